@@ -0,0 +1,81 @@
+#ifndef WSUDO_BENCH_BENCH_H
+#define WSUDO_BENCH_BENCH_H
+
+#include "wsudo/wsudo.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+
+namespace wsudo::bench {
+
+// QueryPerformanceCounter ticks.
+inline int64_t now() {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+inline double ticksToMicros(int64_t ticks) {
+  static const double frequency = [] {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(frequency.QuadPart);
+  }();
+  return static_cast<double>(ticks) * 1e6 / frequency;
+}
+
+// Latency samples for one phase, in microseconds.
+class Samples {
+public:
+  void add(double micros) { _samples.push_back(micros); }
+
+  void merge(const Samples &other) {
+    _samples.insert(_samples.end(), other._samples.begin(),
+                    other._samples.end());
+  }
+
+  size_t count() const { return _samples.size(); }
+
+  // Nearest rank percentile, p in [0, 1]. Sorts the samples.
+  double percentile(double p) {
+    if (_samples.empty()) {
+      return 0;
+    }
+    std::sort(_samples.begin(), _samples.end());
+    auto rank = static_cast<size_t>(p * static_cast<double>(_samples.size()));
+    return _samples[std::min(rank, _samples.size() - 1)];
+  }
+
+  // Print one result line: count, p50, p99, p999 and max.
+  void report(const char *name) {
+    log::print("{:<12} {:>8} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+               name, count(), percentile(0.5), percentile(0.99),
+               percentile(0.999), percentile(1.0));
+  }
+
+  static void reportHeader() {
+    log::print("{:<12} {:>8} {:>10} {:>10} {:>10} {:>10}\n", "phase (us)",
+               "count", "p50", "p99", "p999", "max");
+  }
+
+private:
+  std::vector<double> _samples;
+};
+
+// Times a scope into a Samples.
+class ScopedSample {
+public:
+  explicit ScopedSample(Samples &samples)
+    : _samples{samples}, _start{now()}
+  {}
+  ~ScopedSample() { _samples.add(ticksToMicros(now() - _start)); }
+
+private:
+  Samples &_samples;
+  int64_t _start;
+};
+
+} // namespace wsudo::bench
+
+#endif // WSUDO_BENCH_BENCH_H
@@ -0,0 +1,415 @@
+#include "bench.h"
+#include "wsudo/events.h"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+// Microbenchmarks for the events library, printed as one JSON document so
+// runs before and after a backend or allocator change can be compared by a
+// script:
+//
+//   dispatch         SetEvent to handler run through EventListener::next(),
+//                    per backend, dispatch mode and handler count, with one
+//                    or every handler ready.
+//   churn            emplace() of a handler that finishes, plus the next()
+//                    that removes it, next to a number of idle handlers.
+//   call             EventHandler::operator() on a plain subclass and on an
+//                    EventCallback lambda, against calling the lambda
+//                    directly.
+//   overlapped_io    EventOverlappedIO messages between the two ends of a
+//                    local pipe, per backend and message size.
+//
+// Latencies are nanoseconds per operation, from batches of operations timed
+// together.
+//
+// Usage: bench_events [-r repeats]
+
+using namespace wsudo;
+using namespace wsudo::events;
+
+namespace {
+
+const char *backendName(EventBackend backend) {
+  return backend == EventBackend::CompletionPort ? "completion_port"
+                                                 : "wait_multiple";
+}
+
+const char *dispatchName(EventDispatch dispatch) {
+  return dispatch == EventDispatch::Batched ? "batched" : "single";
+}
+
+// Collects one JSON object per result.
+class Report {
+public:
+  void add(std::string object) { _objects.push_back(std::move(object)); }
+
+  void print() const {
+    log::print("{{\"benchmarks\": [\n");
+    for (size_t i = 0; i < _objects.size(); ++i) {
+      log::print("  {}{}\n", _objects[i],
+                 i + 1 < _objects.size() ? "," : "");
+    }
+    log::print("]}}\n");
+  }
+
+private:
+  std::vector<std::string> _objects;
+};
+
+// JSON members for per operation latencies. Each sample is one batch's
+// average, in microseconds.
+std::string latencyFields(bench::Samples &samples, size_t opsPerSample) {
+  return fmt::format("\"samples\": {}, \"ops_per_sample\": {}, "
+                     "\"min_ns\": {:.1f}, \"p50_ns\": {:.1f}, "
+                     "\"p99_ns\": {:.1f}",
+                     samples.count(), opsPerSample,
+                     samples.percentile(0) * 1000,
+                     samples.percentile(0.5) * 1000,
+                     samples.percentile(0.99) * 1000);
+}
+
+// Time repeats batches of ops calls to op, each sample being one batch's
+// time per unit, where each call does units of work. Returns false if op
+// did.
+template<typename Op>
+bool measure(bench::Samples &samples, unsigned repeats, size_t ops, Op &&op,
+             size_t units = 1)
+{
+  for (unsigned r = 0; r < repeats; ++r) {
+    auto start = bench::now();
+    for (size_t i = 0; i < ops; ++i) {
+      if (!op(i)) {
+        return false;
+      }
+    }
+    samples.add(bench::ticksToMicros(bench::now() - start) /
+                static_cast<double>(ops * units));
+  }
+  return true;
+}
+
+// Run next() until called reaches target.
+bool runUntil(EventListener &listener, const size_t &called, size_t target) {
+  while (called < target) {
+    if (listener.next(5000) == EventStatus::Failed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void benchDispatch(Report &report, EventBackend backend,
+                   EventDispatch dispatch, size_t handlers, bool allReady,
+                   unsigned repeats)
+{
+  EventListener listener{backend, dispatch};
+  size_t called = 0;
+  std::vector<HANDLE> events;
+  for (size_t i = 0; i < handlers; ++i) {
+    auto &handler = listener.emplace(
+      CreateEventW(nullptr, false, false, nullptr),
+      [&called](EventListener &) {
+        ++called;
+        return EventStatus::Ok;
+      }
+    );
+    events.push_back(handler.event());
+  }
+
+  size_t readyPerOp = allReady ? handlers : 1;
+  size_t ops = std::max<size_t>(1, 256 / readyPerOp);
+  auto signalAndRun = [&](size_t i) {
+    if (allReady) {
+      for (auto event : events) {
+        SetEvent(event);
+      }
+    } else {
+      SetEvent(events[i % handlers]);
+    }
+    return runUntil(listener, called, called + readyPerOp);
+  };
+
+  // The first round warms up thread pool waits and the listener's vectors.
+  // Samples are per handler run, so both modes are comparable.
+  bench::Samples samples;
+  bench::Samples warmup;
+  if (!measure(warmup, 1, ops, signalAndRun) ||
+      !measure(samples, repeats, ops, signalAndRun, readyPerOp))
+  {
+    log::eprint("Dispatch benchmark failed ({}, {} handlers).\n",
+                backendName(backend), handlers);
+    return;
+  }
+  report.add(fmt::format("{{\"benchmark\": \"dispatch\", \"backend\": "
+                         "\"{}\", \"dispatch\": \"{}\", \"handlers\": {}, "
+                         "\"ready\": {}, {}}}",
+                         backendName(backend), dispatchName(dispatch),
+                         handlers, readyPerOp,
+                         latencyFields(samples, ops * readyPerOp)));
+}
+
+void benchChurn(Report &report, EventBackend backend, size_t idleHandlers,
+                unsigned repeats)
+{
+  EventListener listener{backend};
+  for (size_t i = 0; i < idleHandlers; ++i) {
+    listener.emplace(CreateEventW(nullptr, false, false, nullptr),
+                     [](EventListener &) { return EventStatus::Ok; });
+  }
+
+  constexpr size_t ops = 64;
+  bench::Samples samples;
+  size_t finished = 0;
+  std::vector<HANDLE> events(ops);
+  for (unsigned r = 0; r < repeats; ++r) {
+    // Creating the events isn't part of what's measured.
+    for (auto &event : events) {
+      event = CreateEventW(nullptr, false, true, nullptr);
+    }
+    auto start = bench::now();
+    for (size_t i = 0; i < ops; ++i) {
+      listener.emplace(events[i], [&finished](EventListener &) {
+        ++finished;
+        return EventStatus::Finished;
+      });
+      if (!runUntil(listener, finished, finished + 1)) {
+        log::eprint("Churn benchmark failed ({}, {} handlers).\n",
+                    backendName(backend), idleHandlers);
+        return;
+      }
+    }
+    samples.add(bench::ticksToMicros(bench::now() - start) / ops);
+  }
+  report.add(fmt::format("{{\"benchmark\": \"churn\", \"backend\": \"{}\", "
+                         "\"idle_handlers\": {}, {}}}",
+                         backendName(backend), idleHandlers,
+                         latencyFields(samples, ops)));
+}
+
+class CountingHandler final : public EventHandler {
+public:
+  HANDLE event() const override { return nullptr; }
+  EventStatus operator()(EventListener &) override {
+    ++count;
+    return EventStatus::Ok;
+  }
+
+  uint64_t count = 0;
+};
+
+void reportCall(Report &report, const char *kind, bench::Samples &samples,
+                size_t ops)
+{
+  report.add(fmt::format("{{\"benchmark\": \"call\", \"kind\": \"{}\", {}}}",
+                         kind, latencyFields(samples, ops)));
+}
+
+void benchCalls(Report &report, unsigned repeats) {
+  constexpr size_t ops = 1 << 20;
+  EventListener listener;
+  uint64_t lambdaCount = 0;
+  auto lambda = [&lambdaCount](EventListener &) {
+    ++lambdaCount;
+    return EventStatus::Ok;
+  };
+
+  // Called through volatile pointers so the compiler can't see which
+  // handler it is and devirtualize the call.
+  CountingHandler counting;
+  EventHandler *volatile virtualTarget = &counting;
+  EventCallback<decltype(lambda)> callback{
+    CreateEventW(nullptr, false, false, nullptr), lambda
+  };
+  EventHandler *volatile callbackTarget = &callback;
+  decltype(lambda) *volatile directTarget = &lambda;
+
+  bench::Samples virtualSamples;
+  measure(virtualSamples, repeats, ops, [&](size_t) {
+    return (*virtualTarget)(listener) == EventStatus::Ok;
+  });
+  reportCall(report, "virtual_handler", virtualSamples, ops);
+
+  bench::Samples callbackSamples;
+  measure(callbackSamples, repeats, ops, [&](size_t) {
+    return (*callbackTarget)(listener) == EventStatus::Ok;
+  });
+  reportCall(report, "event_callback", callbackSamples, ops);
+
+  bench::Samples directSamples;
+  measure(directSamples, repeats, ops, [&](size_t) {
+    return (*directTarget)(listener) == EventStatus::Ok;
+  });
+  reportCall(report, "direct_lambda", directSamples, ops);
+}
+
+// One end of the pipe, writing or reading until it has moved the given
+// number of messages.
+class PipeEnd final : public EventOverlappedIO {
+public:
+  PipeEnd(HANDLE pipe, BufferPool &pool, bool writer, size_t messageSize,
+          unsigned messages) noexcept
+    : EventOverlappedIO{true, pool},
+      _pipe{pipe},
+      _writer{writer},
+      _messages{messages}
+  {
+    if (writer && _buffer.resize(messageSize)) {
+      std::memset(_buffer.data(), 'x', messageSize);
+    }
+  }
+
+  EventStatus operator()(EventListener &listener) override {
+    switch (EventOverlappedIO::operator()(listener)) {
+      case EventStatus::Failed:
+        return EventStatus::Failed;
+      case EventStatus::Ok:
+        return EventStatus::Ok;
+      case EventStatus::Finished:
+        break;
+    }
+    if (_started) {
+      ++_done;
+    }
+    _started = true;
+
+    // Keep going while IO finishes without waiting.
+    while (_done < _messages) {
+      auto status = _writer ? writeFromBuffer() : readToBuffer();
+      if (status != EventStatus::Finished) {
+        return status;
+      }
+      ++_done;
+    }
+    // The writer stays until the reader is done, since closing its end
+    // could drop the last message.
+    return _writer ? EventStatus::Ok : EventStatus::Finished;
+  }
+
+protected:
+  HANDLE fileHandle() const override { return _pipe; }
+
+private:
+  HObject _pipe;
+  bool _writer;
+  unsigned _messages;
+  unsigned _done = 0;
+  bool _started = false;
+};
+
+// Connects the two ends of a message mode pipe with the server's buffer
+// size, so large messages are read and written in chunks.
+bool createPipePair(HANDLE &serverEnd, HANDLE &clientEnd) {
+  auto name = fmt::format(L"\\\\.\\pipe\\wsudo_bench_events_{}",
+                          GetCurrentProcessId());
+  serverEnd = CreateNamedPipeW(name.c_str(),
+                               PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                               PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE,
+                               1, PipeBufferSize, PipeBufferSize, 0, nullptr);
+  if (serverEnd == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  clientEnd = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                          nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED,
+                          nullptr);
+  if (clientEnd == INVALID_HANDLE_VALUE) {
+    CloseHandle(serverEnd);
+    return false;
+  }
+  DWORD mode = PIPE_READMODE_MESSAGE;
+  SetNamedPipeHandleState(clientEnd, &mode, nullptr, nullptr);
+  return true;
+}
+
+void benchOverlappedIO(Report &report, EventBackend backend,
+                       size_t messageSize, unsigned repeats)
+{
+  // About 16 MiB per run, within reason for tiny messages.
+  auto messages = static_cast<unsigned>(
+    std::clamp<size_t>((16 << 20) / messageSize, 64, 16384)
+  );
+  bench::Samples samples;
+  for (unsigned r = 0; r < repeats; ++r) {
+    HANDLE serverEnd;
+    HANDLE clientEnd;
+    if (!createPipePair(serverEnd, clientEnd)) {
+      log::eprint("Couldn't create a pipe pair: {}\n", lastErrorString());
+      return;
+    }
+    BufferPool pool{messageSize};
+    EventListener listener{backend};
+    listener.emplace<PipeEnd>(serverEnd, pool, true, messageSize, messages);
+    listener.emplace<PipeEnd>(clientEnd, pool, false, messageSize, messages);
+
+    auto start = bench::now();
+    while (listener.count() == 2) {
+      if (listener.next(5000) == EventStatus::Failed) {
+        log::eprint("Overlapped IO benchmark failed ({}, {} bytes).\n",
+                    backendName(backend), messageSize);
+        return;
+      }
+    }
+    samples.add(bench::ticksToMicros(bench::now() - start) / messages);
+  }
+
+  auto p50Micros = samples.percentile(0.5);
+  report.add(fmt::format("{{\"benchmark\": \"overlapped_io\", \"backend\": "
+                         "\"{}\", \"message_bytes\": {}, \"messages\": {}, "
+                         "\"mib_per_s\": {:.1f}, {}}}",
+                         backendName(backend), messageSize, messages,
+                         static_cast<double>(messageSize) /
+                           (p50Micros / 1e6) / (1 << 20),
+                         latencyFields(samples, messages)));
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  log::g_outLogger = spdlog::stdout_color_mt("wsudo.out");
+  log::g_outLogger->set_level(spdlog::level::warn);
+  log::g_errLogger = spdlog::stderr_color_mt("wsudo.err");
+  log::g_errLogger->set_level(spdlog::level::warn);
+  WSUDO_SCOPEEXIT { spdlog::drop_all(); };
+
+  unsigned repeats = 20;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-r") && i + 1 < argc) {
+      repeats = std::max(1, std::atoi(argv[++i]));
+    } else {
+      log::eprint("Unknown argument '{}'.\n", argv[i]);
+      return 1;
+    }
+  }
+
+  Report report;
+  for (auto backend : {EventBackend::WaitMultiple,
+                       EventBackend::CompletionPort})
+  {
+    // WaitForMultipleObjects can't take more than MAXIMUM_WAIT_OBJECTS.
+    std::vector<size_t> counts{1, 4, 16, MAXIMUM_WAIT_OBJECTS};
+    if (backend == EventBackend::CompletionPort) {
+      counts.push_back(256);
+      counts.push_back(1024);
+    }
+    for (auto dispatch : {EventDispatch::Single, EventDispatch::Batched}) {
+      for (auto handlers : counts) {
+        benchDispatch(report, backend, dispatch, handlers, false, repeats);
+        benchDispatch(report, backend, dispatch, handlers, true, repeats);
+      }
+    }
+    // Leave room for the handler being added.
+    for (auto handlers : counts) {
+      benchChurn(report, backend, handlers - 1, repeats);
+    }
+    for (size_t size = 64; size <= 256 * 1024; size *= 4) {
+      benchOverlappedIO(report, backend, size, repeats);
+    }
+  }
+  benchCalls(report, repeats);
+
+  report.print();
+  return 0;
+}
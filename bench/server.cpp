@@ -0,0 +1,203 @@
+#include "bench.h"
+#include "wsudo/server.h"
+#include "wsudo/client.h"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+// Drives an in-process TokenServer with simulated clients and reports
+// latency per protocol phase. Credentials come from the WSUSER and
+// WSPASSWORD environment variables, like the logon test.
+//
+// Usage: bench_server [-c clients] [-n requests per client] [-j threads]
+//                     [--no-bless]
+
+using namespace wsudo;
+
+const wchar_t *const BenchPipeName = L"\\\\.\\pipe\\wsudo_bench_pipe";
+
+struct ClientResult {
+  bench::Samples connect;
+  bench::Samples credential;
+  bench::Samples bless;
+  bench::Samples total;
+  unsigned failures = 0;
+};
+
+static std::wstring getEnv(const wchar_t *name) {
+  wchar_t buffer[256];
+  auto length = GetEnvironmentVariableW(name, buffer, 256);
+  if (length == 0 || length >= 256) {
+    return std::wstring{};
+  }
+  return std::wstring{buffer, length};
+}
+
+// A process that stays suspended for the whole run so there is something to
+// bless. Its token can be replaced any number of times before it starts.
+static PROCESS_INFORMATION createBlessTarget() {
+  STARTUPINFOW si{};
+  si.cb = sizeof(STARTUPINFOW);
+  PROCESS_INFORMATION pi{};
+  wchar_t commandLine[] = L"cmd.exe /c exit";
+  if (!CreateProcessW(nullptr, commandLine, nullptr, nullptr, false,
+                      CREATE_SUSPENDED | CREATE_NO_WINDOW, nullptr, nullptr,
+                      &si, &pi))
+  {
+    log::error("Couldn't create bless target: {}", lastErrorString());
+  }
+  return pi;
+}
+
+static void runClient(ClientResult &result, unsigned requests,
+                      std::wstring_view username, std::wstring_view password,
+                      bool doBless)
+{
+  auto target = doBless ? createBlessTarget() : PROCESS_INFORMATION{};
+  WSUDO_SCOPEEXIT {
+    if (target.hProcess) {
+      TerminateProcess(target.hProcess, 1);
+      CloseHandle(target.hThread);
+      CloseHandle(target.hProcess);
+    }
+  };
+  if (doBless && !target.hProcess) {
+    result.failures += requests;
+    return;
+  }
+
+  for (unsigned i = 0; i < requests; ++i) {
+    bench::ScopedSample total{result.total};
+    // Only opening the pipe counts as connecting; the connection lives on for
+    // the other phases.
+    std::optional<ClientConnection> conn;
+    {
+      bench::ScopedSample sample{result.connect};
+      conn.emplace(BenchPipeName);
+    }
+    bool ok = conn->good();
+    if (ok) {
+      {
+        bench::ScopedSample sample{result.credential};
+        ok = conn->negotiate(username, password);
+      }
+      if (ok && doBless) {
+        bench::ScopedSample sample{result.bless};
+        ok = conn->bless(target.hProcess);
+      }
+    }
+    if (!ok) {
+      ++result.failures;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  log::g_outLogger = spdlog::stdout_color_mt("wsudo.out");
+  log::g_outLogger->set_level(spdlog::level::warn);
+  log::g_errLogger = spdlog::stderr_color_mt("wsudo.err");
+  log::g_errLogger->set_level(spdlog::level::warn);
+  WSUDO_SCOPEEXIT { spdlog::drop_all(); };
+
+  unsigned clients = 8;
+  unsigned requests = 200;
+  unsigned threads = 0;
+  bool doBless = true;
+  for (int i = 1; i < argc; ++i) {
+    auto hasValue = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-c") && hasValue) {
+      clients = static_cast<unsigned>(std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "-n") && hasValue) {
+      requests = static_cast<unsigned>(std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "-j") && hasValue) {
+      threads = static_cast<unsigned>(std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--no-bless")) {
+      doBless = false;
+    } else {
+      log::eprint("Unknown argument '{}'.\n", argv[i]);
+      return 1;
+    }
+  }
+
+  auto username = getEnv(L"WSUSER");
+  auto password = getEnv(L"WSPASSWORD");
+  if (username.empty() || password.empty()) {
+    log::eprint("Set WSUSER and WSPASSWORD to the account to log on as.\n");
+    return 1;
+  }
+
+  HANDLE quitEvent = nullptr;
+  server::Config config{BenchPipeName, &quitEvent};
+  config.workerThreads = threads;
+  // Keep enough instances listening that clients don't queue on creation.
+  config.pipePool.minIdle = clients;
+  config.pipePool.maxIdle = clients * 2;
+  std::thread serverThread{&server::serverMain, std::ref(config)};
+  WSUDO_SCOPEEXIT {
+    if (quitEvent) {
+      SetEvent(quitEvent);
+    }
+    serverThread.join();
+  };
+
+  // Wait for the first instance to start listening.
+  for (int attempt = 0; !WaitNamedPipeW(BenchPipeName, 100); ++attempt) {
+    if (attempt == 50 || config.status != server::StatusUnset) {
+      log::eprint("Server didn't start: {}.\n",
+                  server::statusToString(config.status));
+      return 1;
+    }
+    Sleep(10);
+  }
+
+  // Warm up the session cache so the logon isn't counted.
+  {
+    ClientConnection conn{BenchPipeName};
+    if (!conn || !conn.negotiate(username, password)) {
+      log::eprint("Warmup logon failed.\n");
+      return 1;
+    }
+  }
+
+  std::vector<ClientResult> results(clients);
+  std::vector<std::thread> threadsRunning;
+  threadsRunning.reserve(clients);
+  auto start = bench::now();
+  for (unsigned i = 0; i < clients; ++i) {
+    threadsRunning.emplace_back(runClient, std::ref(results[i]), requests,
+                                std::wstring_view{username},
+                                std::wstring_view{password}, doBless);
+  }
+  for (auto &thread : threadsRunning) {
+    thread.join();
+  }
+  auto elapsed = bench::ticksToMicros(bench::now() - start) / 1e6;
+
+  ClientResult total;
+  for (auto &result : results) {
+    total.connect.merge(result.connect);
+    total.credential.merge(result.credential);
+    total.bless.merge(result.bless);
+    total.total.merge(result.total);
+    total.failures += result.failures;
+  }
+
+  auto completed = total.total.count() - total.failures;
+  log::print("{} clients x {} requests in {:.2f} s: {:.0f} requests/s, "
+             "{} failed\n\n", clients, requests, elapsed,
+             static_cast<double>(completed) / elapsed, total.failures);
+  bench::Samples::reportHeader();
+  total.connect.report("connect");
+  total.credential.report("credential");
+  if (doBless) {
+    total.bless.report("bless");
+  }
+  total.total.report("total");
+
+  return total.failures ? 2 : 0;
+}
@@ -0,0 +1,125 @@
+#include "bench.h"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+// Measures end to end wall time of wsudo.exe elevating a short command, from
+// CreateProcess to exit, over many runs. Needs a running TokenServer and a
+// session it already has cached (or a running wsudo --agent) so nothing
+// asks for a password; run wsudo.exe once by hand first.
+//
+// Usage: bench_startup [-n runs] [--budget ms] [--wsudo path] [command]
+//
+// The command defaults to C:\Windows\System32\whoami.exe, and its output is
+// discarded. With --budget, exits with 3 if the median run takes longer.
+
+using namespace wsudo;
+
+// wsudo.exe next to this executable.
+static std::wstring defaultClientPath() {
+  wchar_t path[MAX_PATH];
+  auto length = GetModuleFileNameW(nullptr, path, MAX_PATH);
+  if (length == 0 || length == MAX_PATH) {
+    return L"wsudo.exe";
+  }
+  std::wstring result{path, length};
+  auto slash = result.find_last_of(L'\\');
+  result.erase(slash == std::wstring::npos ? 0 : slash + 1);
+  return result + L"wsudo.exe";
+}
+
+// Run the command line once with every standard handle on NUL. Returns the
+// exit code, or -1 if it couldn't be started.
+static int runOnce(const std::wstring &commandLine, HANDLE nul) {
+  STARTUPINFOW si{};
+  si.cb = sizeof(STARTUPINFOW);
+  si.hStdInput = nul;
+  si.hStdOutput = nul;
+  si.hStdError = nul;
+  si.dwFlags = STARTF_USESTDHANDLES;
+  PROCESS_INFORMATION pi{};
+  std::wstring mutableCommandLine{commandLine};
+  if (!CreateProcessW(nullptr, mutableCommandLine.data(), nullptr, nullptr,
+                      true, 0, nullptr, nullptr, &si, &pi))
+  {
+    log::eprint("Couldn't start wsudo: {}\n", lastErrorString());
+    return -1;
+  }
+  CloseHandle(pi.hThread);
+  HObject process{pi.hProcess};
+  WaitForSingleObject(process, INFINITE);
+  DWORD exitCode;
+  GetExitCodeProcess(process, &exitCode);
+  return static_cast<int>(exitCode);
+}
+
+int main(int argc, char *argv[]) {
+  log::g_outLogger = spdlog::stdout_color_mt("wsudo.out");
+  log::g_outLogger->set_level(spdlog::level::warn);
+  log::g_errLogger = spdlog::stderr_color_mt("wsudo.err");
+  log::g_errLogger->set_level(spdlog::level::warn);
+  WSUDO_SCOPEEXIT { spdlog::drop_all(); };
+
+  unsigned runs = 100;
+  double budgetMs = 0;
+  std::wstring client = defaultClientPath();
+  std::wstring command = L"C:\\Windows\\System32\\whoami.exe";
+  for (int i = 1; i < argc; ++i) {
+    auto hasValue = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-n") && hasValue) {
+      runs = static_cast<unsigned>(std::atoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--budget") && hasValue) {
+      budgetMs = std::atof(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--wsudo") && hasValue) {
+      client = to_utf16(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      command = to_utf16(argv[i]);
+    } else {
+      log::eprint("Unknown argument '{}'.\n", argv[i]);
+      return 1;
+    }
+  }
+
+  SECURITY_ATTRIBUTES inherit{sizeof(SECURITY_ATTRIBUTES), nullptr, true};
+  HANDLE nulHandle = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE, &inherit,
+                                 OPEN_EXISTING, 0, nullptr);
+  if (nulHandle == INVALID_HANDLE_VALUE) {
+    log::eprint("Couldn't open NUL: {}\n", lastErrorString());
+    return 1;
+  }
+  HObject nul{nulHandle};
+  auto commandLine = L"\"" + client + L"\" \"" + command + L"\"";
+
+  // The first run pages the binaries in and may fill the command cache.
+  if (int exitCode = runOnce(commandLine, nul); exitCode != 0) {
+    log::eprint("Warmup run exited with {}; is the server running with a "
+                "cached session?\n", exitCode);
+    return 1;
+  }
+
+  bench::Samples samples;
+  unsigned failures = 0;
+  for (unsigned i = 0; i < runs; ++i) {
+    auto start = bench::now();
+    auto exitCode = runOnce(commandLine, nul);
+    samples.add(bench::ticksToMicros(bench::now() - start));
+    if (exitCode != 0) {
+      ++failures;
+    }
+  }
+
+  log::print("{} runs, {} failed\n\n", runs, failures);
+  bench::Samples::reportHeader();
+  samples.report("startup");
+
+  auto medianMs = samples.percentile(0.5) / 1000;
+  if (budgetMs > 0 && medianMs > budgetMs) {
+    log::eprint("Median {:.2f} ms is over the {:.2f} ms budget.\n", medianMs,
+                budgetMs);
+    return 3;
+  }
+  return failures ? 2 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef WSUDO_AGENT_H
+#define WSUDO_AGENT_H
+
+#include "wsudo.h"
+#include "client.h"
+
+#include <string>
+#include <vector>
+
+// A long lived client that holds one authenticated connection to the server
+// and blesses processes for the user's other wsudo invocations. Callers talk
+// to it with BLES messages on a pipe private to their logon session, and get
+// the same SUCC response the server would send.
+namespace wsudo::agent {
+
+// Name of the agent pipe for the current logon session, or empty if it
+// couldn't be determined.
+std::wstring pipeName();
+
+// Ask a running agent to bless processes. Returns false if no agent is
+// running or it couldn't bless them, in which case the caller should ask the
+// server itself.
+bool bless(const std::vector<HANDLE> &processes, std::vector<DWORD> &statuses);
+
+// Serve bless requests over conn, which must already be authenticated as
+// username. Returns a ClientExitCode when the agent stops, which happens
+// when its server session expires.
+int serve(ClientConnection &conn, const std::wstring &username);
+
+} // namespace wsudo::agent
+
+#endif // WSUDO_AGENT_H
@@ -0,0 +1,95 @@
+#ifndef WSUDO_BUFFERPOOL_H
+#define WSUDO_BUFFERPOOL_H
+
+#include "wsudo.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace wsudo::events {
+
+// Pool of IO buffers in power of two size classes, from PipeBufferSize up to
+// the smallest class that holds the maximum message size. Free buffers are
+// kept on one interlocked SList per class, so taking and returning them is
+// lock free. All functions are thread safe.
+class BufferPool {
+  struct Block;
+
+public:
+  // Smallest buffer handed out.
+  static constexpr size_t MinBufferSize = PipeBufferSize;
+
+  explicit BufferPool(size_t maxMessageSize = DefaultMaxMessageSize) noexcept;
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // Largest message a buffer from this pool may hold.
+  size_t maxMessageSize() const { return _maxMessageSize; }
+
+  // Number of blocks allocated from the heap so far. Once the pool is warm,
+  // this should stop growing.
+  size_t allocations() const { return _allocations.load(); }
+
+private:
+  friend class IOBuffer;
+
+  // Free blocks kept per class. Blocks past this go back to the heap, so a
+  // burst of clients doesn't pin its peak memory forever.
+  static constexpr unsigned MaxCachedPerClass = 64;
+  static constexpr unsigned MaxClasses = 16;
+
+  size_t _maxMessageSize;
+  unsigned _classCount;
+  std::array<SLIST_HEADER, MaxClasses> _freeLists;
+  std::atomic<size_t> _allocations{0};
+
+  // Returns a block that can hold at least size bytes, or null if size is
+  // over the maximum message size.
+  Block *take(size_t size);
+  void give(Block *block);
+};
+
+// Growable buffer whose storage comes from a BufferPool. It holds no memory
+// until it is first resized, and gives its block back on release().
+class IOBuffer {
+public:
+  explicit IOBuffer(BufferPool &pool) noexcept
+    : _pool{&pool}
+  {}
+  ~IOBuffer() { release(); }
+
+  IOBuffer(const IOBuffer &) = delete;
+  IOBuffer &operator=(const IOBuffer &) = delete;
+
+  uint8_t *data();
+  const uint8_t *data() const;
+  size_t size() const { return _size; }
+  size_t capacity() const;
+  bool empty() const { return _size == 0; }
+
+  // Make room for at least capacity bytes, moving to a larger block if
+  // needed. Returns false if that is over the pool's maximum message size;
+  // the contents are unchanged either way.
+  bool reserve(size_t capacity);
+
+  // Set the size, reserving space first. Returns false on the same
+  // conditions as reserve().
+  bool resize(size_t size);
+
+  // Give the block back to the pool.
+  void release();
+
+  BufferPool &pool() const { return *_pool; }
+
+private:
+  BufferPool *_pool;
+  BufferPool::Block *_block = nullptr;
+  size_t _size = 0;
+};
+
+} // namespace wsudo::events
+
+#endif // WSUDO_BUFFERPOOL_H
@@ -2,8 +2,10 @@
 #define WSUDO_CLIENT_H
 
 #include "wsudo.h"
+#include "metrics.h"
 
 #include <vector>
+#include <string_view>
 
 namespace wsudo {
 
@@ -46,20 +48,36 @@ class ClientConnection {
 
   constexpr static int MaxConnectAttempts = 3;
 
-  void connect(
-    LPSECURITY_ATTRIBUTES secAttr,
-    const wchar_t *pipeName,
-    int attempts
-  );
+  void connect(const wchar_t *pipeName, int attempts, DWORD flags);
+
+  // Write the message in _buffer and read the response into it.
+  bool transact(const char *name);
 
 public:
-  explicit ClientConnection(const wchar_t *pipeName);
+  // Tries to connect up to attempts times while every pipe instance is busy,
+  // waiting for a free one in between. Fails right away if the pipe doesn't
+  // exist. Flags are passed to CreateFileW.
+  explicit ClientConnection(const wchar_t *pipeName,
+                            int attempts = MaxConnectAttempts,
+                            DWORD flags = 0);
 
   bool good() const { return !!_pipe; }
   explicit operator bool() const { return good(); }
 
-  bool negotiate(const char *credentials, size_t length);
+  // Returns true if the server has a live session for this user, so no
+  // credentials are needed before bless().
+  bool querySession(std::wstring_view username);
+  bool negotiate(std::wstring_view username, std::wstring_view password);
   bool bless(HANDLE process);
+  // Bless up to msg::MaxBlessHandles processes in one round trip. On success
+  // statuses holds a Win32 error code for each process.
+  bool bless(const std::vector<HANDLE> &processes,
+             std::vector<DWORD> &statuses);
+  // Send credentials and the process to bless in a single round trip.
+  bool negotiateAndBless(std::wstring_view username,
+                         std::wstring_view password, HANDLE process);
+  // Fetch server statistics. The server only answers administrators.
+  bool queryStats(metrics::StatsSnapshot &stats);
 
   bool readServerMessage();
 };
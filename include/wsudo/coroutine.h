@@ -0,0 +1,175 @@
+#ifndef WSUDO_COROUTINE_H
+#define WSUDO_COROUTINE_H
+
+#include "events.h"
+
+// Coroutine event handlers need C++20; configure with -DWSUDO_COROUTINES=ON.
+#if WSUDO_COROUTINES
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+namespace wsudo::events {
+
+class EventCoroutineHandler;
+
+// Bump allocator for one handler's coroutine frames. Space is reclaimed all
+// at once when no frames are live; frames that don't fit go on the heap.
+class CoroutineArena {
+public:
+  static constexpr size_t Size = 1024;
+
+  CoroutineArena() = default;
+  CoroutineArena(const CoroutineArena &) = delete;
+  CoroutineArena &operator=(const CoroutineArena &) = delete;
+
+  // Returns null if there isn't room.
+  void *allocate(size_t size) noexcept;
+  void deallocate(void *block) noexcept;
+
+private:
+  alignas(std::max_align_t) std::byte _storage[Size];
+  size_t _top = 0;
+  unsigned _live = 0;
+};
+
+// Return type of EventCoroutineHandler::run(). The coroutine starts
+// suspended, and the status it co_returns goes to the listener like a
+// handler's return value.
+class EventTask {
+public:
+  struct promise_type {
+    EventStatus status = EventStatus::Failed;
+
+    EventTask get_return_object() noexcept {
+      return EventTask{
+        std::coroutine_handle<promise_type>::from_promise(*this)
+      };
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(EventStatus result) noexcept { status = result; }
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    // Member coroutines of a handler keep their frame in its arena.
+    template<
+      typename Self,
+      typename... Args,
+      typename = std::enable_if_t<
+                   std::is_base_of_v<EventCoroutineHandler, Self>
+                 >
+    >
+    static void *operator new(size_t size, Self &self, Args &...) {
+      return allocateFrame(size, &self.coroutineArena());
+    }
+    static void *operator new(size_t size) {
+      return allocateFrame(size, nullptr);
+    }
+    static void operator delete(void *frame, size_t size) noexcept;
+
+  private:
+    static void *allocateFrame(size_t size, CoroutineArena *arena);
+  };
+
+  EventTask() noexcept = default;
+  EventTask(EventTask &&other) noexcept
+    : _handle{std::exchange(other._handle, nullptr)}
+  {}
+  EventTask &operator=(EventTask &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+  ~EventTask() { destroy(); }
+
+  explicit operator bool() const { return !!_handle; }
+  bool done() const { return _handle.done(); }
+  void resume() { _handle.resume(); }
+  // The co_returned status, once done() is true.
+  EventStatus status() const { return _handle.promise().status; }
+
+private:
+  std::coroutine_handle<promise_type> _handle{};
+
+  explicit EventTask(std::coroutine_handle<promise_type> handle) noexcept
+    : _handle{handle}
+  {}
+
+  void destroy() {
+    if (_handle) {
+      _handle.destroy();
+      _handle = nullptr;
+    }
+  }
+};
+
+// Awaits IO started by EventCoroutineHandler. IO that finishes right away
+// doesn't suspend; otherwise the coroutine resumes when the listener runs
+// the handler for its completion. Resumes with Finished or Failed.
+class IOAwaiter {
+public:
+  explicit IOAwaiter(EventStatus &status) noexcept : _status{status} {}
+
+  bool await_ready() const noexcept { return _status != EventStatus::Ok; }
+  void await_suspend(std::coroutine_handle<>) const noexcept {}
+  EventStatus await_resume() const noexcept { return _status; }
+
+private:
+  EventStatus &_status;
+};
+
+// Event handler written as a coroutine. run() is started the first time the
+// handler is signaled and whenever it is signaled after a reset, and can
+// co_await connect(), read() and write() in sequence instead of chaining
+// callbacks.
+class EventCoroutineHandler : public EventOverlappedIO {
+public:
+  using EventOverlappedIO::EventOverlappedIO;
+
+  // Destroys a suspended coroutine so the next event starts run() over.
+  // Like EventOverlappedIO::reset(), this returns false; subclasses that
+  // can be reused override it, call this, and return true.
+  bool reset() override;
+
+  EventStatus operator()(EventListener &listener) override;
+
+  CoroutineArena &coroutineArena() { return _arena; }
+
+protected:
+  // The handler body.
+  virtual EventTask run() = 0;
+
+  // Wait for a client on fileHandle(), which must be a named pipe.
+  IOAwaiter connect();
+  // Read a message into _buffer.
+  IOAwaiter read() {
+    _ioStatus = readToBuffer();
+    return IOAwaiter{_ioStatus};
+  }
+  // Write all of _buffer.
+  IOAwaiter write() {
+    _ioStatus = writeFromBuffer();
+    return IOAwaiter{_ioStatus};
+  }
+
+private:
+  // Declared before _task, which frees its frame into the arena when it's
+  // destroyed.
+  CoroutineArena _arena{};
+  EventTask _task{};
+  // Result of the IO being awaited.
+  EventStatus _ioStatus = EventStatus::Ok;
+  // Set while a connect is pending. EventOverlappedIO doesn't track those.
+  bool _connecting = false;
+};
+
+} // namespace wsudo::events
+
+#endif // WSUDO_COROUTINES
+
+#endif // WSUDO_COROUTINE_H
@@ -2,17 +2,46 @@
 #define WSUDO_EVENTS_H
 
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <utility>
 #include <cstdint>
 
 #include "wsudo.h"
+#include "timerwheel.h"
+#include "bufferpool.h"
 
 /**
  * Windows Event Server/Client
- * Uses WaitForMultipleObjects to execute callbacks on event completion.
+ * Uses WaitForMultipleObjects or an IO completion port to execute callbacks
+ * on event completion.
  */
 
 namespace wsudo::events {
 
+// Selects how an EventListener waits for its handlers.
+enum class EventBackend {
+  // WaitForMultipleObjects on every handler's event. Limited to
+  // MAXIMUM_WAIT_OBJECTS handlers, and the wait scans all of them.
+  WaitMultiple,
+  // IO completion port. Overlapped IO is posted directly to the handler that
+  // started it; plain events are forwarded to the port by the thread pool.
+  CompletionPort,
+};
+
+// Selects how much an EventListener handles each time it wakes up.
+enum class EventDispatch {
+  // Run one ready handler per call to next().
+  Single,
+  // Run every handler that is ready when next() wakes up. WaitMultiple
+  // starts each wait just past the handler that woke the previous one, so
+  // handlers early in the list can't starve the rest. CompletionPort
+  // dequeues several packets per call.
+  Batched,
+};
+
 // Status codes for the listener to manage individual handlers.
 enum class EventStatus {
   // The event completed its work for this step.
@@ -25,6 +54,12 @@ enum class EventStatus {
 
 class EventListener;
 
+// Identifies a handler within its listener. The low half is a slot index and
+// the high half counts how many times that slot has been reused, so an ID
+// for a removed handler doesn't match its slot's next occupant. 0 is never a
+// valid ID.
+using HandlerId = ULONG_PTR;
+
 // A waitable event based on Windows timers.
 // The callback in operator() is triggered when the event is signaled.
 class EventHandler {
@@ -45,8 +80,27 @@ public:
   // does nothing and returns false.
   virtual bool reset();
 
+  // Optional - called when the listener uses a completion port. Return true
+  // if this handler's overlapped IO will be posted to the port with the given
+  // key, in which case event() is only used to wake the handler manually. The
+  // default implementation does nothing and returns false.
+  virtual bool bindCompletionPort(HANDLE port, ULONG_PTR key);
+
   // Event handler implementation.
   virtual EventStatus operator()(EventListener &) = 0;
+
+  // Optional - called when a timer armed with EventListener::setTimeout
+  // expires. The status is handled the same as operator(). The default
+  // implementation does nothing and returns Ok.
+  virtual EventStatus timeout(EventListener &, TimerId id);
+
+  // Identifies this handler within its listener. Set when the handler is
+  // added and stable until it is removed. This is also the completion key.
+  HandlerId key() const { return _key; }
+
+private:
+  friend class EventListener;
+  HandlerId _key = 0;
 };
 
 // Lambda wrapper event handler.
@@ -93,7 +147,9 @@ public:
   EventOverlappedIO() = delete;
   /// @param isEventSet Should action be taken immediately (true), or should we
   /// wait until the event is triggered another way (false)?
-  explicit EventOverlappedIO(bool isEventSet) noexcept;
+  /// @param bufferPool Where the IO buffer comes from. It is taken when a read
+  /// starts and given back on reset().
+  EventOverlappedIO(bool isEventSet, BufferPool &bufferPool) noexcept;
   ~EventOverlappedIO();
 
   // This class is not copyable or movable because the embedded
@@ -107,19 +163,28 @@ public:
 
   // Returns false, but succeeds. Subclasses can override this to reset their
   // own state and return true. If this is overridden, a subclass must call
-  // EventOverlappedIO::reset().
+  // EventOverlappedIO::reset(). This releases the IO buffer.
   bool reset() override;
 
-  // Returns the overlapped trigger event.
-  HANDLE event() const override { return _overlapped.hEvent; }
+  // Returns the overlapped trigger event. Signal this to run the handler
+  // without any IO completing.
+  HANDLE event() const override { return _event; }
+
+  // Associates the file handle with the port. After this, completions no
+  // longer signal event().
+  bool bindCompletionPort(HANDLE port, ULONG_PTR key) override;
 
   // Subclasses should call this first to handle chunked reading/writing.
   // Returns EventStatus::Finished when reading/writing is done.
   EventStatus operator()(EventListener &) override;
 
+  // Bytes moved by every EventOverlappedIO in this process.
+  static uint64_t totalBytesRead();
+  static uint64_t totalBytesWritten();
+
 protected:
   OVERLAPPED _overlapped{};
-  std::vector<uint8_t> _buffer{};
+  IOBuffer _buffer;
 
   // Subclasses should return an overlapped readable/writable handle here.
   virtual HANDLE fileHandle() const = 0;
@@ -133,6 +198,10 @@ protected:
   EventStatus writeFromBuffer() { _offset = 0; return beginWrite(); }
 
 private:
+  // Wakeup event. This is also the overlapped event unless the handler is
+  // bound to a completion port.
+  HANDLE _event;
+
   // Position in buffer to begin reading or writing, depending on IO state.
   size_t _offset = 0;
 
@@ -148,11 +217,6 @@ private:
     Failed,
   } _ioState{IOState::Inactive};
 
-  const size_t BufferDoublingLimit = 4;
-
-  // Max amount to read/write at once.
-  const DWORD ChunkSize = static_cast<DWORD>(PipeBufferSize);
-
   // Begins an overlapped read operation.
   EventStatus beginRead();
   // Finishes an overlapped read operation. Not all the data may be read at
@@ -166,17 +230,24 @@ private:
 };
 
 // Manages a set of event handlers.
+// With the CompletionPort backend, run() can use several worker threads. Any
+// idle worker takes the next ready handler from the port, and a handler's
+// steps never run on two workers at once.
 class EventListener final {
 public:
-  explicit EventListener() = default;
+  explicit EventListener(EventBackend backend = EventBackend::WaitMultiple,
+                         EventDispatch dispatch = EventDispatch::Single);
+  ~EventListener();
 
   EventListener(const EventListener &) = delete;
   EventListener &operator=(const EventListener &) = delete;
 
-  EventListener(EventListener &&) = default;
-  EventListener &operator=(EventListener &&) = default;
+  // Not movable because wait callbacks and workers point back to it.
+  EventListener(EventListener &&) = delete;
+  EventListener &operator=(EventListener &&) = delete;
 
-  // Construct a handler in place.
+  // Construct a handler in place. This is safe to call from inside a handler
+  // on any worker.
   template<typename H, typename... Args>
   std::enable_if_t<
     std::conjunction_v<
@@ -186,11 +257,9 @@ public:
     H &
   >
   emplace(Args &&...args) {
-    auto &handler = static_cast<H &>(
-      *_handlers.emplace_back(std::make_unique<H>(std::forward<Args>(args)...))
+    return static_cast<H &>(
+      add(std::make_unique<H>(std::forward<Args>(args)...))
     );
-    _events.emplace_back(handler.event());
-    return handler;
   }
 
   // Add a function object or lambda event handler with a custom event object.
@@ -206,27 +275,166 @@ public:
   EventStatus next(DWORD timeout = INFINITE);
 
   // Run the event loop until a quit is triggered. Returns Finished or Failed.
-  EventStatus run(DWORD timeout = INFINITE);
+  // With the CompletionPort backend, threads > 1 runs that many workers
+  // (including the calling thread); otherwise it is ignored.
+  EventStatus run(DWORD timeout = INFINITE, unsigned threads = 1);
 
   // Return the number of events in the queue.
   size_t count() const {
-    assert(_events.size() == _handlers.size());
+    std::shared_lock<std::shared_mutex> lock{_mutex};
+    assert(_events.size() == _dense.size());
     return _events.size();
   }
 
+  // True if id belongs to a handler that hasn't been removed.
+  bool contains(HandlerId id) const;
+
+  // Set the handler's event so it runs without any IO completing. Safe to
+  // call from any thread. Returns false if the handler is gone.
+  bool wake(HandlerId id);
+
+  // Call handler.timeout() after ms milliseconds, unless the timer is
+  // canceled first. Timeouts for a handler are serialized with its other
+  // events. Safe to call from any worker.
+  TimerId setTimeout(EventHandler &handler, DWORD ms);
+
+  // Returns true if the timer was canceled before it fired.
+  bool cancelTimeout(TimerId id);
+
   bool isRunning() const { return _running; }
-  void stop() { _running = false; }
+  void stop();
+
+  EventBackend backend() const { return _backend; }
+  EventDispatch dispatchMode() const { return _dispatch; }
 
 private:
-  // List of events to pass to WaitForMultipleObjects.
+  // Completion port registration for one handler.
+  struct PortEntry {
+    HANDLE port;
+    EventHandler *handler;
+    ULONG_PTR key;
+    // Thread pool wait that posts a packet when handler->event() is set.
+    HANDLE wait = nullptr;
+
+    // Guards the fields below, and wait after the entry is attached.
+    std::mutex mutex{};
+    // Set while a worker is running the handler.
+    bool running = false;
+    // Set when the handler is gone; stale packets are then ignored.
+    bool removed = false;
+    // Packets that arrived while another worker was running the handler.
+    // The running worker handles them before letting go.
+    unsigned pendingIO = 0;
+    unsigned pendingWakes = 0;
+    std::vector<TimerId> pendingTimeouts{};
+  };
+
+  // What woke a completion port handler.
+  enum class Packet {
+    IO,
+    Wake,
+    Timeout,
+  };
+
+  // Handler storage. A slot either holds a handler or is on the free list.
+  struct Slot {
+    std::unique_ptr<EventHandler> handler{};
+    // Completion port registration, for the CompletionPort backend.
+    std::shared_ptr<PortEntry> portEntry{};
+    // Incremented when the slot is freed; part of the handler's ID.
+    uint32_t generation = 1;
+    // Index into _events while occupied, or the next free slot.
+    uint32_t dense = Nil;
+  };
+
+  static constexpr uint32_t Nil = UINT32_MAX;
+  static constexpr unsigned IdIndexBits = sizeof(HandlerId) * 4;
+  static constexpr HandlerId IdIndexMask = (HandlerId{1} << IdIndexBits) - 1;
+
+  static HandlerId makeId(uint32_t index, uint32_t generation) {
+    return (static_cast<HandlerId>(generation) << IdIndexBits) | index;
+  }
+
+  // Most completion packets a worker takes at once. Kept small so one worker
+  // doesn't sit on packets that idle workers could be running.
+  static constexpr ULONG PortBatchSize = 8;
+
+  EventBackend _backend;
+  EventDispatch _dispatch;
+  // Guards the handler lists. Handlers are never run with this held.
+  mutable std::shared_mutex _mutex;
+  // Handlers by slot index. Slots are reused, but IDs aren't.
+  std::vector<Slot> _slots;
+  // Head of the free slot list.
+  uint32_t _freeSlot = Nil;
+  // Events to pass to WaitForMultipleObjects, packed with no gaps: _events[i]
+  // belongs to the handler in slot _dense[i].
   std::vector<HANDLE> _events;
-  // List of handlers, must be kept in sync with the event list.
-  std::vector<std::unique_ptr<EventHandler>> _handlers;
+  std::vector<uint32_t> _dense;
+  // Batched WaitMultiple state: where in _events the next wait starts, the
+  // rotated copy of _events it waits on, and the handlers found ready, with
+  // whether each was an abandoned mutex.
+  size_t _rotation = 0;
+  std::vector<HANDLE> _waitOrder;
+  std::vector<std::pair<HandlerId, bool>> _ready;
   // Active flag.
-  bool _running;
-
-  // Remove an event handler from the list.
-  void remove(size_t index);
+  std::atomic<bool> _running = false;
+  // Number of threads currently in run().
+  std::atomic<unsigned> _workers = 0;
+
+  // Completion port, only used by the CompletionPort backend. Completion
+  // keys are handler IDs, so packets that arrive after their handler is
+  // removed are dropped. Key 0 is a wakeup for the workers themselves.
+  HObject _port;
+
+  // Handler deadlines.
+  std::mutex _timerMutex;
+  TimerWheel _timers;
+
+  EventHandler &add(std::unique_ptr<EventHandler> handler);
+  // Returns the slot holding a live handler with this ID, or null. Callers
+  // must hold _mutex.
+  Slot *slotFor(HandlerId id);
+  const Slot *slotFor(HandlerId id) const;
+  // Returns the port entry for a live handler, or null.
+  std::shared_ptr<PortEntry> portEntry(HandlerId id);
+
+  EventStatus nextWaitMultiple(DWORD timeout);
+  EventStatus nextWaitMultipleBatched(DWORD timeout);
+  EventStatus nextCompletion(DWORD timeout);
+  EventStatus nextCompletionBatched(DWORD timeout);
+  // Worker loop for run().
+  EventStatus runWorker(DWORD timeout);
+
+  // Runs a handler and applies its status. Returns false if the handler
+  // should be removed.
+  bool dispatch(EventHandler &handler);
+  // Applies a handler's status. Returns false if it should be removed.
+  bool apply(EventHandler &handler, EventStatus status);
+  // Runs a completion port handler, or queues the packet for the worker that
+  // is already running it.
+  void dispatchEntry(PortEntry &entry, Packet packet, TimerId timer = 0);
+
+  // Shorten a wait timeout so it ends at the next timer deadline. Sets
+  // shortened if the result is earlier than timeout.
+  DWORD waitTimeout(DWORD timeout, bool &shortened);
+  // Run the timeout of every handler whose timer expired.
+  void runTimers();
+
+  // Register a new handler with the completion port.
+  void attach(Slot &slot);
+  // Queue a packet the next time the entry's event is signaled.
+  bool armWait(PortEntry &entry);
+  static void CALLBACK waitCallback(PVOID context, BOOLEAN timedOut);
+  // Wake every worker blocked on the port so it checks _running again.
+  void wakeWorkers();
+
+  // Remove an event handler from the list. The last handler in _events moves
+  // into its place. The handler is destroyed after _mutex is released.
+  void remove(HandlerId id);
+  // Requires _mutex exclusively. Returns the handler for the caller to
+  // destroy once it unlocks, or null if it wasn't in the list.
+  [[nodiscard]] std::unique_ptr<EventHandler> removeLocked(HandlerId id);
 };
 
 } // namespace wsudo::events
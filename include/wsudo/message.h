@@ -0,0 +1,95 @@
+#ifndef WSUDO_MESSAGE_H
+#define WSUDO_MESSAGE_H
+
+#include "wsudo.h"
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace wsudo::msg {
+
+// Client requests are framed as a fixed header followed by the fields for
+// that message type:
+//
+//   char     type[4]    One of the msg::client headers.
+//   uint16_t version    FrameVersion.
+//   uint16_t reserved   Always 0.
+//   uint32_t length     Size of the fields in bytes.
+//
+// A string field is a uint32_t count of UTF-16 code units, then the
+// characters and a terminating NUL, so it can be used in place as a C string.
+// A handle field is a uint64_t so 32 and 64 bit processes agree on the
+// layout. Every field is a multiple of 2 bytes, which keeps strings aligned.
+//
+// QSES is the username, CRED is username and password, BLES is one or more
+// process handles, CRBL is the process handle, username and password, and
+// STAT has no fields.
+//
+// SUCC in response to BLES is followed by a uint32_t Win32 error code for
+// each handle, in order; ERROR_SUCCESS means that process was blessed.
+// Other responses may be followed by a UTF-8 message for the user, e.g. a
+// DENY for a client throttled after failed logons says when to try again.
+
+constexpr uint16_t FrameVersion = 1;
+
+// Most handles one BLES message can carry.
+constexpr size_t MaxBlessHandles = 64;
+
+struct FrameHeader {
+  char type[4];
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t length;
+};
+static_assert(sizeof(FrameHeader) == 12, "FrameHeader must not be padded");
+
+// Builds a frame in a buffer, replacing its contents.
+class FrameWriter {
+public:
+  FrameWriter(std::vector<char> &buffer, const char *type);
+
+  FrameWriter &string(std::wstring_view value);
+  FrameWriter &handle(HANDLE value);
+
+  // Fill in the field length. Returns the size of the whole frame.
+  size_t finish();
+
+private:
+  std::vector<char> &_buffer;
+
+  void append(const void *data, size_t size);
+};
+
+// Reads the fields of a received frame without copying them. Strings point
+// into the frame's buffer, which must outlive them and be 2 byte aligned.
+class FrameReader {
+public:
+  FrameReader(const void *data, size_t size) noexcept;
+
+  // False if the header is short, the version is unknown, or the length
+  // doesn't match the size of the frame.
+  bool valid() const { return _valid; }
+  explicit operator bool() const { return valid(); }
+
+  // Check the message type against one of the msg::client headers.
+  bool is(const char *type) const;
+
+  // Each of these returns false if the next field is missing or malformed.
+  // Strings with embedded NULs are rejected.
+  bool string(std::wstring_view &value);
+  bool handle(HANDLE &value);
+
+  // True when every field has been read.
+  bool atEnd() const { return _cursor == _end; }
+
+private:
+  FrameHeader _header{};
+  const uint8_t *_cursor = nullptr;
+  const uint8_t *_end = nullptr;
+  bool _valid = false;
+};
+
+} // namespace wsudo::msg
+
+#endif // WSUDO_MESSAGE_H
@@ -0,0 +1,126 @@
+#ifndef WSUDO_METRICS_H
+#define WSUDO_METRICS_H
+
+#include "wsudo.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Latency of each step of a client request. Every span is added to a per
+// phase histogram, and while a trace session has the provider enabled, also
+// written as an ETW event:
+//
+//   Provider: wsudo.TokenServer {5b91d2a9-c16c-445e-9124-0db0f2e6e4c5}
+//   Event:    Phase (Phase: string, Micros: uint64, Client: int32)
+//
+// e.g. `tracelog -start wsudo -guid #5b91d2a9-c16c-445e-9124-0db0f2e6e4c5`.
+
+namespace wsudo::metrics {
+
+enum class Phase : unsigned {
+  // Waiting for a client on a listening pipe instance.
+  Connect,
+  // Reading one message.
+  Read,
+  // Dispatching one message, including the phases below.
+  Dispatch,
+  // LogonUserExW for a new session.
+  Logon,
+  // Opening the client process and duplicating its handle.
+  OpenProcess,
+  // DuplicateTokenEx for a new primary token.
+  DuplicateToken,
+  // NtSetInformationProcess.
+  SetToken,
+  // Writing the response.
+  Write,
+};
+
+constexpr unsigned PhaseCount = static_cast<unsigned>(Phase::Write) + 1;
+
+inline const char *phaseName(Phase phase) {
+  switch (phase) {
+  default: return "unknown";
+  case Phase::Connect: return "connect";
+  case Phase::Read: return "read";
+  case Phase::Dispatch: return "dispatch";
+  case Phase::Logon: return "logon";
+  case Phase::OpenProcess: return "open process";
+  case Phase::DuplicateToken: return "duplicate token";
+  case Phase::SetToken: return "set token";
+  case Phase::Write: return "write";
+  }
+}
+
+// Bucket i counts spans that took [2^(i-1), 2^i) microseconds; bucket 0 is
+// under a microsecond and the last bucket has everything past it.
+constexpr unsigned BucketCount = 32;
+
+struct HistogramSnapshot {
+  uint64_t count;
+  uint64_t totalMicros;
+  uint64_t maxMicros;
+  std::array<uint64_t, BucketCount> buckets;
+};
+
+// Body of the response to a STAT message, after the SUCC header. Bump
+// StatsVersion when the layout changes.
+constexpr uint32_t StatsVersion = 1;
+
+struct StatsSnapshot {
+  uint32_t version;
+  // Handlers registered with the event listener.
+  uint32_t handlers;
+  // Named pipe instances, and how many are waiting for a client.
+  uint32_t pipeInstances;
+  uint32_t pipeIdle;
+  // Session cache.
+  uint64_t sessions;
+  uint64_t sessionHits;
+  uint64_t sessionMisses;
+  uint64_t sessionEvictions;
+  // Bytes moved by overlapped IO.
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  std::array<HistogramSnapshot, PhaseCount> phases;
+};
+
+// Copy a phase's histogram. Counters are read individually, so a snapshot
+// taken while spans are recorded may be off by those spans.
+HistogramSnapshot snapshot(Phase phase);
+
+// QueryPerformanceCounter ticks.
+inline int64_t now() {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart;
+}
+
+// Add a span that started at `start` ticks and ends now.
+void record(Phase phase, int64_t start, int clientId = -1);
+
+// Times a scope.
+class Span {
+public:
+  explicit Span(Phase phase, int clientId = -1) noexcept
+    : _phase{phase}, _clientId{clientId}, _start{now()}
+  {}
+  ~Span() { record(_phase, _start, _clientId); }
+
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+private:
+  Phase _phase;
+  int _clientId;
+  int64_t _start;
+};
+
+// Register and unregister the ETW provider. Histograms work either way.
+void registerProvider();
+void unregisterProvider();
+
+} // namespace wsudo::metrics
+
+#endif // WSUDO_METRICS_H
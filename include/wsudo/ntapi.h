@@ -26,6 +26,29 @@ typedef NTSTATUS (WINAPI *NtSetInformationProcess_t)(
     HANDLE, PROCESSINFOCLASS, PVOID, ULONG
 );
 
+// Every ntdll function wsudo calls. Add new functions here along with their
+// _t typedef above.
+#define WSUDO_NT_API_FUNCTIONS(X) \
+  X(RtlNtStatusToDosError)        \
+  X(NtQueryInformationProcess)    \
+  X(NtSetInformationProcess)
+
+// Resolved ntdll entry points. A null pointer means the function isn't
+// available on this system.
+struct Api {
+#define WSUDO_NT_API_MEMBER(name) name##_t name = nullptr;
+  WSUDO_NT_API_FUNCTIONS(WSUDO_NT_API_MEMBER)
+#undef WSUDO_NT_API_MEMBER
+};
+
+// Resolve the API table. Only the first call does any work, so this is cheap
+// to call from every entry point that needs the table. Returns false if any
+// function is missing; each one is logged.
+bool loadApi();
+
+// The table filled in by loadApi(). Empty until then.
+extern Api g_api;
+
 } // namespace wsudo::nt
 
 #endif // WSUDO_NTAPI_H
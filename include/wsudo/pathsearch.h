@@ -0,0 +1,86 @@
+#ifndef WSUDO_PATHSEARCH_H
+#define WSUDO_PATHSEARCH_H
+
+#include "wsudo.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace wsudo {
+
+// Append arg to commandLine so CommandLineToArgvW and the CRT parse it back
+// unchanged.
+void appendQuotedArgument(std::wstring &commandLine, std::wstring_view arg);
+
+// Build a command line for CreateProcessW from program followed by argc
+// arguments. The program is only wrapped in quotes, since argv[0] parsing
+// doesn't treat backslashes specially.
+std::wstring buildCommandLine(std::wstring_view program, int argc,
+                              wchar_t *const argv[]);
+
+// Finds the executable a command name refers to, honoring PATH and PATHEXT.
+// Names containing a directory are resolved relative to the current
+// directory; bare names are only looked up in PATH, since searching the
+// current directory first is a trap when running elevated.
+//
+// Lookups are remembered in a cache file. An entry stays valid until a
+// directory searched before finding it changes its last write time, which
+// happens whenever a file in it is created, deleted or renamed. A cache hit
+// costs one attribute query per directory up to the match, instead of a
+// probe for each extension in each directory.
+class CommandResolver {
+public:
+  // An empty cachePath disables the cache file.
+  CommandResolver(std::wstring_view path, std::wstring_view pathExt,
+                  std::wstring cachePath);
+
+  // Use the process's PATH and PATHEXT, and a cache under %LOCALAPPDATA%.
+  static CommandResolver fromEnvironment();
+
+  // Returns the full path to the executable, or an empty string if the
+  // command wasn't found.
+  std::wstring resolve(std::wstring_view command);
+
+  // Write the cache file if any lookups changed it.
+  bool save();
+
+private:
+  // Cache entries beyond this drop the oldest.
+  static constexpr size_t MaxEntries = 256;
+  // Last write time of a directory that doesn't exist.
+  static constexpr uint64_t Missing = UINT64_MAX;
+  // Not checked since the cache was created.
+  static constexpr uint64_t Unknown = 0;
+
+  struct Entry {
+    std::wstring command;
+    // File name within _directories[directory].
+    std::wstring fileName;
+    uint32_t directory;
+  };
+
+  std::vector<std::wstring> _directories;
+  std::vector<uint64_t> _writeTimes;
+  std::vector<std::wstring> _extensions;
+  std::vector<Entry> _entries;
+  // Identifies PATH and PATHEXT; the cache is dropped when they change.
+  uint64_t _environmentHash;
+  std::wstring _cachePath;
+  bool _dirty = false;
+
+  void load();
+  // Compare directory i's last write time with the recorded one, dropping
+  // entries that depended on it if it changed. Returns true if unchanged.
+  bool checkDirectory(uint32_t i);
+  // Look for command in one directory. Returns the file name or empty.
+  std::wstring findInDirectory(uint32_t i, std::wstring_view command) const;
+  // Resolve a name with a directory part.
+  std::wstring resolvePath(std::wstring_view command) const;
+  bool hasExtension(std::wstring_view command) const;
+};
+
+} // namespace wsudo
+
+#endif // WSUDO_PATHSEARCH_H
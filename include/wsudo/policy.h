@@ -0,0 +1,164 @@
+#ifndef WSUDO_POLICY_H
+#define WSUDO_POLICY_H
+
+#include "wsudo.h"
+#include "events.h"
+
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace wsudo::policy {
+
+enum class Decision {
+  Allow,
+  Deny,
+};
+
+// One of the SIDs a request is checked for: the user or one of its groups.
+struct PolicySid {
+  PSID sid;
+  // Deny-only groups match deny rules but never allow rules.
+  bool denyOnly;
+};
+
+// Policy rules compiled into one read-only block of memory: a sorted index
+// of SIDs, and for each SID the programs rules say it may or may not
+// elevate. Checking never parses or allocates besides one copy of the image
+// path, and accounts are resolved to SIDs when the policy is compiled.
+//
+// Policy text has one rule per line, and # starts a comment:
+//
+//   <principal> <program>     Allow principal to elevate program.
+//   <principal> !<program>    Deny it, regardless of any allow rule.
+//
+// A principal is a user or DOMAIN\user, a group written %group, a SID
+// string, or ALL for everyone. A program is a full path, a directory prefix
+// ending in \* for everything under it, or ALL. Either may be quoted. A
+// request is allowed if an allow rule matches and no deny rule does.
+//
+// Program rules are advisory. The client creates the process it wants
+// elevated and keeps full access to it, so once any program is allowed it
+// can write that process's memory and run something else. Only the
+// principal side of a rule, who may elevate at all, is enforced.
+class PolicyTable {
+public:
+  // Returns null if the text doesn't compile, with error saying why.
+  static std::shared_ptr<const PolicyTable> compile(std::wstring_view text,
+                                                    std::string &error);
+
+  PolicyTable(const PolicyTable &) = delete;
+  PolicyTable &operator=(const PolicyTable &) = delete;
+
+  // imagePath is the full path of the executable, as given by
+  // QueryFullProcessImageNameW.
+  Decision check(const PolicySid *sids, size_t count,
+                 std::wstring_view imagePath) const;
+
+  size_t ruleCount() const;
+
+private:
+  struct Header;
+  struct SidEntry;
+  struct Rule;
+
+  Handle<const void *, UnmapViewOfFile> _view;
+
+  explicit PolicyTable(const void *view) noexcept : _view{view} {}
+
+  const Header &header() const;
+  const SidEntry *sids() const;
+  const Rule *rules() const;
+  const uint8_t *bytes() const {
+    return static_cast<const uint8_t *>(static_cast<const void *>(_view));
+  }
+  // Returns the SID's index entry, or null if no rule names it.
+  const SidEntry *find(PSID sid) const;
+};
+
+// The policy file and its compiled table. check() is thread safe, and
+// load() swaps in a new table without blocking checks for longer than a
+// pointer copy.
+class Policy {
+public:
+  explicit Policy(std::wstring path) noexcept;
+
+  Policy(const Policy &) = delete;
+  Policy &operator=(const Policy &) = delete;
+
+  // %ProgramData%\wsudo\policy.conf.
+  static std::wstring defaultPath();
+
+  const std::wstring &path() const { return _path; }
+
+  // Create the policy file's directory if it doesn't exist, writable only by
+  // SYSTEM and Administrators. Returns false if it couldn't be created.
+  bool createDirectory();
+
+  // Compile the policy file and start using it. If it doesn't compile, it or
+  // its directory isn't owned by and only writable by SYSTEM, Administrators
+  // or TrustedInstaller, or it has been removed, the current
+  // rules stay; if there are none yet, everything is denied. Until there is
+  // a file, everything is allowed. Returns true if the file was loaded.
+  bool load();
+
+  // Check a user and its groups, e.g. a session's TokenIdentity::sids().
+  Decision check(const PolicySid *sids, size_t count,
+                 std::wstring_view imagePath) const;
+
+private:
+  std::wstring _path;
+  mutable std::shared_mutex _mutex;
+  // Null allows everything. Guarded by _mutex.
+  std::shared_ptr<const PolicyTable> _table{};
+  // Set after the first load() attempt.
+  std::atomic<bool> _loaded = false;
+
+  void setTable(std::shared_ptr<const PolicyTable> table);
+  // Returns true if rules are in use, including the deny-all ones
+  // failClosed() sets.
+  bool hasTable() const;
+  // After a failed load, deny everything unless rules are already active.
+  // Allowing everything for lack of a file doesn't count.
+  void failClosed();
+};
+
+// Reloads the policy when the file changes, using ReadDirectoryChangesW on
+// its directory. If the directory doesn't exist yet, this watches its
+// nearest ancestor that does until it's created.
+class PolicyWatchHandler final : public events::EventHandler {
+public:
+  explicit PolicyWatchHandler(Policy &policy) noexcept;
+  ~PolicyWatchHandler();
+
+  HANDLE event() const override { return _event; }
+
+  events::EventStatus operator()(events::EventListener &) override;
+
+private:
+  Policy &_policy;
+  std::wstring _policyDirectory;
+  std::wstring _fileName;
+  // The policy directory, or the ancestor being watched for it.
+  HObject _directory;
+  // The entry of _directory whose changes matter: the policy file, or the
+  // next directory on the way to it.
+  std::wstring _watchName;
+  bool _watchingPolicyDirectory = false;
+  HObject _event;
+  OVERLAPPED _overlapped{};
+  alignas(DWORD) uint8_t _changes[4096];
+
+  // Open the policy directory, or its nearest existing ancestor. Returns
+  // false if neither can be opened.
+  bool open();
+  // Queue the next directory read.
+  bool watch();
+};
+
+} // namespace wsudo::policy
+
+#endif // WSUDO_POLICY_H
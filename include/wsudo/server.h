@@ -4,8 +4,12 @@
 #include "wsudo.h"
 #include "events.h"
 #include "session.h"
+#include "policy.h"
 
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include <type_traits>
 #include <vector>
 #include <string_view>
@@ -33,12 +37,29 @@ inline const char *statusToString(Status status) {
   }
 }
 
-// Creates connections to a named pipe with the necessary security attributes.
+// Named pipe instance pool limits.
+struct PipePoolConfig {
+  // Low watermark: when fewer instances than this are listening, connecting
+  // clients cause a new one to be created.
+  unsigned minIdle = DefaultMinIdlePipes;
+  // High watermark: when at least this many instances are listening, an
+  // instance whose client disconnects is closed instead of reused.
+  unsigned maxIdle = DefaultMaxIdlePipes;
+  // Total instance limit, at most PIPE_UNLIMITED_INSTANCES.
+  unsigned maxInstances = DefaultMaxPipes;
+};
+
+// Creates connections to a named pipe with the necessary security attributes,
+// and keeps count of the instances so the pool can grow and shrink with load.
+// All functions are thread safe.
 class NamedPipeHandleFactory final {
 public:
-  explicit NamedPipeHandleFactory(LPCWSTR pipeName) noexcept;
+  explicit NamedPipeHandleFactory(LPCWSTR pipeName,
+                                  PipePoolConfig pool = PipePoolConfig{})
+                                  noexcept;
 
-  // Create a new pipe connection.
+  // Create a new pipe connection. The new instance counts as idle. Returns
+  // null if the pool is full or creation failed.
   HObject operator()();
 
   // Returns true if initialization succeeded and a connection can be created.
@@ -48,9 +69,44 @@ public:
   explicit operator bool() const
   { return good(); }
 
+  // An idle instance accepted a client. Returns true if another instance
+  // should be created to keep enough listening.
+  bool onConnected();
+
+  // An instance's client left. Returns true if the instance should listen
+  // again, or false if it should be closed.
+  bool onDisconnected();
+
+  // An instance was closed. idle says whether it was listening at the time.
+  void onClosed(bool idle);
+
+  // Returns true if more instances are listening than the pool minimum.
+  bool hasExtraIdle() const;
+
+  // An idle instance waited too long for a client. Returns true if it should
+  // be closed, in which case it no longer counts as idle.
+  bool onIdleTimeout();
+
+  // Returns an ID for a new instance's log messages.
+  int nextInstanceId() { return ++_lastInstanceId; }
+
+  // Total number of open instances.
+  unsigned instances() const;
+
+  // Number of instances waiting for a client.
+  unsigned idle() const;
+
+  // The pool limits, clamped to what the factory can honor.
+  const PipePoolConfig &pool() const { return _pool; }
+
 private:
   bool _firstInstance = true;
   LPCWSTR _pipeName;
+  PipePoolConfig _pool;
+  mutable std::mutex _mutex;
+  unsigned _instances = 0;
+  unsigned _idle = 0;
+  std::atomic<int> _lastInstanceId = 0;
   SID_IDENTIFIER_AUTHORITY _sidAuth;
   Handle<PSID, FreeSid> _sid;
   EXPLICIT_ACCESS_W _explicitAccess;
@@ -65,13 +121,21 @@ public:
   using Callback = recursive_mem_callback<Self>;
 
   explicit ClientConnectionHandler(HObject pipe, int clientId,
-                                   session::SessionManager &sessionManager)
+                                   events::EventListener &listener,
+                                   NamedPipeHandleFactory &pipeFactory,
+                                   session::SessionManager &sessionManager,
+                                   policy::Policy &policy,
+                                   events::BufferPool &bufferPool)
                                    noexcept;
+  ~ClientConnectionHandler();
 
   bool reset() override;
 
   events::EventStatus operator()(events::EventListener &) override;
 
+  events::EventStatus timeout(events::EventListener &,
+                              events::TimerId id) override;
+
 protected:
   HANDLE fileHandle() const override {
     return _pipe;
@@ -80,26 +144,111 @@ protected:
 private:
   HObject _pipe;
   int _clientId;
+  events::EventListener &_listener;
+  NamedPipeHandleFactory &_pipeFactory;
   session::SessionManager &_sessionManager;
+  policy::Policy &_policy;
   Callback _callback;
-  HObject _userToken{};
+  // Set once the client has authenticated.
+  std::shared_ptr<session::Session> _session{};
+  // The client process, opened on first use for the rest of the connection.
+  HObject _clientProcess{};
+  // True while the pipe is waiting for a client.
+  bool _idle = true;
+  // Set when the pool decided to close this instance.
+  bool _retired = false;
+  // Read or idle timeout, if one is armed.
+  events::TimerId _timer = 0;
+  // When the current connect, read or write started, in QPC ticks.
+  int64_t _phaseStart = 0;
+  // Whether to read another message after the response is written.
+  bool _keepConnection = false;
+  // Logon the current message is waiting for, if any.
+  std::shared_ptr<session::PendingLogon> _pendingLogon{};
+  // Remote process handle a CredentialBless message blesses once the logon
+  // is done; null for a plain Credential message.
+  HANDLE _blessAfterLogon = nullptr;
+
+  void setTimer(DWORD ms);
+  void clearTimer();
+
+  // Count this instance as connected, and add another listening instance if
+  // the pool is running low. A retired instance isn't counted; the idle
+  // timeout that retired it already stopped counting it as idle.
+  void claimInstance();
 
   void createResponse(const char *header,
                       std::string_view message = std::string_view{});
+  // Response with a binary body.
+  void createResponse(const char *header, const void *body, size_t length);
 
   Callback beginConnect();
   Callback endConnect();
   Callback read();
   Callback respond();
+  Callback waitForLogon();
+  Callback finishLogon();
+  Callback write();
+  Callback responded();
   Callback resetConnection();
 
   // Returns true to read another message, false to reset the connection.
   bool dispatchMessage();
-  bool tryToLogonUser(char *username, char *password);
-  bool bless(HANDLE remoteHandle);
+  // Both views point into _buffer. The password must be NUL terminated; it
+  // is erased before returning. A cached session is used right away;
+  // otherwise this starts _pendingLogon, and the response waits for it.
+  bool tryToLogonUser(std::wstring_view username, std::wstring_view password);
+  // Respond to a credential message with its session, which is null if the
+  // logon failed. Blesses _blessAfterLogon if it is set. Returns true to
+  // read another message.
+  bool authenticated(std::shared_ptr<session::Session> session,
+                     std::wstring_view username);
+  // Bless a batch of the client's process handles, opening the client once.
+  // Writes a Win32 error code for each handle to statuses. Returns false if
+  // none could be attempted.
+  bool bless(const HANDLE *remoteHandles, size_t count, uint32_t *statuses);
+  // True if the policy lets the session elevate the process. The client
+  // created the process and can still change what it runs, so this only
+  // enforces program rules as far as PolicyTable says.
+  bool authorize(HANDLE process);
+  // Returns the pipe client's process, owned by this handler, or null on
+  // failure.
+  HANDLE openClientProcess();
+  // Returns the pipe client's token, or null on failure.
+  HObject openClientToken();
+  // True if the client is running elevated as an administrator.
+  bool clientIsAdmin();
+  // Read the client's logon session and user into key.
+  bool clientSessionKey(session::SessionKey &key);
+  // Attach the client's cached session if it is for username.
+  bool tryCachedSession(std::wstring_view username);
+  void respondWithStats();
+};
+
+// Expires cached sessions when the session manager's timer fires.
+class SessionTimerHandler final : public events::EventHandler {
+public:
+  explicit SessionTimerHandler(session::SessionManager &sessionManager)
+                               noexcept
+    : _sessionManager{sessionManager}
+  {}
+
+  HANDLE event() const override {
+    return _sessionManager.timer();
+  }
+
+  events::EventStatus operator()(events::EventListener &) override {
+    _sessionManager.expire();
+    return events::EventStatus::Ok;
+  }
+
+private:
+  session::SessionManager &_sessionManager;
 };
 
 // Server configuration.
+class SessionHolder;
+
 struct Config {
   // Named pipe filename.
   std::wstring pipeName;
@@ -107,6 +256,33 @@ struct Config {
   // Pointer to global quit event handle.
   HANDLE *quitEvent;
 
+  // Number of event loop worker threads. 0 uses one per processor.
+  unsigned workerThreads = 0;
+
+  // Pipe instance pool limits.
+  PipePoolConfig pipePool{};
+
+  // Largest client message accepted, in bytes. Rounded up to a buffer size.
+  size_t maxMessageSize = DefaultMaxMessageSize;
+
+  // Policy file. Empty uses policy::Policy::defaultPath().
+  std::wstring policyPath{};
+
+  // Called once the first pipe instances exist, before the server resumes
+  // any handed off sessions or does other noncritical setup. The service
+  // host reports SERVICE_RUNNING here.
+  std::function<void()> onListening{};
+
+  // Called last, after every pipe instance is closed and the sessions are
+  // handed off. The service host reports SERVICE_STOPPED here so the SCM can
+  // start the next instance.
+  std::function<void()> onStopped{};
+
+  // Set before triggering the quit event to give the cached sessions to a
+  // holder that is already listening for the next server instance, instead
+  // of dropping them.
+  std::atomic<SessionHolder *> sessionHolder = nullptr;
+
   // Server status return value.
   Status status = StatusUnset;
 
@@ -120,6 +296,66 @@ struct Config {
 // the server's exit status.
 void serverMain(Config &config);
 
+// Session handoff between an instance that is stopping and the one that
+// replaces it, so a restart doesn't make every client log on again. The SCM
+// only starts the new instance once the old one reports SERVICE_STOPPED, and
+// may end the old process any time after that, so the old one can't wait for
+// it. Instead it starts a holder, a copy of this executable that listens on
+// the handoff pipe, before reporting any stop state. The old instance gives
+// the holder its sessions as it stops, and the holder duplicates their tokens
+// into the new instance's process, since it can't inherit them.
+
+// How long the holder waits for the next instance.
+constexpr DWORD HandoffTimeoutMs = 30 * 1000;
+
+// How long a starting server waits for the handoff pipe to appear or become
+// free. A server that isn't taking over waits this long before it serves
+// anyone.
+constexpr DWORD HandoffConnectTimeoutMs = 1000;
+
+class SessionHolder final {
+public:
+  // Start the holder and wait until it is listening on the handoff pipe.
+  // Returns true if it is, including if it already was.
+  bool start();
+
+  // Give the holder the sessions; it offers them to the next instance for up
+  // to HandoffTimeoutMs. Doesn't wait for that.
+  void handOff(session::SessionManager &sessionManager);
+
+private:
+  HObject _process;
+  // The write end of the holder's standard input, which reads the sessions.
+  HObject _input;
+};
+
+// Run as a holder (TokenServer.exe --hold-sessions <event>): listen on the
+// handoff pipe, set the inherited event, then read the sessions from
+// standard input and offer them. Returns the process exit code.
+int holdSessions(HANDLE listeningEvent);
+
+// Take the sessions of a holder that is waiting for this instance, if there
+// is one. Returns how many were adopted.
+size_t receiveSessions(session::SessionManager &sessionManager);
+
+// Windows service host.
+
+constexpr wchar_t ServiceName[] = L"wsudo";
+
+// User-defined control code: stop, handing the sessions to the next start.
+constexpr DWORD ServiceControlHandOff = 128;
+
+// Run under the SCM dispatcher. Returns the process exit code.
+int runService(Config &config);
+
+// Register TokenServer.exe as an automatically started service running as
+// LocalSystem, or remove it.
+bool installService();
+bool uninstallService();
+
+// Hand off, wait for the service to stop, and start it again.
+bool restartService();
+
 } // namespace wsudo::server
 
 #endif // WSUDO_SERVER_H
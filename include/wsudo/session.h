@@ -2,56 +2,315 @@
 #define WSUDO_SESSION_H
 
 #include "wsudo.h"
+#include "tokentemplate.h"
+#include "policy.h"
+#include "throttle.h"
 
-#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <string>
 #include <string_view>
 #include <memory>
+#include <vector>
+#include <mutex>
 
 namespace wsudo::session {
 
 class Session;
 
+// Identifies whose session it is: the logon session the client runs in,
+// e.g. one console login, and the client's user. Sessions are never shared
+// across logon sessions.
+struct SessionKey {
+  LUID logonId{};
+  uint8_t sidLength = 0;
+  std::array<uint8_t, SECURITY_MAX_SID_SIZE> sid{};
+
+  // Read the key from a client token opened with TOKEN_QUERY.
+  static bool fromToken(HANDLE token, SessionKey &key);
+
+  uint64_t hash() const;
+
+  // The user SID, for APIs that take a PSID.
+  PSID user() const { return const_cast<uint8_t *>(sid.data()); }
+
+  bool operator==(const SessionKey &other) const;
+  bool operator!=(const SessionKey &other) const { return !(*this == other); }
+};
+
+// What a session's logon token says about its user: SIDs, privileges and
+// account name. Reading these means several GetTokenInformation calls and a
+// LookupAccountSidW that can go over the network for domain accounts, so
+// it's done once when the session is stored and lives as long as the
+// session does.
+class TokenIdentity {
+public:
+  TokenIdentity() = default;
+  TokenIdentity(const TokenIdentity &) = delete;
+  TokenIdentity &operator=(const TokenIdentity &) = delete;
+  TokenIdentity(TokenIdentity &&) = default;
+  TokenIdentity &operator=(TokenIdentity &&) = default;
+
+  // Read from a token opened with TOKEN_QUERY.
+  bool read(HANDLE token);
+
+  explicit operator bool() const { return !_sidData.empty(); }
+
+  PSID userSid() const {
+    return _sidData.empty()
+      ? nullptr
+      : reinterpret_cast<PSID>(const_cast<uint8_t *>(_sidData.data()));
+  }
+
+  // DOMAIN\user, or the SID string if the name couldn't be looked up.
+  std::wstring_view accountName() const { return _accountName; }
+
+  // The user and its enabled and deny-only groups, sorted by SID.
+  const std::vector<policy::PolicySid> &sids() const { return _sids; }
+
+  // True for the user and enabled groups. Binary search.
+  bool isMember(PSID sid) const;
+
+  // True if the token has the privilege, enabled or not. Binary search.
+  bool hasPrivilege(const LUID &privilege) const;
+
+private:
+  // Every SID's bytes, the user's first; _sids points into this.
+  std::vector<uint8_t> _sidData;
+  std::vector<policy::PolicySid> _sids;
+  // Sorted by LUID.
+  std::vector<LUID_AND_ATTRIBUTES> _privileges;
+  std::wstring _accountName;
+};
+
+// Open addressing hash table of sessions with linear probing. Slots keep the
+// key's hash next to the pointer so most probes never touch the session.
+// Not thread safe; SessionManager locks around it.
+class SessionTable {
+public:
+  SessionTable();
+
+  // Returns the slot's session pointer, or null if the key isn't present.
+  std::shared_ptr<Session> *find(const SessionKey &key);
+
+  // Insert a session under its key, replacing any session already there.
+  void insert(std::shared_ptr<Session> session);
+
+  void erase(const SessionKey &key);
+
+  // Erase every session the predicate returns true for, and call visit on
+  // the rest. Entries moved by an erase may be seen twice.
+  template<typename Pred, typename Visit>
+  void eraseIf(Pred &&pred, Visit &&visit);
+
+  template<typename Visit>
+  void forEach(Visit &&visit) const;
+
+  size_t size() const { return _count; }
+
+private:
+  struct Slot {
+    uint64_t hash = 0;
+    std::shared_ptr<Session> session{};
+  };
+
+  std::vector<Slot> _slots;
+  size_t _count = 0;
+
+  size_t mask() const { return _slots.size() - 1; }
+  // Index of the key's slot, or of the empty slot where it would go.
+  size_t probe(const SessionKey &key, uint64_t hash) const;
+  void grow();
+  // Remove the slot's session and shift later entries of its probe run back,
+  // so lookups never need tombstones.
+  void eraseAt(size_t index);
+};
+
+// A LogonUserExW call running on the thread pool. Clients that ask for the
+// same logon while it runs wait on this one instead of starting their own.
+class PendingLogon {
+public:
+  PendingLogon(const PendingLogon &) = delete;
+  PendingLogon &operator=(const PendingLogon &) = delete;
+
+  std::wstring_view username() const { return _username; }
+
+  bool done() const { return _done.load(std::memory_order_acquire); }
+
+  // The stored session, or null if the logon failed. Only valid once done().
+  const std::shared_ptr<Session> &session() const { return _session; }
+
+  // Call wake on the thread pool when the logon is done. Returns false if it
+  // already is, in which case wake isn't called. owner identifies the
+  // waiter for cancel().
+  bool notify(const void *owner, std::function<void()> wake);
+
+  // Forget the owner's wake callback, e.g. when it stops waiting.
+  void cancel(const void *owner);
+
+private:
+  friend class SessionManager;
+
+  PendingLogon(const SessionKey &key, DWORD processId,
+               std::wstring_view username, std::wstring_view domain,
+               std::wstring_view password)
+    : _key{key}, _processId{processId}, _username{username},
+      _domain{domain}, _password{password}
+  {}
+
+  const SessionKey _key;
+  // The client process that started the logon; failures are charged to it.
+  const DWORD _processId;
+  const std::wstring _username;
+  const std::wstring _domain;
+  // Erased once the logon is done. Guarded by SessionManager::_logonMutex.
+  std::wstring _password;
+  std::mutex _mutex;
+  // Guarded by _mutex.
+  std::vector<std::pair<const void *, std::function<void()>>> _waiters;
+  std::shared_ptr<Session> _session{};
+  std::atomic<bool> _done = false;
+
+  // Publish the result and wake every waiter.
+  void finish(std::shared_ptr<Session> session);
+};
+
+// Session cache counters.
+struct SessionStats {
+  size_t sessions;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// Session storage shared by all server workers. All public functions are
+// thread safe.
 class SessionManager {
 public:
   explicit SessionManager(unsigned defaultTtlSeconds) noexcept;
+  // Waits for logons still running on the thread pool.
+  ~SessionManager();
   SessionManager(const SessionManager &) = delete;
   SessionManager &operator=(const SessionManager &) = delete;
-  SessionManager(SessionManager &&) = default;
-  SessionManager &operator=(SessionManager &&) = default;
+  SessionManager(SessionManager &&) = delete;
+  SessionManager &operator=(SessionManager &&) = delete;
 
-  std::shared_ptr<Session> find(std::wstring_view username,
-                                std::wstring_view domain = {});
+  // Returns the session cached for username by the client logon session
+  // key names, or null. key must come from the client's own token; neither
+  // it nor the username alone is enough for a hit. A hit restarts the
+  // session's TTL.
+  std::shared_ptr<Session> find(const SessionKey &key,
+                                std::wstring_view username);
 
-  template<typename... Args>
-  std::shared_ptr<Session> create(Args &&...args) {
-    return store(Session(*this, std::forward<Args>(args)...));
+  // Log on on the thread pool and store the session under key, without
+  // blocking the caller. If the same user is already logging on for key with
+  // the same password, returns that logon instead of starting another, so a
+  // burst of clients from one logon session costs one LogonUserExW. Returns
+  // null if the work couldn't be queued. The caller still owns password and
+  // may erase it right away.
+  //
+  // Callers reserve the attempt with throttle().check() first. The outcome
+  // ends it, or joining a running logon releases it; if this returns null,
+  // the caller releases it.
+  std::shared_ptr<PendingLogon> logon(const SessionKey &key,
+                                      DWORD processId,
+                                      std::wstring_view username,
+                                      std::wstring_view domain,
+                                      std::wstring_view password);
+
+  // Block until every logon started by logon() is done. Call this before
+  // destroying anything their wake callbacks use.
+  void waitForLogons();
+
+  // Failed logon limits for clients.
+  LogonThrottle &throttle() {
+    return _throttle;
   }
 
   unsigned defaultTtlSeconds() const {
     return _defaultTtlSeconds;
   }
 
+  // Shared by every session's token pool.
+  const std::shared_ptr<const TokenTemplate> &tokenTemplate() const {
+    return _tokenTemplate;
+  }
+
+  // Waitable timer that is signaled when the next session may have expired.
+  // Register this with the event listener and call expire() when it fires.
+  HANDLE timer() const {
+    return _timer;
+  }
+
+  // Remove expired sessions and rearm the timer for the next one.
+  void expire();
+
+  SessionStats stats();
+
+  // Look up the local account domain. Nothing depends on it yet, so the
+  // server does this after it starts listening.
+  void loadLocalDomain();
+
+  // Serialize the unexpired sessions for a server instance that is taking
+  // over from this one. Their tokens are duplicated into process, and the
+  // state refers to them by their handle values there.
+  std::vector<uint8_t> exportSessions(HANDLE process);
+
+  // Adopt sessions serialized by another instance's exportSessions(), with
+  // the expiration times they had there. Only pass state from a verified
+  // previous instance; its token handles are taken as this process's. Each
+  // must still be a primary token for its session's account and logon SID,
+  // or none of the state is used. Returns how many were added.
+  size_t importSessions(const uint8_t *data, size_t size);
+
 private:
-  std::shared_ptr<Session> store(Session &&session);
+  std::shared_ptr<Session> store(const SessionKey &key, Session &&session);
+
+  // Arm the timer for the given GetTickCount64() time. Requires _mutex.
+  void armTimer(ULONGLONG dueAt);
+
+  static void CALLBACK logonCallback(PTP_CALLBACK_INSTANCE, PVOID context);
+  void runLogon(const std::shared_ptr<PendingLogon> &logon);
 
   unsigned _defaultTtlSeconds;
+  std::shared_ptr<const TokenTemplate> _tokenTemplate;
   HObject _timer;
+  // When the timer is due, or 0 if it isn't armed. Guarded by _mutex.
+  ULONGLONG _timerDueAt = 0;
   std::wstring _localDomain;
-  std::unordered_map<std::wstring_view, std::shared_ptr<Session>> _sessions;
+  LogonThrottle _throttle;
+  // Guards _sessions and the expiration times of the sessions in it.
+  std::mutex _mutex;
+  SessionTable _sessions;
+  // Counters, guarded by _mutex.
+  uint64_t _hits = 0;
+  uint64_t _misses = 0;
+  uint64_t _evictions = 0;
+  // Logons running on the thread pool, guarded by _logonMutex. There are
+  // only ever a few, so they're searched in order.
+  std::mutex _logonMutex;
+  std::condition_variable _logonsDone;
+  std::vector<std::shared_ptr<PendingLogon>> _logons;
 };
 
 class Session {
   friend class SessionManager;
 
-  // Password is a move reference in the hopes that we will get the only copy
-  // and erase it after we're done with it.
+  // The password is only used for the logon; the caller owns it and is
+  // responsible for erasing it.
   Session(const SessionManager &manager, std::wstring_view username,
-          std::wstring_view domain, std::wstring &&password,
+          std::wstring_view domain, const wchar_t *password,
           unsigned ttlSeconds) noexcept;
 
   Session(const SessionManager &manager, std::wstring_view username,
-          std::wstring_view domain, std::wstring &&password) noexcept;
+          std::wstring_view domain, const wchar_t *password) noexcept;
+
+  // Adopt a logon handed over from another server instance.
+  Session(const SessionManager &manager, std::wstring username,
+          std::wstring domain, HObject token, HLocalPtr<PSID> logonSid,
+          unsigned ttlSeconds) noexcept;
 
 public:
   Session(const Session &) = delete;
@@ -68,30 +327,90 @@ public:
     return _domain;
   }
 
+  const SessionKey &key() const {
+    return _key;
+  }
+
   HANDLE token() const {
     return _token;
   }
 
+  // Logon SID from LogonUserExW.
   PSID psid() const {
     return _pSid;
   }
 
+  // SID of the user the session belongs to, or null if it couldn't be read.
+  PSID userSid() const {
+    return _identity.userSid();
+  }
+
+  // The logon token's groups, privileges and account name.
+  const TokenIdentity &identity() const {
+    return _identity;
+  }
+
   explicit operator bool() const {
-    return !!_token;
+    return !!_token && !!_tokenPool;
+  }
+
+  // Returns a new primary token to assign to one client process. A primary
+  // token can only belong to one process, so each bless needs its own; they
+  // are usually duplicated ahead of time by the session's token pool.
+  HObject createPrimaryToken() const {
+    return _tokenPool->take();
   }
 
 private:
+  SessionKey _key;
   const std::wstring _username;
   const std::wstring _domain;
   HObject _token;
   HLocalPtr<PSID> _pSid;
+  TokenIdentity _identity;
+  std::shared_ptr<TokenPool> _tokenPool;
   // The amount of time this session will be kept open without being referenced.
   // Each time the session is used, its lifetime is reset to this value.
   unsigned _ttlResetSeconds;
-  // The time when this session expires if left untouched.
-  unsigned _ttlExpiresSeconds;
+  // The GetTickCount64() time when this session expires if left untouched.
+  ULONGLONG _ttlExpiresAt;
+
+  // Start pre-duplicating primary tokens from the logon token.
+  void createTokenPool(const SessionManager &manager);
+
+  // Reset the expiration time to a full TTL from now.
+  void touch() {
+    _ttlExpiresAt = GetTickCount64() + _ttlResetSeconds * 1000ull;
+  }
 };
 
+template<typename Pred, typename Visit>
+void SessionTable::eraseIf(Pred &&pred, Visit &&visit) {
+  size_t index = 0;
+  while (index < _slots.size()) {
+    auto &session = _slots[index].session;
+    if (session && pred(*session)) {
+      // Shifting may move an unvisited entry into this slot, so look at it
+      // again.
+      eraseAt(index);
+      continue;
+    }
+    if (session) {
+      visit(*session);
+    }
+    ++index;
+  }
+}
+
+template<typename Visit>
+void SessionTable::forEach(Visit &&visit) const {
+  for (auto &slot : _slots) {
+    if (slot.session) {
+      visit(*slot.session);
+    }
+  }
+}
+
 } // namespace wsudo::session
 
 #endif // WSUDO_SESSION_H_
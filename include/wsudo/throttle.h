@@ -0,0 +1,105 @@
+#ifndef WSUDO_THROTTLE_H
+#define WSUDO_THROTTLE_H
+
+#include "wsudo.h"
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace wsudo::session {
+
+// Limits failed logons per client user and per client process, so a script
+// looping on a wrong password can't keep the server busy with LogonUserExW
+// calls. Each client gets a bucket of Burst failures that refills by one
+// every RefillMs. Once it's empty, the client is refused for a backoff that
+// doubles with every further failure, up to MaxBackoffMs.
+//
+// check() reserves an attempt that stays in flight until the logon is done,
+// and a bucket admits no more attempts at once than it has failures left,
+// so parallel connections can't get past Burst either. The client user's
+// failures are also counted per account it tries; logging on forgives only
+// the ones for that account.
+//
+// Only clients with failures or attempts in flight are tracked, and at most
+// capacity of them; the least recently used are forgotten first. All
+// functions are thread safe, and times are GetTickCount64() values.
+class LogonThrottle {
+public:
+  static constexpr unsigned Burst = 5;
+  static constexpr ULONGLONG RefillMs = 60 * 1000;
+  static constexpr ULONGLONG BaseBackoffMs = 1000;
+  static constexpr ULONGLONG MaxBackoffMs = 5 * 60 * 1000;
+  static constexpr size_t DefaultCapacity = 4096;
+
+  explicit LogonThrottle(size_t capacity = DefaultCapacity) noexcept
+    : _capacity{capacity}
+  {}
+
+  LogonThrottle(const LogonThrottle &) = delete;
+  LogonThrottle &operator=(const LogonThrottle &) = delete;
+
+  // Returns 0 and reserves an attempt if the client may try to log on as
+  // account, or the milliseconds until it may. user is the client's own SID.
+  // Every reservation ends with failed(), succeeded() or release().
+  ULONGLONG check(PSID user, DWORD processId, std::wstring_view account,
+                  ULONGLONG now);
+
+  // Charge a failed logon to the client.
+  void failed(PSID user, DWORD processId, std::wstring_view account,
+              ULONGLONG now);
+
+  // Forgive the client's failures for account after it logs on as it.
+  void succeeded(PSID user, DWORD processId, std::wstring_view account,
+                 ULONGLONG now);
+
+  // End a reservation without charging anything, e.g. when the logon
+  // couldn't start or joined one already running.
+  void release(PSID user, DWORD processId, std::wstring_view account,
+               ULONGLONG now);
+
+  // Number of entries tracked, one per client user, client process and
+  // account a client user tried.
+  size_t size();
+
+private:
+  struct Entry {
+    std::string key;
+    unsigned tokens = Burst;
+    // Attempts reserved by check() that haven't ended yet.
+    unsigned inFlight = 0;
+    // Failures with an empty bucket since it was last full.
+    unsigned strikes = 0;
+    ULONGLONG refilledAt = 0;
+    ULONGLONG blockedUntil = 0;
+  };
+
+  using Keys = std::array<std::string, 3>;
+
+  size_t _capacity;
+  std::mutex _mutex;
+  // Most recently used first. Guarded by _mutex.
+  std::list<Entry> _entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+
+  // The client user's, client process's and user and account's keys.
+  static Keys keys(PSID user, DWORD processId, std::wstring_view account);
+
+  // Returns the key's entry refilled up to now, or null. Requires _mutex.
+  Entry *find(const std::string &key, ULONGLONG now);
+  // Returns the key's entry as the most recently used, adding it if needed.
+  // Requires _mutex.
+  Entry &use(const std::string &key, ULONGLONG now);
+  // End one attempt, and stop tracking the entry if that leaves nothing to
+  // remember. Requires _mutex.
+  void endAttempt(Entry &entry);
+  // Charge one failure to the entry. Requires _mutex.
+  void charge(Entry &entry, ULONGLONG now);
+};
+
+} // namespace wsudo::session
+
+#endif // WSUDO_THROTTLE_H
@@ -0,0 +1,87 @@
+#ifndef WSUDO_TIMERWHEEL_H
+#define WSUDO_TIMERWHEEL_H
+
+#include "wsudo.h"
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+namespace wsudo::events {
+
+// Identifies an armed timer. 0 is never a valid ID.
+using TimerId = uint64_t;
+
+// Hierarchical timing wheel. Arming and canceling are O(1); advancing costs
+// one step per elapsed tick, plus moving timers down a level whenever a
+// coarser slot comes due. Deadlines are rounded up to the next tick.
+// This class is not thread safe.
+class TimerWheel {
+public:
+  // Resolution in milliseconds.
+  static constexpr uint64_t TickMs = 10;
+
+  // A timer that fired: its ID and the key it was armed with.
+  using Expired = std::pair<TimerId, ULONG_PTR>;
+
+  explicit TimerWheel(uint64_t nowMs) noexcept;
+
+  // Arm a timer for delayMs after nowMs. Returns the timer's ID.
+  TimerId arm(uint64_t nowMs, uint64_t delayMs, ULONG_PTR key);
+
+  // Returns true if the timer was armed and is now canceled, or false if it
+  // already fired or was canceled before.
+  bool cancel(TimerId id);
+
+  // Move the wheel forward to nowMs, appending every timer that expired.
+  void advance(uint64_t nowMs, std::vector<Expired> &expired);
+
+  // Returns the number of milliseconds after nowMs that advance() should be
+  // called again, or UINT64_MAX if no timers are armed. This may be earlier
+  // than the next deadline, but never later.
+  uint64_t msUntilNext(uint64_t nowMs) const;
+
+  // Number of armed timers.
+  size_t size() const { return _count; }
+
+private:
+  static constexpr unsigned LevelBits = 6;
+  static constexpr unsigned SlotsPerLevel = 1u << LevelBits;
+  static constexpr unsigned SlotMask = SlotsPerLevel - 1;
+  static constexpr unsigned Levels = 4;
+  static constexpr uint32_t Nil = UINT32_MAX;
+
+  struct Node {
+    // Expiration tick.
+    uint64_t expires;
+    ULONG_PTR key;
+    // Slot list links.
+    uint32_t next;
+    uint32_t prev;
+    // Incremented when the node is freed, so stale IDs don't match.
+    uint32_t generation;
+    // Index into _slots, or Nil if the node is free.
+    uint32_t slot;
+  };
+
+  std::vector<Node> _nodes;
+  // Head of the free node list.
+  uint32_t _free = Nil;
+  // Heads of the slot lists, level by level.
+  std::array<uint32_t, Levels * SlotsPerLevel> _slots;
+  // Current tick.
+  uint64_t _now;
+  size_t _count = 0;
+
+  // Link a node into its slot. Timers due before earliest are moved to it.
+  void insert(uint32_t index, uint64_t earliest);
+  void unlink(uint32_t index);
+  void release(uint32_t index);
+  // Reinsert every timer in a slot at the given level.
+  void cascade(unsigned level);
+};
+
+} // namespace wsudo::events
+
+#endif // WSUDO_TIMERWHEEL_H
@@ -0,0 +1,69 @@
+#ifndef WSUDO_TOKENTEMPLATE_H
+#define WSUDO_TOKENTEMPLATE_H
+
+#include "wsudo.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace wsudo::session {
+
+// Primary tokens duplicated ahead of time for each session.
+constexpr unsigned DefaultTokenPoolSize = 2;
+
+// The token elevated processes get copies of, and the security descriptor
+// the copies are created with. For now this is the server's own token. It is
+// opened once and shared by every session.
+class TokenTemplate {
+public:
+  TokenTemplate() noexcept;
+
+  TokenTemplate(const TokenTemplate &) = delete;
+  TokenTemplate &operator=(const TokenTemplate &) = delete;
+
+  explicit operator bool() const {
+    return !!_token && !!_security;
+  }
+
+  // Create a new primary token. Returns null on failure.
+  HObject duplicate() const;
+
+private:
+  HObject _token;
+  HLocalPtr<PSECURITY_DESCRIPTOR> _security;
+};
+
+// Tokens duplicated from a template before they are needed. A primary token
+// can only be assigned to one process, so each bless takes one; the pool is
+// then topped up again on the Windows thread pool, away from the event loop.
+// Thread safe.
+class TokenPool : public std::enable_shared_from_this<TokenPool> {
+public:
+  explicit TokenPool(std::shared_ptr<const TokenTemplate> tokenTemplate,
+                     unsigned capacity = DefaultTokenPoolSize) noexcept;
+
+  TokenPool(const TokenPool &) = delete;
+  TokenPool &operator=(const TokenPool &) = delete;
+
+  // Returns a ready token, or duplicates one now if the pool ran dry.
+  HObject take();
+
+  // Start filling the pool in the background. take() does this too.
+  void refill();
+
+private:
+  std::shared_ptr<const TokenTemplate> _template;
+  unsigned _capacity;
+  std::mutex _mutex;
+  std::vector<HObject> _tokens;
+  // Set while a refill is queued or running, so only one runs at a time.
+  bool _refilling = false;
+
+  static void CALLBACK refillCallback(PTP_CALLBACK_INSTANCE, PVOID context);
+  void fill();
+};
+
+} // namespace wsudo::session
+
+#endif // WSUDO_TOKENTEMPLATE_H
@@ -32,13 +32,29 @@ extern const wchar_t *const PipeFullPath;
 /// Pipe's buffer size in bytes.
 constexpr size_t PipeBufferSize = 1024;
 
-// Maximum concurrent server connections. Being sudo, it's unlikely to have to
-// process many things concurrently, but we have to give Windows a number.
-constexpr int MaxPipeConnections = 3;
+// Largest message the server accepts by default, in bytes. Connections read
+// into pooled buffers that double from PipeBufferSize up to this size.
+constexpr size_t DefaultMaxMessageSize = PipeBufferSize << 4;
+
+// Pipe instances the server keeps listening when no clients are connected.
+constexpr unsigned DefaultMinIdlePipes = 2;
+
+// Idle pipe instances above this are closed when their client disconnects.
+constexpr unsigned DefaultMaxIdlePipes = 8;
+
+// Maximum concurrent server connections. This is the most Windows allows.
+constexpr unsigned DefaultMaxPipes = PIPE_UNLIMITED_INSTANCES;
 
 // Pipe timeout, again for Windows.
 constexpr int PipeDefaultTimeout = 0;
 
+// Time a connected client has to send its next message, in milliseconds.
+constexpr DWORD ClientReadTimeout = 30 * 1000;
+
+// Time an idle pipe instance above the pool minimum waits for a client before
+// it is closed, in milliseconds.
+constexpr DWORD PipeIdleTimeout = 60 * 1000;
+
 
 /// Message headers
 namespace msg {
@@ -49,8 +65,12 @@ namespace msg {
     extern const char *const QuerySession;
     /// User credentials message
     extern const char *const Credential;
-    /// Bless (elevate process) request message
+    /// Bless (elevate processes) request message
     extern const char *const Bless;
+    /// Credentials and bless request in one message, with one response.
+    extern const char *const CredentialBless;
+    /// Server statistics request (administrators only).
+    extern const char *const Stats;
   }
 
   /// Server->Client message headers
@@ -63,17 +83,53 @@ namespace msg {
     extern const char *const InternalError;
     /// Access denied
     extern const char *const AccessDenied;
+    /// No cached session; the client should send credentials.
+    extern const char *const NoSession;
   }
 } // namespace msg
 
+// Compile time log level floor, as a spdlog level number (0 = trace,
+// 1 = debug, 2 = info, 3 = warn, 4 = err, 5 = critical, 6 = off). Calls below
+// it compile to nothing, though a log:: function's arguments are still
+// evaluated; use WSUDO_LOG_TRACE and WSUDO_LOG_DEBUG to drop those too.
+// Defaults to info in release builds.
+#ifndef WSUDO_LOG_LEVEL
+#  ifdef NDEBUG
+#    define WSUDO_LOG_LEVEL 2
+#  else
+#    define WSUDO_LOG_LEVEL 0
+#  endif
+#endif
+
 namespace log {
 
+// Lowest level that is compiled in.
+constexpr auto MinLevel =
+  static_cast<spdlog::level::level_enum>(WSUDO_LOG_LEVEL);
+
 // Logger that prints to stdout.
 extern std::shared_ptr<spdlog::logger> g_outLogger;
 
 // Logger that prints to stderr.
 extern std::shared_ptr<spdlog::logger> g_errLogger;
 
+// If set, called to create g_outLogger and g_errLogger the first time
+// either is used, for programs that usually exit without logging anything.
+extern void (*g_createLoggers)();
+
+// Run g_createLoggers once if the loggers don't exist yet. Thread safe.
+void ensureLoggers();
+
+inline spdlog::logger &outLogger() {
+  ensureLoggers();
+  return *g_outLogger;
+}
+
+inline spdlog::logger &errLogger() {
+  ensureLoggers();
+  return *g_errLogger;
+}
+
 /// Print to stdout with no prefix.
 template<typename... Args>
 static inline void print(const char *fmt, Args &&...args)
@@ -87,32 +143,56 @@ static inline void eprint(const char *fmt, Args &&...args)
 /// Trace logger.
 template<typename... Args>
 static inline void trace(const char *fmt, Args &&...args)
-{ g_outLogger->trace(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::trace) {
+    outLogger().trace(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Debug logger.
 template<typename... Args>
 static inline void debug(const char *fmt, Args &&...args)
-{ g_outLogger->debug(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::debug) {
+    outLogger().debug(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Info logger.
 template<typename... Args>
 static inline void info(const char *fmt, Args &&...args)
-{ g_outLogger->info(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::info) {
+    outLogger().info(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Warning logger.
 template<typename... Args>
 static inline void warn(const char *fmt, Args &&...args)
-{ g_errLogger->warn(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::warn) {
+    errLogger().warn(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Error logger.
 template<typename... Args>
 static inline void error(const char *fmt, Args &&...args)
-{ g_errLogger->error(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::err) {
+    errLogger().error(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Critical logger.
 template<typename... Args>
 static inline void critical(const char *fmt, Args &&...args)
-{ g_errLogger->critical(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::critical) {
+    errLogger().critical(fmt, std::forward<Args>(args)...);
+  }
+}
 
 // wchar_t loggers (not currently working).
 #ifndef WSUDO_WCHAR_T_LOGGING
@@ -130,32 +210,56 @@ static inline void eprint(const wchar_t *fmt, Args &&...args)
 /// Trace logger (wchar_t version).
 template<typename... Args>
 static inline void trace(const wchar_t *fmt, Args &&...args)
-{ g_outLogger->trace(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::trace) {
+    outLogger().trace(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Debug logger (wchar_t version).
 template<typename... Args>
 static inline void debug(const wchar_t *fmt, Args &&...args)
-{ g_outLogger->debug(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::debug) {
+    outLogger().debug(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Info logger (wchar_t version).
 template<typename... Args>
 static inline void info(const wchar_t *fmt, Args &&...args)
-{ g_outLogger->info(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::info) {
+    outLogger().info(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Warning logger (wchar_t version).
 template<typename... Args>
 static inline void warn(const wchar_t *fmt, Args &&...args)
-{ g_errLogger->warn(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::warn) {
+    errLogger().warn(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Error logger (wchar_t version).
 template<typename... Args>
 static inline void error(const wchar_t *fmt, Args &&...args)
-{ g_errLogger->error(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::err) {
+    errLogger().error(fmt, std::forward<Args>(args)...);
+  }
+}
 
 /// Critical logger (wchar_t version).
 template<typename... Args>
 static inline void critical(const wchar_t *fmt, Args &&...args)
-{ g_errLogger->critical(fmt, std::forward<Args>(args)...); }
+{
+  if constexpr (MinLevel <= spdlog::level::critical) {
+    errLogger().critical(fmt, std::forward<Args>(args)...);
+  }
+}
 
 #endif
 
@@ -280,6 +384,19 @@ namespace detail {
   [[maybe_unused]] auto const &WSUDO_CONCAT2(_scopeExit_, __LINE__) = \
     ::wsudo::detail::ScopeExitHelper{} % [&, this]()
 
+// Trace and debug logging whose arguments aren't evaluated below the
+// WSUDO_LOG_LEVEL floor.
+#if WSUDO_LOG_LEVEL <= 0
+# define WSUDO_LOG_TRACE(...) ::wsudo::log::trace(__VA_ARGS__)
+#else
+# define WSUDO_LOG_TRACE(...) ((void)0)
+#endif
+#if WSUDO_LOG_LEVEL <= 1
+# define WSUDO_LOG_DEBUG(...) ::wsudo::log::debug(__VA_ARGS__)
+#else
+# define WSUDO_LOG_DEBUG(...) ((void)0)
+#endif
+
 #ifndef NDEBUG
 # define WSUDO_UNREACHABLE(why) do { assert(0 && (why)); __assume(0); } while(0)
 #else
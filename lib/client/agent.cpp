@@ -0,0 +1,241 @@
+#include "wsudo/agent.h"
+#include "wsudo/message.h"
+
+#include <sddl.h>
+#include <cstring>
+
+using namespace wsudo;
+
+namespace {
+
+bool tokenLogonId(HANDLE token, LUID &logonId) {
+  TOKEN_STATISTICS statistics;
+  DWORD length;
+  if (!GetTokenInformation(token, TokenStatistics, &statistics,
+                           sizeof(statistics), &length))
+  {
+    return false;
+  }
+  logonId = statistics.AuthenticationId;
+  return true;
+}
+
+std::wstring pipeNameFor(const LUID &logonId) {
+  return fmt::format(L"\\\\.\\pipe\\wsudo_agent_{:08X}{:08X}",
+                     static_cast<unsigned long>(logonId.HighPart),
+                     logonId.LowPart);
+}
+
+// Write a response header, followed by per-handle statuses if there are any.
+bool respond(HANDLE pipe, const char *header,
+             const std::vector<DWORD> &statuses = {})
+{
+  std::vector<char> response(4 + statuses.size() * sizeof(uint32_t));
+  std::memcpy(response.data(), header, 4);
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    uint32_t status = statuses[i];
+    std::memcpy(response.data() + 4 + i * sizeof(uint32_t), &status,
+                sizeof(uint32_t));
+  }
+  DWORD bytes;
+  return WriteFile(pipe, response.data(), (DWORD)response.size(), &bytes,
+                   nullptr) &&
+         bytes == response.size();
+}
+
+// Returns the pipe client's process if it is in the given logon session.
+HObject openCaller(HANDLE pipe, const LUID &logonId) {
+  HObject process;
+  ULONG processId;
+  if (!GetNamedPipeClientProcessId(pipe, &processId)) {
+    return process;
+  }
+  process = OpenProcess(PROCESS_DUP_HANDLE | PROCESS_QUERY_LIMITED_INFORMATION,
+                        false, processId);
+  if (!process) {
+    return process;
+  }
+  HObject token;
+  LUID callerLogonId;
+  if (!OpenProcessToken(process, TOKEN_QUERY, &token) ||
+      !tokenLogonId(token, callerLogonId) ||
+      callerLogonId.LowPart != logonId.LowPart ||
+      callerLogonId.HighPart != logonId.HighPart)
+  {
+    process = nullptr;
+  }
+  return process;
+}
+
+// Handle one caller's request. Returns false if the agent should stop.
+bool serveCaller(HANDLE pipe, ClientConnection &conn,
+                 const std::wstring &username, const LUID &logonId)
+{
+  auto caller = openCaller(pipe, logonId);
+  if (!caller) {
+    log::warn("Refusing a caller from outside this logon session.");
+    respond(pipe, msg::server::AccessDenied);
+    return true;
+  }
+
+  // A full BLES fits in one pipe buffer. Vector storage is aligned enough
+  // for FrameReader.
+  std::vector<char> request(PipeBufferSize);
+  DWORD bytes;
+  if (!ReadFile(pipe, request.data(), (DWORD)request.size(), &bytes,
+                nullptr))
+  {
+    respond(pipe, msg::server::InvalidMessage);
+    return true;
+  }
+  msg::FrameReader frame{request.data(), bytes};
+  std::vector<HANDLE> remoteHandles;
+  HANDLE remoteHandle;
+  if (frame && frame.is(msg::client::Bless)) {
+    while (!frame.atEnd() && remoteHandles.size() < msg::MaxBlessHandles &&
+           frame.handle(remoteHandle))
+    {
+      remoteHandles.push_back(remoteHandle);
+    }
+  }
+  if (remoteHandles.empty() || !frame.atEnd()) {
+    respond(pipe, msg::server::InvalidMessage);
+    return true;
+  }
+
+  // The server duplicates handles out of its pipe client, which is us, so
+  // bring the caller's handles into this process first.
+  std::vector<DWORD> statuses(remoteHandles.size(), ERROR_SUCCESS);
+  std::vector<HObject> localHandles(remoteHandles.size());
+  std::vector<HANDLE> forwarded;
+  for (size_t i = 0; i < remoteHandles.size(); ++i) {
+    if (DuplicateHandle(caller, remoteHandles[i], GetCurrentProcess(),
+                        &localHandles[i], 0, false, DUPLICATE_SAME_ACCESS))
+    {
+      forwarded.push_back(localHandles[i]);
+    } else {
+      statuses[i] = GetLastError();
+    }
+  }
+
+  std::vector<DWORD> forwardedStatuses;
+  if (!forwarded.empty() && !conn.bless(forwarded, forwardedStatuses)) {
+    // The server drops connections that sit idle, but the session outlives
+    // them; reconnect and pick it back up.
+    conn = ClientConnection{PipeFullPath};
+    if (!conn || !conn.querySession(username)) {
+      log::eprint("[wsudo] Server session ended; stopping the agent.\n");
+      respond(pipe, msg::server::NoSession);
+      return false;
+    }
+    if (!conn.bless(forwarded, forwardedStatuses)) {
+      respond(pipe, msg::server::InternalError);
+      return true;
+    }
+  }
+  for (size_t i = 0, j = 0; i < statuses.size(); ++i) {
+    if (statuses[i] == ERROR_SUCCESS) {
+      statuses[i] = forwardedStatuses[j++];
+    }
+  }
+  respond(pipe, msg::server::Success, statuses);
+  return true;
+}
+
+} // namespace
+
+std::wstring agent::pipeName() {
+  HObject token;
+  LUID logonId;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) ||
+      !tokenLogonId(token, logonId))
+  {
+    return std::wstring{};
+  }
+  return pipeNameFor(logonId);
+}
+
+bool agent::bless(const std::vector<HANDLE> &processes,
+                  std::vector<DWORD> &statuses)
+{
+  auto name = pipeName();
+  if (name.empty()) {
+    return false;
+  }
+  // Don't wait if no agent is running, and don't let whoever owns the pipe
+  // impersonate us.
+  ClientConnection conn{name.c_str(), 1,
+                        SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION};
+  return conn && conn.bless(processes, statuses);
+}
+
+int agent::serve(ClientConnection &conn, const std::wstring &username) {
+  HObject token;
+  LUID logonId;
+  alignas(TOKEN_USER)
+    uint8_t user[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+  DWORD length;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) ||
+      !tokenLogonId(token, logonId) ||
+      !GetTokenInformation(token, TokenUser, user, sizeof(user), &length))
+  {
+    log::critical("Can't read process token: {}\n", lastErrorString());
+    return ClientExitSystemError;
+  }
+
+  // Only this user may open the pipe; serveCaller also checks that callers
+  // are in this logon session.
+  HLocalPtr<LPWSTR> sidString;
+  HLocalPtr<PSECURITY_DESCRIPTOR> securityDescriptor;
+  if (!ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER *>(user)->User.Sid,
+                              &sidString))
+  {
+    log::critical("Can't convert user SID: {}\n", lastErrorString());
+    return ClientExitSystemError;
+  }
+  auto sddl = fmt::format(L"D:P(A;;GA;;;{})",
+                          static_cast<LPWSTR>(sidString));
+  if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        sddl.c_str(), SDDL_REVISION_1, &securityDescriptor, nullptr))
+  {
+    log::critical("Can't create security descriptor: {}\n",
+                  lastErrorString());
+    return ClientExitSystemError;
+  }
+  SECURITY_ATTRIBUTES securityAttributes{sizeof(SECURITY_ATTRIBUTES),
+                                         securityDescriptor, false};
+
+  // One instance serves callers in turn. Requiring the first instance means
+  // nobody else can already be listening under this name.
+  auto name = pipeNameFor(logonId);
+  HANDLE rawPipe =
+    CreateNamedPipeW(name.c_str(),
+                     PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                     PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT |
+                       PIPE_REJECT_REMOTE_CLIENTS,
+                     1, PipeBufferSize, PipeBufferSize, PipeDefaultTimeout,
+                     &securityAttributes);
+  if (rawPipe == INVALID_HANDLE_VALUE) {
+    log::critical("Can't create agent pipe (is an agent already running?): "
+                  "{}\n", lastErrorString());
+    return ClientExitSystemError;
+  }
+  HObject pipe{rawPipe};
+  log::print(L"[wsudo] Agent running for {}.\n", username);
+
+  while (true) {
+    if (!ConnectNamedPipe(pipe, nullptr) &&
+        GetLastError() != ERROR_PIPE_CONNECTED)
+    {
+      log::critical("Agent pipe failed: {}\n", lastErrorString());
+      return ClientExitSystemError;
+    }
+    bool keepRunning = serveCaller(pipe, conn, username, logonId);
+    // Let the caller read the response before disconnecting it.
+    FlushFileBuffers(pipe);
+    DisconnectNamedPipe(pipe);
+    if (!keepRunning) {
+      return ClientExitAccessDenied;
+    }
+  }
+}
@@ -1,4 +1,7 @@
 #include "wsudo/client.h"
+#include "wsudo/agent.h"
+#include "wsudo/message.h"
+#include "wsudo/pathsearch.h"
 
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <string>
@@ -7,94 +10,159 @@
 #include <cstring>
 #include <cstdio>
 
-#define SECURITY_WIN32
-#include <Security.h>
-#pragma comment(lib, "Secur32.lib")
+#include <shellapi.h>
+#pragma comment(lib, "Shell32.lib")
 
 using namespace wsudo;
 
-void ClientConnection::connect(
-  LPSECURITY_ATTRIBUTES secAttr,
-  const wchar_t *pipeName,
-  int attempts
-)
+void ClientConnection::connect(const wchar_t *pipeName, int attempts,
+                               DWORD flags)
 {
-  if (attempts >= MaxConnectAttempts) {
-    return;
-  }
-  HANDLE pipe = CreateFileW(pipeName, GENERIC_READ | GENERIC_WRITE,
-                            FILE_SHARE_READ | FILE_SHARE_WRITE,
-                            secAttr, OPEN_EXISTING, 0, nullptr);
-  if (pipe == INVALID_HANDLE_VALUE) {
+  for (int attempt = 1; attempt <= attempts; ++attempt) {
+    // Usually an instance is listening, so try it before anything else.
+    HANDLE pipe = CreateFileW(pipeName, GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                              OPEN_EXISTING, flags, nullptr);
+    if (pipe != INVALID_HANDLE_VALUE) {
+      _pipe = pipe;
+      return;
+    }
+    // Only a busy pipe is worth waiting for; a missing one means there is no
+    // server.
+    if (GetLastError() != ERROR_PIPE_BUSY || attempt == attempts) {
+      return;
+    }
     WaitNamedPipeW(pipeName, NMPWAIT_USE_DEFAULT_WAIT);
-    connect(secAttr, pipeName, ++attempts);
-    return;
   }
-
-  _pipe = pipe;
 }
 
-ClientConnection::ClientConnection(const wchar_t *pipeName) {
-  SECURITY_ATTRIBUTES secAttr;
-  secAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
-  secAttr.bInheritHandle = false;
-  secAttr.lpSecurityDescriptor = nullptr;
-  connect(&secAttr, pipeName, 0);
+ClientConnection::ClientConnection(const wchar_t *pipeName, int attempts,
+                                   DWORD flags)
+{
+  connect(pipeName, attempts, flags);
   if (good()) {
     _buffer.reserve(PipeBufferSize);
   }
 }
 
-bool ClientConnection::negotiate(const char *credentials, size_t length) {
+bool ClientConnection::transact(const char *name) {
   DWORD bytes;
-  size_t messageLength = length + 4;
-  _buffer.resize(messageLength);
-  assert(strlen(msg::client::Credential) == 4);
-  std::memcpy(_buffer.data(), msg::client::Credential, 4);
-  std::memcpy(_buffer.data() + 4, credentials, length);
-  log::trace("Writing credential message, size {}", messageLength);
-  if (
-    !WriteFile(_pipe, _buffer.data(), (DWORD)messageLength, &bytes, nullptr) ||
-    bytes != messageLength
-  )
-  {
-    log::error("Couldn't write negotiate message.");
+  size_t messageLength = _buffer.size();
+  WSUDO_LOG_TRACE("Writing {} message, size {}", name, messageLength);
+  bool written =
+    WriteFile(_pipe, _buffer.data(), (DWORD)messageLength, &bytes, nullptr) &&
+    bytes == messageLength;
+  // Don't leave credentials lying around in the buffer.
+  SecureZeroMemory(_buffer.data(), _buffer.size());
+  if (!written) {
+    log::error("Couldn't write {} message.", name);
     return false;
   }
 
+  // Most responses fit in one pipe buffer, but stats don't.
   _buffer.resize(PipeBufferSize);
-  if (!ReadFile(_pipe, _buffer.data(), PipeBufferSize, &bytes, nullptr)) {
-    log::error("Couldn't read server response.");
-    return false;
+  size_t total = 0;
+  while (!ReadFile(_pipe, _buffer.data() + total,
+                   static_cast<DWORD>(_buffer.size() - total), &bytes,
+                   nullptr))
+  {
+    if (GetLastError() != ERROR_MORE_DATA) {
+      log::error("Couldn't read server response.");
+      return false;
+    }
+    total += bytes;
+    _buffer.resize(_buffer.size() * 2);
   }
-  _buffer.resize(bytes);
+  _buffer.resize(total + bytes);
   return readServerMessage();
 }
 
+bool ClientConnection::querySession(std::wstring_view username) {
+  msg::FrameWriter{_buffer, msg::client::QuerySession}
+    .string(username)
+    .finish();
+  return transact("query session");
+}
+
+bool ClientConnection::negotiate(std::wstring_view username,
+                                 std::wstring_view password)
+{
+  msg::FrameWriter{_buffer, msg::client::Credential}
+    .string(username)
+    .string(password)
+    .finish();
+  return transact("negotiate");
+}
+
 bool ClientConnection::bless(HANDLE process) {
-  DWORD bytes;
-  size_t messageLength = 4 + sizeof(HANDLE);
-  _buffer.resize(messageLength);
-  assert(strlen(msg::client::Bless) == 4);
-  std::memcpy(_buffer.data(), msg::client::Bless, 4);
-  std::memcpy(_buffer.data() + 4, &process, sizeof(HANDLE));
-  log::trace("Writing bless message, size {}", messageLength);
-  if (
-    !WriteFile(_pipe, _buffer.data(), (DWORD)messageLength, &bytes, nullptr) ||
-    bytes != messageLength
-  )
-  {
-    log::error("Couldn't write bless message.");
+  std::vector<DWORD> statuses;
+  if (!bless(std::vector<HANDLE>{process}, statuses)) {
+    return false;
+  }
+  if (statuses[0] != ERROR_SUCCESS) {
+    log::eprint("Couldn't bless process: {}\n", lastErrorString(statuses[0]));
     return false;
   }
+  return true;
+}
 
-  _buffer.resize(PipeBufferSize);
-  if (!ReadFile(_pipe, _buffer.data(), PipeBufferSize, &bytes, nullptr)) {
-    log::error("Couldn't read server response.");
+bool ClientConnection::bless(const std::vector<HANDLE> &processes,
+                             std::vector<DWORD> &statuses)
+{
+  assert(!processes.empty() && processes.size() <= msg::MaxBlessHandles);
+  msg::FrameWriter writer{_buffer, msg::client::Bless};
+  for (auto process : processes) {
+    writer.handle(process);
+  }
+  writer.finish();
+  if (!transact("bless")) {
     return false;
   }
-  _buffer.resize(bytes);
-  return readServerMessage();
+  if (_buffer.size() != 4 + processes.size() * sizeof(uint32_t)) {
+    log::error("Bless response has {} bytes for {} processes.",
+               _buffer.size(), processes.size());
+    return false;
+  }
+  statuses.resize(processes.size());
+  for (size_t i = 0; i < processes.size(); ++i) {
+    uint32_t status;
+    std::memcpy(&status, _buffer.data() + 4 + i * sizeof(uint32_t),
+                sizeof(uint32_t));
+    statuses[i] = status;
+  }
+  return true;
+}
+
+bool ClientConnection::negotiateAndBless(std::wstring_view username,
+                                         std::wstring_view password,
+                                         HANDLE process)
+{
+  msg::FrameWriter{_buffer, msg::client::CredentialBless}
+    .handle(process)
+    .string(username)
+    .string(password)
+    .finish();
+  return transact("credential bless");
+}
+
+bool ClientConnection::queryStats(metrics::StatsSnapshot &stats) {
+  msg::FrameWriter{_buffer, msg::client::Stats}.finish();
+  if (!transact("stats")) {
+    return false;
+  }
+  uint32_t version = 0;
+  if (_buffer.size() >= 4 + sizeof(uint32_t)) {
+    std::memcpy(&version, _buffer.data() + 4, sizeof(uint32_t));
+  }
+  if (version != metrics::StatsVersion ||
+      _buffer.size() != 4 + sizeof(metrics::StatsSnapshot))
+  {
+    log::error("Unsupported stats format (version {}, {} bytes).", version,
+               _buffer.size());
+    return false;
+  }
+  std::memcpy(&stats, _buffer.data() + 4, sizeof(metrics::StatsSnapshot));
+  return true;
 }
 
 bool ClientConnection::readServerMessage() {
@@ -105,11 +173,15 @@ bool ClientConnection::readServerMessage() {
   char header[5];
   std::memcpy(header, _buffer.data(), 4);
   header[4] = 0;
-  log::trace("Reading response with code {}.", header);
+  WSUDO_LOG_TRACE("Reading response with code {}.", header);
   if (!std::memcmp(header, msg::server::Success, 4)) {
     // Don't print a success message - just start the process.
     return true;
   }
+  if (!std::memcmp(header, msg::server::NoSession, 4)) {
+    // Not an error; the caller falls back to asking for credentials.
+    return false;
+  }
   if (!std::memcmp(header, msg::server::InvalidMessage, 4)) {
     log::eprint("Invalid message");
   } else if (!std::memcmp(header, msg::server::InternalError, 4)) {
@@ -127,25 +199,35 @@ bool ClientConnection::readServerMessage() {
   return false;
 }
 
-// FIXME: This is a hack and doesn't actually handle certain cases.
-std::wstring fullCommandLine(int argc, wchar_t *argv[]) {
-  std::wstring cl;
-  for (int i = 0; i < argc; ++i) {
-    if (wcschr(argv[i], L' ')) {
-      cl.push_back(L'"');
-      cl.append(argv[i]);
-      cl.push_back(L'"');
-    } else {
-      cl.append(argv[i]);
-    }
-    cl.push_back(L' ');
+static int printStats(ClientConnection &conn) {
+  metrics::StatsSnapshot stats;
+  if (!conn.queryStats(stats)) {
+    return ClientExitAccessDenied;
   }
-
-  return cl;
+  log::print("handlers        {}\n", stats.handlers);
+  log::print("pipes           {} ({} idle)\n", stats.pipeInstances,
+             stats.pipeIdle);
+  log::print("sessions        {} ({} hits, {} misses, {} evictions)\n",
+             stats.sessions, stats.sessionHits, stats.sessionMisses,
+             stats.sessionEvictions);
+  log::print("bytes           {} read, {} written\n", stats.bytesRead,
+             stats.bytesWritten);
+  log::print("\n{:<16} {:>10} {:>12} {:>12}\n", "phase", "count",
+             "mean (us)", "max (us)");
+  for (unsigned i = 0; i < metrics::PhaseCount; ++i) {
+    auto &phase = stats.phases[i];
+    log::print("{:<16} {:>10} {:>12} {:>12}\n",
+               metrics::phaseName(static_cast<metrics::Phase>(i)),
+               phase.count, phase.count ? phase.totalMicros / phase.count : 0,
+               phase.maxMicros);
+  }
+  return ClientExitOk;
 }
 
-// Returns {process, thread}
-std::pair<HANDLE, HANDLE> createProcess(int argc, wchar_t *argv[]) {
+// Returns {process, thread}. The process starts suspended.
+static std::pair<HANDLE, HANDLE>
+createSuspendedProcess(const wchar_t *applicationName, wchar_t *commandLine)
+{
   STARTUPINFOW si{};
   si.cb = sizeof(STARTUPINFOW);
   si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
@@ -153,9 +235,7 @@ std::pair<HANDLE, HANDLE> createProcess(int argc, wchar_t *argv[]) {
   si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
   si.dwFlags = STARTF_USESTDHANDLES;
   PROCESS_INFORMATION pi;
-  std::wstring commandLine{fullCommandLine(argc, argv)};
-  *(commandLine.end() - 1) = 0;
-  if (!CreateProcessW(argv[0], commandLine.data(), nullptr, nullptr, true,
+  if (!CreateProcessW(applicationName, commandLine, nullptr, nullptr, true,
                       CREATE_UNICODE_ENVIRONMENT | CREATE_SUSPENDED,
                       nullptr, nullptr, &si, &pi))
   {
@@ -164,113 +244,291 @@ std::pair<HANDLE, HANDLE> createProcess(int argc, wchar_t *argv[]) {
   return {pi.hProcess, pi.hThread};
 }
 
-int wmain(int argc, wchar_t *argv[]) {
+// Returns {process, thread}
+std::pair<HANDLE, HANDLE> createProcess(CommandResolver &resolver, int argc,
+                                        wchar_t *argv[])
+{
+  auto program = resolver.resolve(argv[0]);
+  if (program.empty()) {
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return {nullptr, nullptr};
+  }
+  auto commandLine = buildCommandLine(program, argc - 1, argv + 1);
+  return createSuspendedProcess(program.c_str(), commandLine.data());
+}
+
+// Returns {process, thread} for a whole command line, resolving the program
+// it starts with.
+std::pair<HANDLE, HANDLE> createProcess(CommandResolver &resolver,
+                                        const wchar_t *commandLine)
+{
+  int argc;
+  HLocalPtr<LPWSTR *> argv{CommandLineToArgvW(commandLine, &argc)};
+  if (!argv || argc < 1) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return {nullptr, nullptr};
+  }
+  auto program = resolver.resolve(static_cast<LPWSTR *>(argv)[0]);
+  if (program.empty()) {
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return {nullptr, nullptr};
+  }
+  std::wstring mutableCommandLine{commandLine};
+  return createSuspendedProcess(program.c_str(), mutableCommandLine.data());
+}
+
+// Suspended child processes waiting to be blessed.
+class Children {
+public:
+  Children() = default;
+  Children(const Children &) = delete;
+  Children &operator=(const Children &) = delete;
+
+  ~Children() {
+    for (auto thread : _threads) {
+      CloseHandle(thread);
+    }
+    for (auto process : _processes) {
+      CloseHandle(process);
+    }
+  }
+
+  void add(std::wstring name, std::pair<HANDLE, HANDLE> processAndThread) {
+    _names.push_back(std::move(name));
+    _processes.push_back(processAndThread.first);
+    _threads.push_back(processAndThread.second);
+  }
+
+  const std::vector<HANDLE> &processes() const { return _processes; }
+
+  // Kill every child, e.g. when they can't be blessed.
+  void terminate() {
+    for (auto process : _processes) {
+      TerminateProcess(process, 1);
+    }
+  }
+
+  // Resume the children that were blessed and kill the rest, then wait for
+  // all of them. Returns the first nonzero exit code, if any.
+  int run(const std::vector<DWORD> &statuses) {
+    int result = ClientExitOk;
+    for (size_t i = 0; i < _processes.size(); ++i) {
+      if (statuses[i] == ERROR_SUCCESS) {
+        ResumeThread(_threads[i]);
+      } else {
+        log::eprint(L"Couldn't bless '{}': {}\n", _names[i],
+                    to_utf16(lastErrorString(statuses[i])));
+        TerminateProcess(_processes[i], 1);
+        result = ClientExitAccessDenied;
+      }
+    }
+
+    WaitForMultipleObjects(static_cast<DWORD>(_processes.size()),
+                           _processes.data(), true, INFINITE);
+    for (auto process : _processes) {
+      DWORD exitCode;
+      GetExitCodeProcess(process, &exitCode);
+      if (result == ClientExitOk && exitCode != 0) {
+        result = static_cast<int>(exitCode);
+      }
+    }
+    return result;
+  }
+
+private:
+  std::vector<std::wstring> _names;
+  std::vector<HANDLE> _processes;
+  std::vector<HANDLE> _threads;
+};
+
+// The current user's account name, without the domain. Read from the
+// process token, which is cheaper than loading Secur32 for GetUserNameExW.
+static bool currentUsername(std::wstring &username) {
+  HObject token;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+    return false;
+  }
+  alignas(TOKEN_USER)
+    uint8_t buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+  DWORD length;
+  if (!GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &length))
+  {
+    return false;
+  }
+  wchar_t name[256];
+  wchar_t domain[256];
+  DWORD nameLength = ARRAYSIZE(name);
+  DWORD domainLength = ARRAYSIZE(domain);
+  SID_NAME_USE use;
+  auto sid = reinterpret_cast<TOKEN_USER *>(buffer)->User.Sid;
+  if (!LookupAccountSidW(nullptr, sid, name, &nameLength, domain,
+                         &domainLength, &use))
+  {
+    return false;
+  }
+  username.assign(name, nameLength);
+  return true;
+}
+
+// Prompt for the password without echoing it. The console mode is only
+// changed while reading, so runs with a cached session never touch it.
+static int readPassword(const std::wstring &username, std::wstring &password)
+{
+  HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+  DWORD stdinMode;
+  GetConsoleMode(hStdin, &stdinMode);
+  WSUDO_SCOPEEXIT { SetConsoleMode(hStdin, stdinMode); };
+
+  log::print(L"[wsudo] password for {}: ", username);
+  fflush(stdout);
+  SetConsoleMode(hStdin, ENABLE_EXTENDED_FLAGS | ENABLE_QUICK_EDIT_MODE);
+  while (true) {
+    wchar_t ch;
+    DWORD chRead;
+    if (!ReadConsoleW(hStdin, &ch, 1, &chRead, nullptr)) {
+      return ClientExitSystemError;
+    }
+    if (ch == 13 || ch == 10) {
+      // Enter
+      log::print("\n");
+      break;
+    } else if (ch == 8 || ch == 0x7F) {
+      // Backspace
+      if (password.length() > 0) {
+        password.erase(password.cend() - 1);
+      }
+    } else if (ch == 3) {
+      // Ctrl-C
+      log::print("\nCanceled.\n");
+      return ClientExitUserCanceled;
+    } else {
+      password.push_back((wchar_t)ch);
+    }
+  }
+  return ClientExitOk;
+}
+
+// Setting up colored console loggers costs more than the rest of a run with
+// a cached session, which never logs, so this only happens on first use.
+static void createLoggers() {
   log::g_outLogger = spdlog::stdout_color_mt("wsudo.out");
   log::g_outLogger->set_level(spdlog::level::trace);
   log::g_errLogger = spdlog::stderr_color_mt("wsudo.err");
   log::g_errLogger->set_level(spdlog::level::warn);
   spdlog::set_pattern("%^[%l]%$ %v");
+}
+
+int wmain(int argc, wchar_t *argv[]) {
+  log::g_createLoggers = &createLoggers;
   WSUDO_SCOPEEXIT { spdlog::drop_all(); };
 
   if (argc < 2) {
-    log::eprint("Usage: wsudo <program> <args>\n");
+    log::eprint("Usage: wsudo <program> <args>\n"
+                "       wsudo --each <command line>...\n"
+                "       wsudo --agent\n"
+                "       wsudo --stats\n");
+    return ClientExitInvalidUsage;
+  }
+
+  if (!wcscmp(argv[1], L"--stats")) {
+    ClientConnection conn{PipeFullPath};
+    if (!conn) {
+      log::critical("Connection to server failed.\n");
+      return ClientExitServerNotFound;
+    }
+    return printStats(conn);
+  }
+
+  // Each argument after --each is a whole command line, elevated together.
+  bool each = !wcscmp(argv[1], L"--each");
+  if (each && (argc < 3 || argc - 2 > (int)msg::MaxBlessHandles)) {
+    log::eprint("--each takes 1 to {} command lines.\n",
+                msg::MaxBlessHandles);
+    return ClientExitInvalidUsage;
+  }
+  bool agentMode = !wcscmp(argv[1], L"--agent");
+  if (agentMode && argc != 2) {
+    log::eprint("--agent takes no arguments.\n");
     return ClientExitInvalidUsage;
   }
 
+  // Create the processes before talking to anyone so the handles to bless go
+  // out with the first message that can carry them. They stay suspended until
+  // their tokens are replaced, and are killed if that doesn't happen.
+  Children children;
+  auto resolver = CommandResolver::fromEnvironment();
+  if (each) {
+    for (int i = 2; i < argc; ++i) {
+      auto processAndThread = createProcess(resolver, argv[i]);
+      if (!processAndThread.first) {
+        log::eprint(L"Error creating process '{}': {}.\n", argv[i],
+                    to_utf16(lastErrorString()));
+        children.terminate();
+        return ClientExitCreateProcessError;
+      }
+      children.add(argv[i], processAndThread);
+    }
+  } else if (!agentMode) {
+    auto processAndThread = createProcess(resolver, argc - 1, argv + 1);
+    if (!processAndThread.first) {
+      log::critical("Error creating process: {}.\n", lastErrorString());
+      return ClientExitCreateProcessError;
+    }
+    children.add(argv[1], processAndThread);
+  }
+  resolver.save();
+
+  // A running agent already holds a session for us.
+  std::vector<DWORD> statuses;
+  if (!agentMode && agent::bless(children.processes(), statuses)) {
+    return children.run(statuses);
+  }
+
   ClientConnection conn{PipeFullPath};
   if (!conn) {
     log::critical("Connection to server failed.\n");
+    children.terminate();
     return ClientExitServerNotFound;
   }
 
-  HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-  DWORD stdinMode;
-  GetConsoleMode(hStdin, &stdinMode);
-  DWORD newStdinMode = ENABLE_PROCESSED_INPUT | ENABLE_LINE_INPUT |
-                       ENABLE_ECHO_INPUT | ENABLE_EXTENDED_FLAGS |
-                       ENABLE_QUICK_EDIT_MODE;
-  SetConsoleMode(hStdin, newStdinMode);
-  WSUDO_SCOPEEXIT { SetConsoleMode(hStdin, stdinMode); };
-
   std::wstring username{};
-  ULONG usernameLength = 0;
-  GetUserNameExW(NameSamCompatible, nullptr, &usernameLength);
-  if (GetLastError() == ERROR_MORE_DATA) {
-    username.resize(usernameLength);
-    if (!GetUserNameExW(NameSamCompatible, username.data(), &usernameLength)) {
-      log::critical("Can't get username.\n");
-      return ClientExitSystemError;
-    }
-    // It ends in a null that we don't want printed.
-    username.erase(username.cend() - 1);
-  } else {
-    log::critical("Can't get username.\n");
+  if (!currentUsername(username)) {
+    log::critical("Can't get username: {}\n", lastErrorString());
+    children.terminate();
     return ClientExitSystemError;
   }
 
-  if (auto slash = username.find(L'\\'); slash != std::wstring::npos) {
-    username = username.substr(slash + 1);
-  }
-
+  // Skip the password if the server already has a session for us.
+  bool haveSession = conn.querySession(username);
   std::wstring password{};
-  log::print(L"[wsudo] password for {}: ", username);
-  fflush(stdout);
-  {
-    SetConsoleMode(hStdin, ENABLE_EXTENDED_FLAGS | ENABLE_QUICK_EDIT_MODE);
-    while (true) {
-      wchar_t ch;
-      DWORD chRead;
-      if (!ReadConsoleW(hStdin, &ch, 1, &chRead, nullptr)) {
-        return ClientExitSystemError;
-      }
-      if (ch == 13 || ch == 10) {
-        // Enter
-        log::print("\n");
-        break;
-      } else if (ch == 8 || ch == 0x7F) {
-        // Backspace
-        if (password.length() > 0) {
-          password.erase(password.cend() - 1);
-        }
-      } else if (ch == 3) {
-        // Ctrl-C
-        log::print("\nCanceled.\n");
-        return ClientExitUserCanceled;
-      } else {
-        password.push_back((wchar_t)ch);
-      }
+  if (!haveSession) {
+    auto result = readPassword(username, password);
+    if (result != ClientExitOk) {
+      children.terminate();
+      return result;
     }
-    SetConsoleMode(hStdin, newStdinMode);
   }
 
-  auto u8creds = to_utf8(username);
-  u8creds.push_back(0);
-  u8creds.append(to_utf8(password));
-  if (!conn.negotiate(u8creds.data(), u8creds.length())) {
+  bool blessed;
+  if (agentMode) {
+    blessed = haveSession || conn.negotiate(username, password);
+  } else if (!haveSession && !each) {
+    // Credentials and the one process go in a single message.
+    blessed = conn.negotiateAndBless(username, password,
+                                     children.processes()[0]);
+    statuses.assign(1, ERROR_SUCCESS);
+  } else {
+    blessed = (haveSession || conn.negotiate(username, password)) &&
+              conn.bless(children.processes(), statuses);
+  }
+  SecureZeroMemory(password.data(), password.length() * sizeof(wchar_t));
+  if (!blessed) {
+    children.terminate();
     return ClientExitAccessDenied;
   }
 
-  auto [process, thread] = createProcess(argc - 1, argv + 1);
-  if (!process) {
-    log::critical("Error creating process: {}.\n", lastErrorString());
-    return ClientExitCreateProcessError;
+  if (agentMode) {
+    return agent::serve(conn, username);
   }
-
-  if (!conn.bless(process)) {
-    log::critical("Server failed to adjust privileges\n");
-    TerminateProcess(process, 1);
-    CloseHandle(thread);
-    CloseHandle(process);
-    return ClientExitSystemError;
-  }
-
-  ResumeThread(thread);
-  CloseHandle(thread);
-  WaitForSingleObject(process, INFINITE);
-  DWORD exitCode;
-  GetExitCodeProcess(process, &exitCode);
-  CloseHandle(process);
-
-  return (int)exitCode;
+  return children.run(statuses);
 }
-
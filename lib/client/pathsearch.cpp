@@ -0,0 +1,445 @@
+#include "wsudo/pathsearch.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace wsudo;
+
+namespace {
+
+constexpr char CacheMagic[4] = {'W', 'S', 'P', 'C'};
+constexpr uint32_t CacheVersion = 1;
+// Anything bigger isn't a file we wrote.
+constexpr size_t MaxCacheFileSize = 1 << 20;
+
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t environmentHash;
+  uint32_t directoryCount;
+  uint32_t entryCount;
+};
+
+bool equalsIgnoreCase(std::wstring_view a, std::wstring_view b) {
+  return CompareStringOrdinal(a.data(), static_cast<int>(a.length()),
+                              b.data(), static_cast<int>(b.length()),
+                              true) == CSTR_EQUAL;
+}
+
+// Split a semicolon separated list, dropping empty items and quotes.
+std::vector<std::wstring> splitList(std::wstring_view list) {
+  std::vector<std::wstring> items;
+  while (!list.empty()) {
+    auto end = list.find(L';');
+    auto item = list.substr(0, end);
+    list = end == std::wstring_view::npos ? std::wstring_view{}
+                                          : list.substr(end + 1);
+    std::wstring unquoted;
+    for (auto ch : item) {
+      if (ch != L'"') {
+        unquoted.push_back(ch);
+      }
+    }
+    if (!unquoted.empty()) {
+      items.emplace_back(std::move(unquoted));
+    }
+  }
+  return items;
+}
+
+std::wstring joinPath(std::wstring_view directory, std::wstring_view name) {
+  std::wstring path{directory};
+  if (!path.empty() && path.back() != L'\\' && path.back() != L'/') {
+    path.push_back(L'\\');
+  }
+  path.append(name);
+  return path;
+}
+
+bool isFile(const std::wstring &path) {
+  auto attributes = GetFileAttributesW(path.c_str());
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+         !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+std::wstring getEnvironment(const wchar_t *name) {
+  std::wstring value;
+  DWORD length = GetEnvironmentVariableW(name, nullptr, 0);
+  if (length == 0) {
+    return value;
+  }
+  value.resize(length);
+  length = GetEnvironmentVariableW(name, value.data(), length);
+  value.resize(length);
+  return value;
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+} // namespace
+
+void wsudo::appendQuotedArgument(std::wstring &commandLine,
+                                 std::wstring_view arg)
+{
+  if (!arg.empty() && arg.find_first_of(L" \t\n\v\"") == arg.npos) {
+    commandLine.append(arg);
+    return;
+  }
+
+  // Backslashes are only special before a quote, where each pair becomes one
+  // backslash and an odd one escapes the quote.
+  commandLine.push_back(L'"');
+  for (auto it = arg.begin(); ; ++it) {
+    size_t backslashes = 0;
+    while (it != arg.end() && *it == L'\\') {
+      ++it;
+      ++backslashes;
+    }
+    if (it == arg.end()) {
+      commandLine.append(backslashes * 2, L'\\');
+      break;
+    } else if (*it == L'"') {
+      commandLine.append(backslashes * 2 + 1, L'\\');
+      commandLine.push_back(L'"');
+    } else {
+      commandLine.append(backslashes, L'\\');
+      commandLine.push_back(*it);
+    }
+  }
+  commandLine.push_back(L'"');
+}
+
+std::wstring wsudo::buildCommandLine(std::wstring_view program, int argc,
+                                     wchar_t *const argv[])
+{
+  std::wstring commandLine;
+  if (program.find_first_of(L" \t") != program.npos) {
+    commandLine.push_back(L'"');
+    commandLine.append(program);
+    commandLine.push_back(L'"');
+  } else {
+    commandLine.append(program);
+  }
+  for (int i = 0; i < argc; ++i) {
+    commandLine.push_back(L' ');
+    appendQuotedArgument(commandLine, argv[i]);
+  }
+  return commandLine;
+}
+
+CommandResolver::CommandResolver(std::wstring_view path,
+                                 std::wstring_view pathExt,
+                                 std::wstring cachePath)
+  : _directories{splitList(path)},
+    _extensions{splitList(pathExt)},
+    _cachePath{std::move(cachePath)}
+{
+  _writeTimes.resize(_directories.size(), Unknown);
+  _environmentHash = 0xCBF29CE484222325ull;
+  for (auto *list : {&_directories, &_extensions}) {
+    for (auto &item : *list) {
+      _environmentHash = fnv1a(_environmentHash, item.data(),
+                               item.length() * sizeof(wchar_t));
+      _environmentHash = fnv1a(_environmentHash, L";", sizeof(wchar_t));
+    }
+    _environmentHash = fnv1a(_environmentHash, L"|", sizeof(wchar_t));
+  }
+  if (!_cachePath.empty()) {
+    load();
+  }
+}
+
+CommandResolver CommandResolver::fromEnvironment() {
+  auto pathExt = getEnvironment(L"PATHEXT");
+  if (pathExt.empty()) {
+    pathExt = L".COM;.EXE;.BAT;.CMD";
+  }
+  auto localAppData = getEnvironment(L"LOCALAPPDATA");
+  std::wstring cachePath;
+  if (!localAppData.empty()) {
+    cachePath = joinPath(localAppData, L"wsudo\\commands.cache");
+  }
+  return CommandResolver{getEnvironment(L"PATH"), pathExt,
+                         std::move(cachePath)};
+}
+
+std::wstring CommandResolver::resolve(std::wstring_view command) {
+  if (command.empty()) {
+    return std::wstring{};
+  }
+  if (command.find_first_of(L"\\/:") != command.npos) {
+    return resolvePath(command);
+  }
+
+  auto cached = std::find_if(_entries.begin(), _entries.end(),
+                             [command](const Entry &entry) {
+                               return equalsIgnoreCase(entry.command, command);
+                             });
+  if (cached != _entries.end()) {
+    // Checking a directory can drop entries, so copy this one first.
+    auto entry = *cached;
+    uint32_t i = 0;
+    while (i <= entry.directory && checkDirectory(i)) {
+      ++i;
+    }
+    if (i > entry.directory) {
+      return joinPath(_directories[entry.directory], entry.fileName);
+    }
+  }
+
+  for (uint32_t i = 0; i < _directories.size(); ++i) {
+    checkDirectory(i);
+    auto fileName = findInDirectory(i, command);
+    if (fileName.empty()) {
+      continue;
+    }
+    if (_entries.size() >= MaxEntries) {
+      _entries.erase(_entries.begin());
+    }
+    auto path = joinPath(_directories[i], fileName);
+    _entries.push_back(Entry{std::wstring{command}, std::move(fileName), i});
+    _dirty = true;
+    return path;
+  }
+  return std::wstring{};
+}
+
+bool CommandResolver::checkDirectory(uint32_t i) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  uint64_t writeTime = Missing;
+  if (GetFileAttributesExW(_directories[i].c_str(), GetFileExInfoStandard,
+                           &data) &&
+      (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+  {
+    writeTime = (uint64_t{data.ftLastWriteTime.dwHighDateTime} << 32) |
+                data.ftLastWriteTime.dwLowDateTime;
+  }
+  if (writeTime == _writeTimes[i]) {
+    return true;
+  }
+
+  // Anything found in this directory or past it may now be shadowed or gone.
+  _writeTimes[i] = writeTime;
+  _entries.erase(std::remove_if(_entries.begin(), _entries.end(),
+                                [i](const Entry &entry) {
+                                  return entry.directory >= i;
+                                }),
+                 _entries.end());
+  _dirty = true;
+  return false;
+}
+
+std::wstring
+CommandResolver::findInDirectory(uint32_t i, std::wstring_view command) const
+{
+  if (_writeTimes[i] == Missing) {
+    return std::wstring{};
+  }
+  auto base = joinPath(_directories[i], command);
+  if (hasExtension(command)) {
+    return isFile(base) ? std::wstring{command} : std::wstring{};
+  }
+
+  // One directory query covers every extension; pick the one that comes
+  // first in PATHEXT.
+  auto pattern = base + L".*";
+  WIN32_FIND_DATAW data;
+  HANDLE find = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data,
+                                 FindExSearchNameMatch, nullptr, 0);
+  if (find == INVALID_HANDLE_VALUE) {
+    return std::wstring{};
+  }
+  WSUDO_SCOPEEXIT { FindClose(find); };
+  size_t best = _extensions.size();
+  std::wstring bestName;
+  do {
+    std::wstring_view name{data.cFileName};
+    if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+        name.length() <= command.length() ||
+        !equalsIgnoreCase(name.substr(0, command.length()), command))
+    {
+      continue;
+    }
+    auto extension = name.substr(command.length());
+    for (size_t e = 0; e < best; ++e) {
+      if (equalsIgnoreCase(extension, _extensions[e])) {
+        best = e;
+        bestName = name;
+        break;
+      }
+    }
+  } while (FindNextFileW(find, &data));
+  return bestName;
+}
+
+std::wstring CommandResolver::resolvePath(std::wstring_view command) const {
+  std::wstring relative{command};
+  std::wstring path;
+  DWORD length = GetFullPathNameW(relative.c_str(), 0, nullptr, nullptr);
+  if (length == 0) {
+    return path;
+  }
+  path.resize(length);
+  length = GetFullPathNameW(relative.c_str(), length, path.data(), nullptr);
+  path.resize(length);
+
+  if (!hasExtension(command)) {
+    for (auto &extension : _extensions) {
+      if (isFile(path + extension)) {
+        return path + extension;
+      }
+    }
+  }
+  // An explicit path may name an executable with any extension.
+  return isFile(path) ? path : std::wstring{};
+}
+
+bool CommandResolver::hasExtension(std::wstring_view command) const {
+  for (auto &extension : _extensions) {
+    if (command.length() > extension.length() &&
+        equalsIgnoreCase(command.substr(command.length() - extension.length()),
+                         extension))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CommandResolver::load() {
+  HANDLE rawFile = CreateFileW(_cachePath.c_str(), GENERIC_READ,
+                               FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (rawFile == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  HObject file{rawFile};
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart > MaxCacheFileSize) {
+    return;
+  }
+  std::vector<char> data(static_cast<size_t>(size.QuadPart));
+  DWORD bytes;
+  if (!ReadFile(file, data.data(), static_cast<DWORD>(data.size()), &bytes,
+                nullptr) ||
+      bytes != data.size())
+  {
+    return;
+  }
+
+  size_t offset = 0;
+  auto read = [&](void *out, size_t count) {
+    if (data.size() - offset < count) {
+      return false;
+    }
+    std::memcpy(out, data.data() + offset, count);
+    offset += count;
+    return true;
+  };
+  auto readString = [&](std::wstring &out) {
+    uint32_t length;
+    if (!read(&length, sizeof(length)) ||
+        (data.size() - offset) / sizeof(wchar_t) < length)
+    {
+      return false;
+    }
+    out.resize(length);
+    return read(out.data(), length * sizeof(wchar_t));
+  };
+
+  CacheHeader header;
+  if (!read(&header, sizeof(header)) ||
+      std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) ||
+      header.version != CacheVersion ||
+      header.environmentHash != _environmentHash ||
+      header.directoryCount != _directories.size() ||
+      header.entryCount > MaxEntries)
+  {
+    // Written for a different PATH; start over.
+    return;
+  }
+  std::vector<uint64_t> writeTimes(_directories.size());
+  if (!read(writeTimes.data(), writeTimes.size() * sizeof(uint64_t))) {
+    return;
+  }
+  std::vector<Entry> entries(header.entryCount);
+  for (auto &entry : entries) {
+    if (!read(&entry.directory, sizeof(entry.directory)) ||
+        entry.directory >= _directories.size() ||
+        !readString(entry.command) || !readString(entry.fileName))
+    {
+      return;
+    }
+  }
+  _writeTimes = std::move(writeTimes);
+  _entries = std::move(entries);
+}
+
+bool CommandResolver::save() {
+  if (!_dirty || _cachePath.empty()) {
+    return true;
+  }
+
+  std::vector<char> data;
+  auto write = [&data](const void *in, size_t count) {
+    auto bytes = static_cast<const char *>(in);
+    data.insert(data.end(), bytes, bytes + count);
+  };
+  auto writeString = [&write](const std::wstring &in) {
+    auto length = static_cast<uint32_t>(in.length());
+    write(&length, sizeof(length));
+    write(in.data(), in.length() * sizeof(wchar_t));
+  };
+  CacheHeader header{};
+  std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+  header.version = CacheVersion;
+  header.environmentHash = _environmentHash;
+  header.directoryCount = static_cast<uint32_t>(_directories.size());
+  header.entryCount = static_cast<uint32_t>(_entries.size());
+  write(&header, sizeof(header));
+  write(_writeTimes.data(), _writeTimes.size() * sizeof(uint64_t));
+  for (auto &entry : _entries) {
+    write(&entry.directory, sizeof(entry.directory));
+    writeString(entry.command);
+    writeString(entry.fileName);
+  }
+
+  if (auto slash = _cachePath.rfind(L'\\'); slash != _cachePath.npos) {
+    CreateDirectoryW(_cachePath.substr(0, slash).c_str(), nullptr);
+  }
+  // Write a private copy and swap it in, so concurrent clients never read a
+  // partial file.
+  auto tempPath = fmt::format(L"{}.{}", _cachePath, GetCurrentProcessId());
+  {
+    HANDLE rawFile = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr,
+                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                                 nullptr);
+    if (rawFile == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    HObject file{rawFile};
+    DWORD bytes;
+    if (!WriteFile(file, data.data(), static_cast<DWORD>(data.size()), &bytes,
+                   nullptr) ||
+        bytes != data.size())
+    {
+      file = nullptr;
+      DeleteFileW(tempPath.c_str());
+      return false;
+    }
+  }
+  if (!MoveFileExW(tempPath.c_str(), _cachePath.c_str(),
+                   MOVEFILE_REPLACE_EXISTING))
+  {
+    DeleteFileW(tempPath.c_str());
+    return false;
+  }
+  _dirty = false;
+  return true;
+}
@@ -0,0 +1,124 @@
+#include "wsudo/bufferpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <malloc.h>
+
+using namespace wsudo;
+using namespace wsudo::events;
+
+// Block header; the buffer follows it. The SList entry has to come first and
+// be aligned to MEMORY_ALLOCATION_ALIGNMENT.
+struct alignas(MEMORY_ALLOCATION_ALIGNMENT) BufferPool::Block {
+  SLIST_ENTRY entry;
+  unsigned sizeClass;
+
+  size_t capacity() const { return MinBufferSize << sizeClass; }
+  uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
+
+BufferPool::BufferPool(size_t maxMessageSize) noexcept
+  : _maxMessageSize{std::max(maxMessageSize, MinBufferSize)},
+    _classCount{1}
+{
+  while (_classCount < MaxClasses &&
+         (MinBufferSize << (_classCount - 1)) < _maxMessageSize)
+  {
+    ++_classCount;
+  }
+  _maxMessageSize = std::min(_maxMessageSize,
+                             MinBufferSize << (_classCount - 1));
+  for (auto &list : _freeLists) {
+    InitializeSListHead(&list);
+  }
+}
+
+BufferPool::~BufferPool() {
+  for (auto &list : _freeLists) {
+    auto entry = InterlockedFlushSList(&list);
+    while (entry) {
+      auto next = entry->Next;
+      _aligned_free(entry);
+      entry = next;
+    }
+  }
+}
+
+BufferPool::Block *BufferPool::take(size_t size) {
+  if (size > _maxMessageSize) {
+    return nullptr;
+  }
+  unsigned sizeClass = 0;
+  while ((MinBufferSize << sizeClass) < size) {
+    ++sizeClass;
+  }
+
+  if (auto entry = InterlockedPopEntrySList(&_freeLists[sizeClass])) {
+    return reinterpret_cast<Block *>(entry);
+  }
+
+  auto memory = _aligned_malloc(sizeof(Block) + (MinBufferSize << sizeClass),
+                                MEMORY_ALLOCATION_ALIGNMENT);
+  if (!memory) {
+    return nullptr;
+  }
+  ++_allocations;
+  auto block = new (memory) Block{};
+  block->sizeClass = sizeClass;
+  return block;
+}
+
+void BufferPool::give(Block *block) {
+  auto &list = _freeLists[block->sizeClass];
+  // The depth is only a hint; going slightly over the limit is harmless.
+  if (QueryDepthSList(&list) >= MaxCachedPerClass) {
+    _aligned_free(block);
+    return;
+  }
+  InterlockedPushEntrySList(&list, &block->entry);
+}
+
+uint8_t *IOBuffer::data() {
+  return _block ? _block->data() : nullptr;
+}
+
+const uint8_t *IOBuffer::data() const {
+  return _block ? _block->data() : nullptr;
+}
+
+size_t IOBuffer::capacity() const {
+  return _block ? _block->capacity() : 0;
+}
+
+bool IOBuffer::reserve(size_t capacity) {
+  if (capacity <= this->capacity()) {
+    return true;
+  }
+  auto block = _pool->take(capacity);
+  if (!block) {
+    return false;
+  }
+  if (_block) {
+    std::memcpy(block->data(), _block->data(), _size);
+    _pool->give(_block);
+  }
+  _block = block;
+  return true;
+}
+
+bool IOBuffer::resize(size_t size) {
+  if (!reserve(size)) {
+    return false;
+  }
+  _size = size;
+  return true;
+}
+
+void IOBuffer::release() {
+  if (_block) {
+    _pool->give(_block);
+    _block = nullptr;
+  }
+  _size = 0;
+}
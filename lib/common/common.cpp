@@ -1,10 +1,22 @@
 #include "wsudo/wsudo.h"
 
+#include <mutex>
+
 namespace wsudo {
 
 namespace log {
   std::shared_ptr<spdlog::logger> g_outLogger;
   std::shared_ptr<spdlog::logger> g_errLogger;
+  void (*g_createLoggers)() = nullptr;
+
+  void ensureLoggers() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+      if (!g_outLogger && g_createLoggers) {
+        g_createLoggers();
+      }
+    });
+  }
 }
 
 const wchar_t *const PipeFullPath = L"\\\\.\\pipe\\wsudo_token_server";
@@ -14,6 +26,8 @@ namespace msg {
     const char *const QuerySession = "QSES";
     const char *const Credential = "CRED";
     const char *const Bless = "BLES";
+    const char *const CredentialBless = "CRBL";
+    const char *const Stats = "STAT";
   }
 
   namespace server {
@@ -21,6 +35,7 @@ namespace msg {
     const char *const InvalidMessage = "MESG";
     const char *const InternalError = "INTE";
     const char *const AccessDenied = "DENY";
+    const char *const NoSession = "NSES";
   }
 } // namespace msg
 
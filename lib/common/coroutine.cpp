@@ -0,0 +1,128 @@
+#include "wsudo/coroutine.h"
+
+using namespace wsudo;
+using namespace wsudo::events;
+
+// Helpers {{{
+
+// Each frame starts with the arena it came from, or null for the heap, so
+// operator delete knows where to give it back.
+constexpr size_t FrameHeaderSize = alignof(std::max_align_t);
+static_assert(FrameHeaderSize >= sizeof(CoroutineArena *));
+
+constexpr size_t alignSize(size_t size) {
+  return (size + alignof(std::max_align_t) - 1) &
+         ~(alignof(std::max_align_t) - 1);
+}
+
+// }}}
+
+void *CoroutineArena::allocate(size_t size) noexcept {
+  size = alignSize(size);
+  if (size > Size - _top) {
+    return nullptr;
+  }
+  void *block = _storage + _top;
+  _top += size;
+  ++_live;
+  return block;
+}
+
+void CoroutineArena::deallocate(void *) noexcept {
+  // Frames usually come and go one at a time, so this is enough to keep
+  // reusing the same space.
+  if (--_live == 0) {
+    _top = 0;
+  }
+}
+
+void *EventTask::promise_type::allocateFrame(size_t size,
+                                             CoroutineArena *arena)
+{
+  size += FrameHeaderSize;
+  void *block = arena ? arena->allocate(size) : nullptr;
+  if (!block) {
+    arena = nullptr;
+    block = ::operator new(size);
+  }
+  *static_cast<CoroutineArena **>(block) = arena;
+  return static_cast<std::byte *>(block) + FrameHeaderSize;
+}
+
+void EventTask::promise_type::operator delete(void *frame, size_t) noexcept {
+  void *block = static_cast<std::byte *>(frame) - FrameHeaderSize;
+  if (auto arena = *static_cast<CoroutineArena **>(block)) {
+    arena->deallocate(block);
+  } else {
+    ::operator delete(block);
+  }
+}
+
+IOAwaiter EventCoroutineHandler::connect() {
+  if (ConnectNamedPipe(fileHandle(), &_overlapped)) {
+    _ioStatus = EventStatus::Finished;
+    return IOAwaiter{_ioStatus};
+  }
+  switch (GetLastError()) {
+  case ERROR_IO_PENDING:
+    _connecting = true;
+    _ioStatus = EventStatus::Ok;
+    break;
+  case ERROR_PIPE_CONNECTED:
+    // Nothing was queued, so there is no overlapped result to collect.
+    _ioStatus = EventStatus::Finished;
+    break;
+  default:
+    log::error("ConnectNamedPipe failed: {}", lastErrorString());
+    _ioStatus = EventStatus::Failed;
+    break;
+  }
+  return IOAwaiter{_ioStatus};
+}
+
+bool EventCoroutineHandler::reset() {
+  _task = EventTask{};
+  _connecting = false;
+  _ioStatus = EventStatus::Ok;
+  return EventOverlappedIO::reset();
+}
+
+EventStatus EventCoroutineHandler::operator()(EventListener &listener) {
+  if (!_task) {
+    _task = run();
+  } else if (_connecting) {
+    if (!HasOverlappedIoCompleted(&_overlapped)) {
+      return EventStatus::Ok;
+    }
+    _connecting = false;
+    DWORD dummyBytesTransferred;
+    if (GetOverlappedResult(fileHandle(), &_overlapped,
+                            &dummyBytesTransferred, false))
+    {
+      _ioStatus = EventStatus::Finished;
+    } else {
+      if (GetLastError() == ERROR_BROKEN_PIPE) {
+        log::info("Connection ended by client.");
+      } else {
+        log::error("Error finalizing connection: {}", lastErrorString());
+      }
+      _ioStatus = EventStatus::Failed;
+    }
+  } else {
+    // A read or write that went pending. Ok means there is more to move.
+    _ioStatus = EventOverlappedIO::operator()(listener);
+    if (_ioStatus == EventStatus::Ok) {
+      return EventStatus::Ok;
+    }
+  }
+
+  // Runs until the next IO that has to wait, or to the end. Any IO that
+  // finishes right away along the way is handled without coming back here.
+  _task.resume();
+  if (!_task.done()) {
+    return EventStatus::Ok;
+  }
+  auto status = _task.status();
+  _task = EventTask{};
+  return status;
+}
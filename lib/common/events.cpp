@@ -1,6 +1,9 @@
 #include "wsudo/events.h"
 #include "wsudo/wsudo.h"
 
+#include <algorithm>
+#include <thread>
+
 using namespace wsudo;
 using namespace wsudo::events;
 
@@ -15,58 +18,150 @@ bool EventHandler::reset() {
   return false;
 }
 
+bool EventHandler::bindCompletionPort(HANDLE, ULONG_PTR) {
+  // Most handlers only have an event to wait on.
+  return false;
+}
+
+EventStatus EventHandler::timeout(EventListener &, TimerId) {
+  return EventStatus::Ok;
+}
+
 // }}} EventHandler
 
 // {{{ EventListener
 
+EventListener::EventListener(EventBackend backend, EventDispatch dispatch)
+  : _backend{backend},
+    _dispatch{dispatch},
+    _timers{GetTickCount64()}
+{
+  if (_backend == EventBackend::CompletionPort) {
+    // Allow as many concurrent workers as there are processors.
+    _port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+    if (!_port) {
+      log::critical("CreateIoCompletionPort failed: {}", lastErrorString());
+    }
+  }
+}
+
+EventListener::~EventListener() {
+  // Wait callbacks reference the entries, so they have to be gone before the
+  // entries are freed.
+  for (auto &slot : _slots) {
+    if (slot.portEntry && slot.portEntry->wait) {
+      UnregisterWaitEx(slot.portEntry->wait, INVALID_HANDLE_VALUE);
+    }
+  }
+  // Handlers may cancel their timers on the way out.
+  _slots.clear();
+}
+
+EventHandler &EventListener::add(std::unique_ptr<EventHandler> handler) {
+  std::unique_lock<std::shared_mutex> lock{_mutex};
+  uint32_t index;
+  if (_freeSlot != Nil) {
+    index = _freeSlot;
+    _freeSlot = _slots[index].dense;
+  } else {
+    index = static_cast<uint32_t>(_slots.size());
+    assert(index < IdIndexMask);
+    _slots.emplace_back();
+  }
+
+  auto &slot = _slots[index];
+  slot.handler = std::move(handler);
+  slot.dense = static_cast<uint32_t>(_events.size());
+  auto &ref = *slot.handler;
+  ref._key = makeId(index, slot.generation);
+  _events.emplace_back(ref.event());
+  _dense.emplace_back(index);
+  if (_backend == EventBackend::CompletionPort) {
+    attach(slot);
+  }
+  return ref;
+}
+
+auto EventListener::slotFor(HandlerId id) -> Slot * {
+  auto index = static_cast<uint32_t>(id & IdIndexMask);
+  if (index >= _slots.size()) {
+    return nullptr;
+  }
+  auto &slot = _slots[index];
+  if (!slot.handler || makeId(index, slot.generation) != id) {
+    return nullptr;
+  }
+  return &slot;
+}
+
+auto EventListener::slotFor(HandlerId id) const -> const Slot * {
+  return const_cast<EventListener *>(this)->slotFor(id);
+}
+
+std::shared_ptr<EventListener::PortEntry>
+EventListener::portEntry(HandlerId id)
+{
+  std::shared_lock<std::shared_mutex> lock{_mutex};
+  auto slot = slotFor(id);
+  return slot ? slot->portEntry : nullptr;
+}
+
+bool EventListener::contains(HandlerId id) const {
+  std::shared_lock<std::shared_mutex> lock{_mutex};
+  return slotFor(id) != nullptr;
+}
+
+bool EventListener::wake(HandlerId id) {
+  std::shared_lock<std::shared_mutex> lock{_mutex};
+  auto slot = slotFor(id);
+  return slot && SetEvent(slot->handler->event());
+}
+
 EventStatus EventListener::next(DWORD timeout) {
-  log::trace("Waiting on {} events.", _events.size());
+  bool batched = _dispatch == EventDispatch::Batched;
+  if (_backend == EventBackend::CompletionPort) {
+    return batched ? nextCompletionBatched(timeout) : nextCompletion(timeout);
+  }
+  return batched ? nextWaitMultipleBatched(timeout)
+                 : nextWaitMultiple(timeout);
+}
+
+EventStatus EventListener::nextWaitMultiple(DWORD timeout) {
+  WSUDO_LOG_TRACE("Waiting on {} events.", _events.size());
 
   if (_events.size() == 0) {
     return EventStatus::Finished;
   }
 
+  bool timerWait;
   auto waitResult = WaitForMultipleObjects(
-    static_cast<DWORD>(_events.size()), &_events[0], false, timeout
+    static_cast<DWORD>(_events.size()), &_events[0], false,
+    waitTimeout(timeout, timerWait)
   );
 
   if (waitResult == WAIT_TIMEOUT) {
-    log::error("WaitForMultipleObjects timed out.");
-    return EventStatus::Failed;
+    if (!timerWait) {
+      log::error("WaitForMultipleObjects timed out.");
+      return EventStatus::Failed;
+    }
   } else if (waitResult >= WAIT_OBJECT_0 &&
              waitResult < WAIT_OBJECT_0 + _events.size())
   {
     size_t index = static_cast<size_t>(waitResult - WAIT_OBJECT_0);
-    log::trace("Event #{} signaled.", index);
+    auto &handler = *_slots[_dense[index]].handler;
+    WSUDO_LOG_TRACE("Event #{} signaled.", handler.key());
 
-    switch ((*_handlers[index])(*this)) {
-    case EventStatus::Ok:
-      log::trace("Event #{} returned Ok.", index);
-      break;
-    case EventStatus::Finished:
-      if (_handlers[index]->reset()) {
-        log::trace("Event #{} returned Finished and was reset.", index);
-      } else {
-        log::debug("Event #{} returned Finished and will be removed.", index);
-        remove(index);
-      }
-      break;
-    case EventStatus::Failed:
-      if (_handlers[index]->reset()) {
-        log::warn("Event #{} returned Failed, but reset succeeded.", index);
-      } else {
-        log::error("Event #{} returned Failed.", index);
-        remove(index);
-      }
-      break;
+    if (!dispatch(handler)) {
+      remove(handler.key());
     }
   } else if (waitResult >= WAIT_ABANDONED_0 &&
              waitResult < WAIT_ABANDONED_0 + _events.size())
 
   {
     size_t index = (size_t)(waitResult - WAIT_ABANDONED_0);
-    log::error("Mutex abandoned state signaled for handler #{}.", index);
-    remove(index);
+    auto id = _slots[_dense[index]].handler->key();
+    log::error("Mutex abandoned state signaled for handler #{}.", id);
+    remove(id);
   } else if (waitResult == WAIT_FAILED) {
     log::critical("WaitForMultipleObjects failed: {}",
                   lastErrorString());
@@ -77,12 +172,246 @@ EventStatus EventListener::next(DWORD timeout) {
     return EventStatus::Failed;
   }
 
+  runTimers();
+
+  return _events.size() > 0 ? EventStatus::Ok : EventStatus::Finished;
+}
+
+EventStatus EventListener::nextWaitMultipleBatched(DWORD timeout) {
+  auto count = _events.size();
+  WSUDO_LOG_TRACE("Waiting on {} events.", count);
+
+  if (count == 0) {
+    return EventStatus::Finished;
+  }
+
+  // Rotate the handles so WaitForMultipleObjects, which reports the lowest
+  // signaled index, starts looking just past the last handler it woke for.
+  auto start = _rotation % count;
+  _waitOrder.assign(_events.cbegin() + start, _events.cend());
+  _waitOrder.insert(_waitOrder.end(), _events.cbegin(),
+                    _events.cbegin() + start);
+  _ready.clear();
+
+  // Only the first wait blocks. Each later one looks at the handles after
+  // the last one found, so every handle that was ready is picked up before
+  // any handler runs, with one call per ready handler.
+  bool timerWait;
+  auto waitMs = waitTimeout(timeout, timerWait);
+  auto total = static_cast<DWORD>(count);
+  DWORD offset = 0;
+  while (offset < total) {
+    auto remaining = total - offset;
+    auto waitResult = WaitForMultipleObjects(remaining, &_waitOrder[offset],
+                                             false, waitMs);
+    DWORD position;
+    bool abandoned = false;
+    if (waitResult == WAIT_TIMEOUT) {
+      if (_ready.empty() && !timerWait) {
+        log::error("WaitForMultipleObjects timed out.");
+        return EventStatus::Failed;
+      }
+      break;
+    } else if (waitResult >= WAIT_OBJECT_0 &&
+               waitResult < WAIT_OBJECT_0 + remaining)
+    {
+      position = waitResult - WAIT_OBJECT_0;
+    } else if (waitResult >= WAIT_ABANDONED_0 &&
+               waitResult < WAIT_ABANDONED_0 + remaining)
+    {
+      position = waitResult - WAIT_ABANDONED_0;
+      abandoned = true;
+    } else if (waitResult == WAIT_FAILED) {
+      log::critical("WaitForMultipleObjects failed: {}",
+                    lastErrorString());
+      return EventStatus::Failed;
+    } else {
+      log::critical("WaitForMultipleObjects returned 0x{:X}: {}", waitResult,
+                    lastErrorString());
+      return EventStatus::Failed;
+    }
+
+    auto dense = (start + offset + position) % count;
+    if (_ready.empty()) {
+      _rotation = dense + 1;
+    }
+    _ready.emplace_back(_slots[_dense[dense]].handler->key(), abandoned);
+    offset += position + 1;
+    waitMs = 0;
+  }
+
+  WSUDO_LOG_TRACE("{} events ready.", _ready.size());
+  for (auto [id, abandoned] : _ready) {
+    // Handlers run earlier in the batch may have removed this one.
+    EventHandler *handler;
+    {
+      std::shared_lock<std::shared_mutex> lock{_mutex};
+      auto slot = slotFor(id);
+      if (!slot) {
+        continue;
+      }
+      handler = slot->handler.get();
+    }
+    if (abandoned) {
+      log::error("Mutex abandoned state signaled for handler #{}.", id);
+    } else {
+      WSUDO_LOG_TRACE("Event #{} signaled.", id);
+      if (dispatch(*handler)) {
+        continue;
+      }
+    }
+    remove(id);
+  }
+
+  runTimers();
+
   return _events.size() > 0 ? EventStatus::Ok : EventStatus::Finished;
 }
 
-EventStatus EventListener::run(DWORD timeout) {
+EventStatus EventListener::nextCompletion(DWORD timeout) {
+  auto handlerCount = count();
+  WSUDO_LOG_TRACE("Waiting on {} events.", handlerCount);
+
+  if (handlerCount == 0) {
+    return EventStatus::Finished;
+  }
+
+  if (!_port) {
+    log::critical("No completion port to wait on.");
+    return EventStatus::Failed;
+  }
+
+  DWORD bytesTransferred;
+  ULONG_PTR key = 0;
+  LPOVERLAPPED overlapped;
+  bool timerWait;
+  if (!GetQueuedCompletionStatus(_port, &bytesTransferred, &key, &overlapped,
+                                 waitTimeout(timeout, timerWait)))
+  {
+    if (!overlapped) {
+      auto error = GetLastError();
+      if (error != WAIT_TIMEOUT) {
+        log::critical("GetQueuedCompletionStatus failed: {}",
+                      lastErrorString(error));
+        return EventStatus::Failed;
+      } else if (!timerWait) {
+        log::error("GetQueuedCompletionStatus timed out.");
+        return EventStatus::Failed;
+      }
+      // A timer is due; nothing was dequeued.
+      key = 0;
+    }
+    // Otherwise the IO itself failed. The handler will find out from
+    // GetOverlappedResult, so dispatch it as usual.
+  }
+
+  if (key != 0) {
+    if (auto entry = portEntry(key)) {
+      dispatchEntry(*entry, overlapped ? Packet::IO : Packet::Wake);
+    } else {
+      WSUDO_LOG_DEBUG("Dropping completion for removed event key {}.", key);
+    }
+  }
+
+  runTimers();
+
+  return count() > 0 ? EventStatus::Ok : EventStatus::Finished;
+}
+
+EventStatus EventListener::nextCompletionBatched(DWORD timeout) {
+  auto handlerCount = count();
+  WSUDO_LOG_TRACE("Waiting on {} events.", handlerCount);
+
+  if (handlerCount == 0) {
+    return EventStatus::Finished;
+  }
+
+  if (!_port) {
+    log::critical("No completion port to wait on.");
+    return EventStatus::Failed;
+  }
+
+  OVERLAPPED_ENTRY entries[PortBatchSize];
+  ULONG dequeued = 0;
+  bool timerWait;
+  if (!GetQueuedCompletionStatusEx(_port, entries, PortBatchSize, &dequeued,
+                                   waitTimeout(timeout, timerWait), false))
+  {
+    auto error = GetLastError();
+    if (error != WAIT_TIMEOUT) {
+      log::critical("GetQueuedCompletionStatusEx failed: {}",
+                    lastErrorString(error));
+      return EventStatus::Failed;
+    } else if (!timerWait) {
+      log::error("GetQueuedCompletionStatusEx timed out.");
+      return EventStatus::Failed;
+    }
+    // A timer is due; nothing was dequeued.
+    dequeued = 0;
+  }
+
+  // Failed IO is dequeued like any other; handlers find out from
+  // GetOverlappedResult.
+  unsigned wakeups = 0;
+  for (ULONG i = 0; i < dequeued; ++i) {
+    auto key = entries[i].lpCompletionKey;
+    if (key == 0) {
+      ++wakeups;
+      continue;
+    }
+    if (auto entry = portEntry(key)) {
+      dispatchEntry(*entry, entries[i].lpOverlapped ? Packet::IO
+                                                    : Packet::Wake);
+    } else {
+      WSUDO_LOG_DEBUG("Dropping completion for removed event key {}.", key);
+    }
+  }
+  if (!_running && wakeups > 1) {
+    // Stop posts one wakeup per worker. Pass on the ones meant for others.
+    for (unsigned i = 1; i < wakeups; ++i) {
+      PostQueuedCompletionStatus(_port, 0, 0, nullptr);
+    }
+  }
+
+  runTimers();
+
+  return count() > 0 ? EventStatus::Ok : EventStatus::Finished;
+}
+
+EventStatus EventListener::run(DWORD timeout, unsigned threads) {
   _running = true;
 
+  if (_backend != EventBackend::CompletionPort || threads <= 1) {
+    return runWorker(timeout);
+  }
+
+  std::vector<EventStatus> workerStatus(threads - 1, EventStatus::Finished);
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  for (unsigned i = 0; i < threads - 1; ++i) {
+    workers.emplace_back([this, timeout, &status = workerStatus[i]] {
+      setThreadName(L"wsudo event worker");
+      status = runWorker(timeout);
+    });
+  }
+
+  auto status = runWorker(timeout);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto s : workerStatus) {
+    if (s == EventStatus::Failed) {
+      status = EventStatus::Failed;
+    }
+  }
+
+  return status;
+}
+
+EventStatus EventListener::runWorker(DWORD timeout) {
+  ++_workers;
+  WSUDO_SCOPEEXIT_THIS { --_workers; };
+
   auto status = EventStatus::Finished;
   while (_running) {
     status = next(timeout);
@@ -91,19 +420,286 @@ EventStatus EventListener::run(DWORD timeout) {
     }
   }
 
+  if (status == EventStatus::Failed) {
+    // Take the other workers down too.
+    stop();
+  }
   return status;
 }
 
-void EventListener::remove(size_t index) {
-  if (index >= _handlers.size()) {
-    log::error("Event index {} out of range.", index);
+void EventListener::stop() {
+  _running = false;
+  wakeWorkers();
+}
+
+void EventListener::wakeWorkers() {
+  if (_backend != EventBackend::CompletionPort || !_port) {
     return;
   }
+  for (unsigned i = _workers; i > 0; --i) {
+    PostQueuedCompletionStatus(_port, 0, 0, nullptr);
+  }
+}
 
-  assert(_handlers.size() == _events.size());
+TimerId EventListener::setTimeout(EventHandler &handler, DWORD ms) {
+  auto now = GetTickCount64();
+  TimerId id;
+  bool earlier;
+  {
+    std::lock_guard<std::mutex> lock{_timerMutex};
+    auto before = _timers.msUntilNext(now);
+    id = _timers.arm(now, ms, handler.key());
+    earlier = _timers.msUntilNext(now) < before;
+  }
+  if (earlier && _backend == EventBackend::CompletionPort && _port) {
+    // Workers may be sleeping past the new deadline; have one recompute its
+    // wait time. Handlers on the WaitMultiple backend are run by the waiting
+    // thread, which recomputes it anyway.
+    PostQueuedCompletionStatus(_port, 0, 0, nullptr);
+  }
+  return id;
+}
+
+bool EventListener::cancelTimeout(TimerId id) {
+  std::lock_guard<std::mutex> lock{_timerMutex};
+  return _timers.cancel(id);
+}
+
+DWORD EventListener::waitTimeout(DWORD timeout, bool &shortened) {
+  uint64_t timerMs;
+  {
+    std::lock_guard<std::mutex> lock{_timerMutex};
+    timerMs = _timers.msUntilNext(GetTickCount64());
+  }
+  shortened = timerMs < timeout;
+  return shortened ? static_cast<DWORD>(timerMs) : timeout;
+}
+
+void EventListener::runTimers() {
+  std::vector<TimerWheel::Expired> expired;
+  {
+    std::lock_guard<std::mutex> lock{_timerMutex};
+    _timers.advance(GetTickCount64(), expired);
+  }
+
+  for (auto [id, key] : expired) {
+    if (_backend == EventBackend::CompletionPort) {
+      if (auto entry = portEntry(key)) {
+        dispatchEntry(*entry, Packet::Timeout, id);
+      }
+      continue;
+    }
+
+    // Only this thread removes handlers on this backend.
+    EventHandler *handler;
+    {
+      std::shared_lock<std::shared_mutex> lock{_mutex};
+      auto slot = slotFor(key);
+      if (!slot) {
+        continue;
+      }
+      handler = slot->handler.get();
+    }
+    WSUDO_LOG_TRACE("Event #{} timed out.", key);
+    if (!apply(*handler, handler->timeout(*this, id))) {
+      remove(key);
+    }
+  }
+}
+
+bool EventListener::dispatch(EventHandler &handler) {
+  return apply(handler, handler(*this));
+}
 
-  _events.erase(_events.cbegin() + index);
-  _handlers.erase(_handlers.cbegin() + index);
+bool EventListener::apply(EventHandler &handler, EventStatus status) {
+  auto id = handler.key();
+  switch (status) {
+  case EventStatus::Ok:
+    WSUDO_LOG_TRACE("Event #{} returned Ok.", id);
+    return true;
+  case EventStatus::Finished:
+    if (handler.reset()) {
+      WSUDO_LOG_TRACE("Event #{} returned Finished and was reset.", id);
+      return true;
+    }
+    WSUDO_LOG_DEBUG("Event #{} returned Finished and will be removed.", id);
+    return false;
+  case EventStatus::Failed:
+    if (handler.reset()) {
+      log::warn("Event #{} returned Failed, but reset succeeded.", id);
+      return true;
+    }
+    log::error("Event #{} returned Failed.", id);
+    return false;
+  }
+
+  WSUDO_UNREACHABLE("Invalid EventStatus");
+}
+
+void EventListener::dispatchEntry(PortEntry &entry, Packet packet,
+                                  TimerId timer)
+{
+  std::unique_lock<std::mutex> lock{entry.mutex};
+  if (entry.removed) {
+    WSUDO_LOG_DEBUG("Dropping completion for removed event key {}.", entry.key);
+    return;
+  }
+  if (entry.running) {
+    // Leave it with the worker that has it; that worker picks this up when
+    // the current step returns.
+    switch (packet) {
+    case Packet::IO:
+      ++entry.pendingIO;
+      break;
+    case Packet::Wake:
+      ++entry.pendingWakes;
+      break;
+    case Packet::Timeout:
+      entry.pendingTimeouts.push_back(timer);
+      break;
+    }
+    return;
+  }
+
+  entry.running = true;
+  while (true) {
+    bool keep;
+    lock.unlock();
+    if (packet == Packet::Timeout) {
+      WSUDO_LOG_TRACE("Event key {} timed out.", entry.key);
+      keep = apply(*entry.handler, entry.handler->timeout(*this, timer));
+    } else {
+      WSUDO_LOG_TRACE("Event key {} signaled ({}).", entry.key,
+                      packet == Packet::IO ? "IO completed" : "event set");
+      keep = dispatch(*entry.handler);
+    }
+    lock.lock();
+
+    if (!keep) {
+      entry.removed = true;
+      entry.running = false;
+      lock.unlock();
+      remove(entry.key);
+      return;
+    }
+
+    if (packet == Packet::Wake) {
+      // The wait only fires once; set it up for the next wakeup.
+      armWait(entry);
+    }
+
+    if (entry.pendingIO) {
+      --entry.pendingIO;
+      packet = Packet::IO;
+    } else if (entry.pendingWakes) {
+      --entry.pendingWakes;
+      packet = Packet::Wake;
+    } else if (!entry.pendingTimeouts.empty()) {
+      timer = entry.pendingTimeouts.back();
+      entry.pendingTimeouts.pop_back();
+      packet = Packet::Timeout;
+    } else {
+      break;
+    }
+  }
+  entry.running = false;
+}
+
+void EventListener::attach(Slot &slot) {
+  auto &handler = *slot.handler;
+  auto key = handler.key();
+  slot.portEntry = std::make_shared<PortEntry>();
+  auto &entry = *slot.portEntry;
+  entry.port = _port;
+  entry.handler = &handler;
+  entry.key = key;
+
+  if (handler.bindCompletionPort(_port, key)) {
+    WSUDO_LOG_TRACE("Event key {} bound to completion port.", key);
+  }
+  // Even IO handlers need the wait for manual wakeups.
+  std::lock_guard<std::mutex> lock{entry.mutex};
+  armWait(entry);
+}
+
+bool EventListener::armWait(PortEntry &entry) {
+  if (entry.wait) {
+    // One-shot waits still have to be unregistered. This doesn't block and
+    // the callback has already run, so a pending result is fine.
+    UnregisterWaitEx(entry.wait, nullptr);
+    entry.wait = nullptr;
+  }
+  if (!RegisterWaitForSingleObject(&entry.wait, entry.handler->event(),
+                                   &EventListener::waitCallback, &entry,
+                                   INFINITE,
+                                   WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD))
+  {
+    log::error("Event key {}: RegisterWaitForSingleObject failed: {}",
+               entry.key, lastErrorString());
+    entry.wait = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void CALLBACK EventListener::waitCallback(PVOID context, BOOLEAN) {
+  auto &entry = *static_cast<PortEntry *>(context);
+  PostQueuedCompletionStatus(entry.port, 0, entry.key, nullptr);
+}
+
+void EventListener::remove(HandlerId id) {
+  std::unique_ptr<EventHandler> handler;
+  {
+    std::unique_lock<std::shared_mutex> lock{_mutex};
+    handler = removeLocked(id);
+  }
+  // Destroyed unlocked: handler destructors can take other locks whose
+  // holders call wake(), which needs _mutex.
+}
+
+std::unique_ptr<EventHandler> EventListener::removeLocked(HandlerId id) {
+  auto slot = slotFor(id);
+  if (!slot) {
+    log::error("Event #{} is not in the list.", id);
+    return nullptr;
+  }
+
+  assert(_dense.size() == _events.size());
+
+  if (auto &entry = slot->portEntry; entry) {
+    // The entry is already marked removed, so no other worker will rearm
+    // the wait. Block until the callback can't touch the entry anymore.
+    if (entry->wait) {
+      UnregisterWaitEx(entry->wait, INVALID_HANDLE_VALUE);
+      entry->wait = nullptr;
+    }
+    entry.reset();
+  }
+
+  // Fill the gap with the last event so the wait list stays packed.
+  auto dense = slot->dense;
+  _events[dense] = _events.back();
+  _dense[dense] = _dense.back();
+  _slots[_dense[dense]].dense = dense;
+  _events.pop_back();
+  _dense.pop_back();
+
+  auto index = static_cast<uint32_t>(id & IdIndexMask);
+  auto handler = std::move(slot->handler);
+  slot->generation = (slot->generation + 1) &
+                     static_cast<uint32_t>(IdIndexMask);
+  if (slot->generation == 0) {
+    // Keep IDs nonzero.
+    slot->generation = 1;
+  }
+  slot->dense = _freeSlot;
+  _freeSlot = index;
+
+  if (_events.empty()) {
+    // Let idle workers see there is nothing left to do.
+    wakeWorkers();
+  }
+  return handler;
 }
 
 // }}} EventListener
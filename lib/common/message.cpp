@@ -0,0 +1,96 @@
+#include "wsudo/message.h"
+
+#include <cstddef>
+#include <cstring>
+#include <cwchar>
+
+using namespace wsudo;
+using namespace wsudo::msg;
+
+FrameWriter::FrameWriter(std::vector<char> &buffer, const char *type)
+  : _buffer{buffer}
+{
+  assert(strlen(type) == 4);
+  FrameHeader header{};
+  std::memcpy(header.type, type, 4);
+  header.version = FrameVersion;
+  _buffer.clear();
+  append(&header, sizeof(FrameHeader));
+}
+
+FrameWriter &FrameWriter::string(std::wstring_view value) {
+  auto count = static_cast<uint32_t>(value.length());
+  const wchar_t nul = 0;
+  append(&count, sizeof(uint32_t));
+  append(value.data(), value.length() * sizeof(wchar_t));
+  append(&nul, sizeof(wchar_t));
+  return *this;
+}
+
+FrameWriter &FrameWriter::handle(HANDLE value) {
+  auto wide = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value));
+  append(&wide, sizeof(uint64_t));
+  return *this;
+}
+
+size_t FrameWriter::finish() {
+  auto length = static_cast<uint32_t>(_buffer.size() - sizeof(FrameHeader));
+  std::memcpy(_buffer.data() + offsetof(FrameHeader, length), &length,
+              sizeof(uint32_t));
+  return _buffer.size();
+}
+
+void FrameWriter::append(const void *data, size_t size) {
+  auto bytes = static_cast<const char *>(data);
+  _buffer.insert(_buffer.end(), bytes, bytes + size);
+}
+
+FrameReader::FrameReader(const void *data, size_t size) noexcept {
+  if (size < sizeof(FrameHeader)) {
+    return;
+  }
+  std::memcpy(&_header, data, sizeof(FrameHeader));
+  if (_header.version != FrameVersion ||
+      _header.length != size - sizeof(FrameHeader))
+  {
+    return;
+  }
+  _cursor = static_cast<const uint8_t *>(data) + sizeof(FrameHeader);
+  _end = _cursor + _header.length;
+  _valid = true;
+}
+
+bool FrameReader::is(const char *type) const {
+  return _valid && !std::memcmp(_header.type, type, 4);
+}
+
+bool FrameReader::string(std::wstring_view &value) {
+  uint32_t count;
+  if (!_valid || static_cast<size_t>(_end - _cursor) < sizeof(uint32_t)) {
+    return false;
+  }
+  std::memcpy(&count, _cursor, sizeof(uint32_t));
+  auto available = static_cast<size_t>(_end - _cursor) - sizeof(uint32_t);
+  if (count >= available / sizeof(wchar_t)) {
+    // No room for the characters and the NUL.
+    return false;
+  }
+  auto chars = reinterpret_cast<const wchar_t *>(_cursor + sizeof(uint32_t));
+  if (chars[count] != 0 || std::wmemchr(chars, 0, count)) {
+    return false;
+  }
+  value = std::wstring_view{chars, count};
+  _cursor += sizeof(uint32_t) + (count + 1) * sizeof(wchar_t);
+  return true;
+}
+
+bool FrameReader::handle(HANDLE &value) {
+  uint64_t wide;
+  if (!_valid || static_cast<size_t>(_end - _cursor) < sizeof(uint64_t)) {
+    return false;
+  }
+  std::memcpy(&wide, _cursor, sizeof(uint64_t));
+  value = reinterpret_cast<HANDLE>(static_cast<uintptr_t>(wide));
+  _cursor += sizeof(uint64_t);
+  return true;
+}
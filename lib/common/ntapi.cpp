@@ -0,0 +1,31 @@
+#include "wsudo/wsudo.h"
+
+#include <mutex>
+
+namespace wsudo::nt {
+
+Api g_api;
+
+bool loadApi() {
+  static std::once_flag once;
+  static bool complete = false;
+  std::call_once(once, [] {
+    auto ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (!ntdll) {
+      log::critical("Can't find ntdll: {}", lastErrorString());
+      return;
+    }
+    complete = true;
+#define WSUDO_NT_API_RESOLVE(name)                                        \
+    g_api.name = reinterpret_cast<name##_t>(GetProcAddress(ntdll, #name)); \
+    if (!g_api.name) {                                                     \
+      log::error("ntdll!{} not found: {}", #name, lastErrorString());      \
+      complete = false;                                                    \
+    }
+    WSUDO_NT_API_FUNCTIONS(WSUDO_NT_API_RESOLVE)
+#undef WSUDO_NT_API_RESOLVE
+  });
+  return complete;
+}
+
+} // namespace wsudo::nt
@@ -5,6 +5,9 @@ using namespace wsudo::events;
 
 // Helpers {{{
 
+static std::atomic<uint64_t> gs_bytesRead{0};
+static std::atomic<uint64_t> gs_bytesWritten{0};
+
 inline void setOverlappedOffset(LPOVERLAPPED overlapped, size_t offset) {
   overlapped->Pointer = reinterpret_cast<PVOID>(offset);
   // MSDN: Zero unused members before use.
@@ -14,28 +17,60 @@ inline void setOverlappedOffset(LPOVERLAPPED overlapped, size_t offset) {
 
 // }}}
 
-EventOverlappedIO::EventOverlappedIO(bool isEventSet) noexcept {
-  _overlapped.hEvent = CreateEventW(nullptr, false, isEventSet, nullptr);
+EventOverlappedIO::EventOverlappedIO(bool isEventSet,
+                                     BufferPool &bufferPool) noexcept
+  : _buffer{bufferPool},
+    _event{CreateEventW(nullptr, false, isEventSet, nullptr)}
+{
+  _overlapped.hEvent = _event;
 }
 
 EventOverlappedIO::~EventOverlappedIO() {
-  CloseHandle(_overlapped.hEvent);
+  CloseHandle(_event);
+}
+
+bool EventOverlappedIO::bindCompletionPort(HANDLE port, ULONG_PTR key) {
+  // Operations that finish immediately are handled inline by beginRead and
+  // beginWrite, so they must not queue a second notification. If this can't
+  // be set, stay on the event instead.
+  if (!SetFileCompletionNotificationModes(fileHandle(),
+                                          FILE_SKIP_COMPLETION_PORT_ON_SUCCESS |
+                                            FILE_SKIP_SET_EVENT_ON_HANDLE))
+  {
+    log::warn("SetFileCompletionNotificationModes failed: {}",
+              lastErrorString());
+    return false;
+  }
+  if (!CreateIoCompletionPort(fileHandle(), port, key, 0)) {
+    log::warn("CreateIoCompletionPort failed: {}", lastErrorString());
+    return false;
+  }
+  _overlapped.hEvent = nullptr;
+  return true;
 }
 
 EventStatus EventOverlappedIO::beginRead() {
+  // Read as much as fits, doubling the buffer when it fills up.
+  if (!_buffer.reserve(_offset + 1)) {
+    log::error("Message is over the {} byte limit.",
+               _buffer.pool().maxMessageSize());
+    _ioState = IOState::Failed;
+    return EventStatus::Failed;
+  }
   _ioState = IOState::Reading;
   setOverlappedOffset(&_overlapped, _offset);
-  _buffer.resize(_offset + ChunkSize);
+  _buffer.resize(_buffer.capacity());
 
-  if (ReadFile(fileHandle(), _buffer.data() + _offset, ChunkSize,
-               nullptr, &_overlapped))
+  if (ReadFile(fileHandle(), _buffer.data() + _offset,
+               static_cast<DWORD>(_buffer.size() - _offset), nullptr,
+               &_overlapped))
   {
     // Interpret the results.
     return endRead();
   }
   auto error = GetLastError();
   if (error == ERROR_IO_PENDING || error == ERROR_MORE_DATA) {
-    log::debug("Read in progress.");
+    WSUDO_LOG_DEBUG("Read in progress.");
     return EventStatus::Ok;
   } else {
     log::error("ReadFile failed: {}", lastErrorString(error));
@@ -49,7 +84,8 @@ EventStatus EventOverlappedIO::endRead() {
   if (GetOverlappedResult(fileHandle(), &_overlapped, &bytesTransferred, false))
   {
     _offset += bytesTransferred;
-    log::debug("Read finished: {} bytes.", _offset);
+    gs_bytesRead.fetch_add(bytesTransferred, std::memory_order_relaxed);
+    WSUDO_LOG_DEBUG("Read finished: {} bytes.", _offset);
     _buffer.resize(_offset);
     _ioState = IOState::Inactive;
     return EventStatus::Finished;
@@ -58,6 +94,9 @@ EventStatus EventOverlappedIO::endRead() {
   if (error == ERROR_IO_PENDING) {
     return EventStatus::Ok;
   } else if (error == ERROR_MORE_DATA) {
+    // The buffer is full but the message isn't done.
+    _offset += bytesTransferred;
+    gs_bytesRead.fetch_add(bytesTransferred, std::memory_order_relaxed);
     return beginRead();
   } else if (error == ERROR_BROKEN_PIPE) {
     log::info("Connection ended by client.");
@@ -74,12 +113,13 @@ EventStatus EventOverlappedIO::beginWrite() {
   setOverlappedOffset(&_overlapped, _offset);
 
   if (WriteFile(fileHandle(), _buffer.data() + _offset,
-                static_cast<DWORD>(_buffer.size()), nullptr, &_overlapped))
+                static_cast<DWORD>(_buffer.size() - _offset), nullptr,
+                &_overlapped))
   {
     // Interpret the results.
     return endWrite();
   } else if (GetLastError() == ERROR_IO_PENDING) {
-    log::trace("Write in progress.");
+    WSUDO_LOG_TRACE("Write in progress.");
     return EventStatus::Ok;
   } else {
     log::error("WriteFile failed: {}", lastErrorString());
@@ -93,8 +133,9 @@ EventStatus EventOverlappedIO::endWrite() {
   if (GetOverlappedResult(fileHandle(), &_overlapped, &bytesTransferred, false))
   {
     _offset += bytesTransferred;
+    gs_bytesWritten.fetch_add(bytesTransferred, std::memory_order_relaxed);
     if (_offset == _buffer.size()) {
-      log::debug("Write finished: {} bytes.", _offset);
+      WSUDO_LOG_DEBUG("Write finished: {} bytes.", _offset);
       _ioState = IOState::Inactive;
       return EventStatus::Finished;
     } else if (_offset > _buffer.size()) {
@@ -103,7 +144,7 @@ EventStatus EventOverlappedIO::endWrite() {
       _ioState = IOState::Inactive;
       return EventStatus::Finished;
     } else {
-      log::debug("Write in progress: {}%.", _offset / _buffer.size());
+      WSUDO_LOG_DEBUG("Write in progress: {}%.", _offset / _buffer.size());
       return beginWrite();
     }
   }
@@ -120,9 +161,18 @@ EventStatus EventOverlappedIO::endWrite() {
   return EventStatus::Failed;
 }
 
+uint64_t EventOverlappedIO::totalBytesRead() {
+  return gs_bytesRead.load(std::memory_order_relaxed);
+}
+
+uint64_t EventOverlappedIO::totalBytesWritten() {
+  return gs_bytesWritten.load(std::memory_order_relaxed);
+}
+
 bool EventOverlappedIO::reset() {
   _ioState = IOState::Inactive;
   _offset = 0;
+  _buffer.release();
   return false;
 }
 
@@ -0,0 +1,178 @@
+#include "wsudo/timerwheel.h"
+
+#include <algorithm>
+
+using namespace wsudo;
+using namespace wsudo::events;
+
+TimerWheel::TimerWheel(uint64_t nowMs) noexcept
+  : _now{nowMs / TickMs}
+{
+  _slots.fill(Nil);
+}
+
+TimerId TimerWheel::arm(uint64_t nowMs, uint64_t delayMs, ULONG_PTR key) {
+  uint32_t index;
+  if (_free != Nil) {
+    index = _free;
+    _free = _nodes[index].next;
+  } else {
+    index = static_cast<uint32_t>(_nodes.size());
+    _nodes.push_back(Node{0, 0, Nil, Nil, 1, Nil});
+  }
+
+  auto &node = _nodes[index];
+  node.expires = (nowMs + delayMs + TickMs - 1) / TickMs;
+  node.key = key;
+  // This tick's slot has already run.
+  insert(index, _now + 1);
+  ++_count;
+
+  return (static_cast<TimerId>(node.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+  auto index = static_cast<uint32_t>(id);
+  auto generation = static_cast<uint32_t>(id >> 32);
+  if (index >= _nodes.size()) {
+    return false;
+  }
+  auto &node = _nodes[index];
+  if (node.generation != generation || node.slot == Nil) {
+    return false;
+  }
+  unlink(index);
+  release(index);
+  --_count;
+  return true;
+}
+
+void TimerWheel::advance(uint64_t nowMs, std::vector<Expired> &expired) {
+  auto target = nowMs / TickMs;
+
+  while (_now < target) {
+    if (_count == 0) {
+      // Nothing to step through.
+      _now = target;
+      break;
+    }
+
+    ++_now;
+
+    // Move timers down from every coarser level that just wrapped, highest
+    // first so nothing lands in a slot that was already emptied.
+    unsigned top = 0;
+    while (top + 1 < Levels &&
+           (_now & ((uint64_t{1} << (LevelBits * (top + 1))) - 1)) == 0)
+    {
+      ++top;
+    }
+    for (unsigned level = top; level > 0; --level) {
+      cascade(level);
+    }
+
+    auto &head = _slots[_now & SlotMask];
+    while (head != Nil) {
+      auto index = head;
+      auto &node = _nodes[index];
+      unlink(index);
+      if (node.expires <= _now) {
+        expired.emplace_back(
+          (static_cast<TimerId>(node.generation) << 32) | index, node.key
+        );
+        release(index);
+        --_count;
+      } else {
+        insert(index, _now + 1);
+      }
+    }
+  }
+}
+
+uint64_t TimerWheel::msUntilNext(uint64_t nowMs) const {
+  if (_count == 0) {
+    return UINT64_MAX;
+  }
+
+  auto toMs = [nowMs](uint64_t tick) -> uint64_t {
+    auto ms = tick * TickMs;
+    return ms > nowMs ? ms - nowMs : 0;
+  };
+
+  // Finest level first; everything here is due within one rotation.
+  for (uint64_t tick = _now + 1; tick < _now + SlotsPerLevel; ++tick) {
+    if (_slots[tick & SlotMask] != Nil) {
+      return toMs(tick);
+    }
+  }
+
+  // Otherwise wake up for the next cascade, which may bring timers down.
+  return toMs(((_now >> LevelBits) + 1) << LevelBits);
+}
+
+void TimerWheel::insert(uint32_t index, uint64_t earliest) {
+  auto &node = _nodes[index];
+  node.expires = std::max(node.expires, earliest);
+
+  auto delta = node.expires - _now;
+  unsigned level = 0;
+  while (level + 1 < Levels &&
+         delta >= (uint64_t{1} << (LevelBits * (level + 1))))
+  {
+    ++level;
+  }
+  if (delta >= (uint64_t{1} << (LevelBits * Levels))) {
+    // Past the wheel's range; fire at the latest time it can hold.
+    node.expires = _now + (uint64_t{1} << (LevelBits * Levels)) - 1;
+  }
+
+  auto slot = level * SlotsPerLevel +
+              static_cast<uint32_t>((node.expires >> (LevelBits * level)) &
+                                    SlotMask);
+  node.slot = slot;
+  node.prev = Nil;
+  node.next = _slots[slot];
+  if (node.next != Nil) {
+    _nodes[node.next].prev = index;
+  }
+  _slots[slot] = index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+  auto &node = _nodes[index];
+  if (node.prev != Nil) {
+    _nodes[node.prev].next = node.next;
+  } else {
+    _slots[node.slot] = node.next;
+  }
+  if (node.next != Nil) {
+    _nodes[node.next].prev = node.prev;
+  }
+  node.slot = Nil;
+}
+
+void TimerWheel::release(uint32_t index) {
+  auto &node = _nodes[index];
+  ++node.generation;
+  if (node.generation == 0) {
+    // Keep IDs nonzero.
+    node.generation = 1;
+  }
+  node.next = _free;
+  _free = index;
+}
+
+void TimerWheel::cascade(unsigned level) {
+  auto slot = level * SlotsPerLevel +
+              static_cast<uint32_t>((_now >> (LevelBits * level)) & SlotMask);
+  auto index = _slots[slot];
+  _slots[slot] = Nil;
+  while (index != Nil) {
+    auto next = _nodes[index].next;
+    _nodes[index].slot = Nil;
+    // Cascades run before this tick's slot, so timers due now still fire on
+    // time.
+    insert(index, _now);
+    index = next;
+  }
+}
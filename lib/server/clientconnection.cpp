@@ -1,4 +1,6 @@
 #include "wsudo/server.h"
+#include "wsudo/message.h"
+#include "wsudo/metrics.h"
 
 #include <AclAPI.h>
 
@@ -7,28 +9,63 @@ using namespace wsudo::server;
 using namespace wsudo::events;
 
 ClientConnectionHandler::ClientConnectionHandler(
-  HObject pipe, int clientId, session::SessionManager &sessionManager
+  HObject pipe, int clientId, EventListener &listener,
+  NamedPipeHandleFactory &pipeFactory, session::SessionManager &sessionManager,
+  policy::Policy &policy, BufferPool &bufferPool
 ) noexcept
-  : EventOverlappedIO{true},
+  : EventOverlappedIO{true, bufferPool},
     _pipe{std::move(pipe)},
     _clientId{clientId},
+    _listener{listener},
+    _pipeFactory{pipeFactory},
     _sessionManager{sessionManager},
+    _policy{policy},
     _callback{&Self::beginConnect}
 {
 }
 
+ClientConnectionHandler::~ClientConnectionHandler() {
+  if (_pendingLogon) {
+    _pendingLogon->cancel(this);
+  }
+  clearTimer();
+  _pipeFactory.onClosed(_idle);
+}
+
 bool ClientConnectionHandler::reset() {
   EventOverlappedIO::reset();
 
-  _userToken = nullptr;
+  if (_pendingLogon) {
+    _pendingLogon->cancel(this);
+    _pendingLogon.reset();
+  }
+  _blessAfterLogon = nullptr;
+  _session.reset();
+  _clientProcess = nullptr;
+  clearTimer();
+  if (_retired) {
+    return false;
+  }
   if (!DisconnectNamedPipe(_pipe) &&
       GetLastError() != ERROR_PIPE_NOT_CONNECTED)
   {
     return false;
   }
-  log::debug("Client {}: Resetting connection.", _clientId);
+  if (!_idle) {
+    if (!_pipeFactory.onDisconnected()) {
+      WSUDO_LOG_DEBUG("Client {}: Enough idle instances; closing this one.",
+                      _clientId);
+      _retired = true;
+      return false;
+    }
+    _idle = true;
+  }
+  if (_pipeFactory.hasExtraIdle()) {
+    setTimer(PipeIdleTimeout);
+  }
+  WSUDO_LOG_DEBUG("Client {}: Resetting connection.", _clientId);
   _callback = &Self::beginConnect;
-  SetEvent(_overlapped.hEvent);
+  SetEvent(event());
   return true;
 }
 
@@ -45,39 +82,124 @@ EventStatus ClientConnectionHandler::operator()(EventListener &listener) {
 
   // No IO, so move on to the next step.
   if (!_callback || !_callback.call_and_swap(*this)) {
+    // A retired instance stopping is the expected outcome, not an error.
+    return _retired ? EventStatus::Finished : EventStatus::Failed;
+  }
+  return EventStatus::Ok;
+}
+
+EventStatus ClientConnectionHandler::timeout(EventListener &, TimerId id) {
+  if (id != _timer) {
+    // Canceled after it already fired.
+    return EventStatus::Ok;
+  }
+  _timer = 0;
+
+  if (_idle) {
+    if (!_pipeFactory.onIdleTimeout()) {
+      return EventStatus::Ok;
+    }
+    WSUDO_LOG_DEBUG("Client {}: Idle too long; closing this instance.",
+                    _clientId);
+    _idle = false;
+    _retired = true;
+  } else {
+    log::info("Client {}: Timed out waiting for a message.", _clientId);
+  }
+
+  // The aborted connect or read completes as a failure, which resets or
+  // retires the handler through the usual path.
+  if (!CancelIoEx(_pipe, &_overlapped) && GetLastError() != ERROR_NOT_FOUND) {
+    log::error("Client {}: CancelIoEx failed: {}", _clientId,
+               lastErrorString());
     return EventStatus::Failed;
   }
   return EventStatus::Ok;
 }
 
+void ClientConnectionHandler::setTimer(DWORD ms) {
+  clearTimer();
+  _timer = _listener.setTimeout(*this, ms);
+}
+
+void ClientConnectionHandler::clearTimer() {
+  if (_timer) {
+    _listener.cancelTimeout(_timer);
+    _timer = 0;
+  }
+}
+
+void ClientConnectionHandler::claimInstance() {
+  clearTimer();
+  if (_retired) {
+    // The idle timeout already took this instance out of the idle count,
+    // but a client connected before the wait was canceled. Serve it; the
+    // instance closes once the client leaves.
+    assert(!_idle);
+    return;
+  }
+  _idle = false;
+  if (!_pipeFactory.onConnected()) {
+    return;
+  }
+
+  auto pipe = _pipeFactory();
+  if (!pipe) {
+    return;
+  }
+  auto id = _pipeFactory.nextInstanceId();
+  WSUDO_LOG_DEBUG("Client {}: Pipe pool is low; adding instance {}.",
+                  _clientId, id);
+  _listener.emplace<ClientConnectionHandler>(std::move(pipe), id, _listener,
+                                             _pipeFactory, _sessionManager,
+                                             _policy, _buffer.pool());
+}
+
 void ClientConnectionHandler::createResponse(const char *header,
                                              std::string_view message)
+{
+  createResponse(header, message.data(), message.length());
+}
+
+void ClientConnectionHandler::createResponse(const char *header,
+                                             const void *body, size_t length)
 {
   assert(strlen(header) == 4);
-  size_t totalSize = 4 + message.length();
-  if (_buffer.size() < totalSize) {
-    _buffer.resize(totalSize);
+  if (!_buffer.resize(4 + length)) {
+    // Only send the header if the body doesn't fit.
+    length = 0;
+    _buffer.resize(4);
   }
   std::memcpy(_buffer.data(), header, 4);
-  if (message.length()) {
-    std::memcpy(_buffer.data() + 4, message.data(), message.length());
+  if (length) {
+    std::memcpy(_buffer.data() + 4, body, length);
   }
 }
 
 ClientConnectionHandler::Callback
 ClientConnectionHandler::beginConnect() {
+  if (_retired) {
+    // The idle timeout fired before this instance started listening.
+    return nullptr;
+  }
+  _phaseStart = metrics::now();
   if (ConnectNamedPipe(_pipe, &_overlapped)) {
-    log::trace("Client {}: connected.", _clientId);
+    WSUDO_LOG_TRACE("Client {}: connected.", _clientId);
+    metrics::record(metrics::Phase::Connect, _phaseStart, _clientId);
+    claimInstance();
     return read();
   }
 
   switch (GetLastError()) {
   case ERROR_IO_PENDING:
-    log::trace("Client {}: waiting for connection.", _clientId);
+    WSUDO_LOG_TRACE("Client {}: waiting for connection.", _clientId);
     return &Self::endConnect;
   case ERROR_PIPE_CONNECTED:
-    log::trace("Client {}: already connected; reading.", _clientId);
-    return endConnect();
+    // Nothing was queued, so there is no overlapped result to collect.
+    WSUDO_LOG_TRACE("Client {}: already connected; reading.", _clientId);
+    metrics::record(metrics::Phase::Connect, _phaseStart, _clientId);
+    claimInstance();
+    return read();
   default:
     log::error("Client {}: ConnectNamedPipe failed: {}", _clientId,
                lastErrorString());
@@ -91,6 +213,10 @@ ClientConnectionHandler::endConnect() {
   if (!GetOverlappedResult(_pipe, &_overlapped,
                            &dummyBytesTransferred, false))
   {
+    if (_retired) {
+      // Canceled by the idle timeout.
+      return nullptr;
+    }
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       log::info("Client {}: connection ended by client.", _clientId);
       return nullptr;
@@ -99,11 +225,15 @@ ClientConnectionHandler::endConnect() {
                lastErrorString());
     return nullptr;
   }
+  metrics::record(metrics::Phase::Connect, _phaseStart, _clientId);
+  claimInstance();
   return read();
 }
 
 ClientConnectionHandler::Callback
 ClientConnectionHandler::read() {
+  setTimer(ClientReadTimeout);
+  _phaseStart = metrics::now();
   switch (readToBuffer()) {
     case EventStatus::Failed:
       return nullptr;
@@ -118,23 +248,63 @@ ClientConnectionHandler::read() {
 
 ClientConnectionHandler::Callback
 ClientConnectionHandler::respond() {
-  Callback nextCb = &Self::resetConnection;
-  if (dispatchMessage()) {
-    nextCb = &Self::read;
+  clearTimer();
+  metrics::record(metrics::Phase::Read, _phaseStart, _clientId);
+  {
+    metrics::Span span{metrics::Phase::Dispatch, _clientId};
+    _keepConnection = dispatchMessage();
+  }
+  if (_pendingLogon) {
+    return waitForLogon();
+  }
+  return write();
+}
+
+ClientConnectionHandler::Callback
+ClientConnectionHandler::waitForLogon() {
+  auto &listener = _listener;
+  auto id = key();
+  if (_pendingLogon->notify(this, [&listener, id] { listener.wake(id); })) {
+    WSUDO_LOG_TRACE("Client {}: waiting for logon.", _clientId);
+    return &Self::finishLogon;
+  }
+  return finishLogon();
+}
+
+ClientConnectionHandler::Callback
+ClientConnectionHandler::finishLogon() {
+  if (!_pendingLogon->done()) {
+    // Signaled for some other reason; keep waiting.
+    return &Self::finishLogon;
   }
+  metrics::record(metrics::Phase::Logon, _phaseStart, _clientId);
+  auto logon = std::move(_pendingLogon);
+  _keepConnection = authenticated(logon->session(), logon->username());
+  return write();
+}
 
+ClientConnectionHandler::Callback
+ClientConnectionHandler::write() {
+  _phaseStart = metrics::now();
   switch (writeFromBuffer()) {
     case EventStatus::Ok:
-      return nextCb;
+      return &Self::responded;
     case EventStatus::Failed:
       return nullptr;
     case EventStatus::Finished:
-      return nextCb(*this);
+      return responded();
     default:
       WSUDO_UNREACHABLE("Invalid EventStatus");
   }
+}
 
-  return nextCb;
+ClientConnectionHandler::Callback
+ClientConnectionHandler::responded() {
+  metrics::record(metrics::Phase::Write, _phaseStart, _clientId);
+  if (_keepConnection) {
+    return read();
+  }
+  return resetConnection();
 }
 
 ClientConnectionHandler::Callback
@@ -147,76 +317,105 @@ ClientConnectionHandler::resetConnection() {
 }
 
 bool ClientConnectionHandler::dispatchMessage() {
-  if (_buffer.size() < 4) {
-    log::warn("Client {}: No message header found.", _clientId);
-    createResponse(msg::server::InvalidMessage, "No message header present");
+  msg::FrameReader frame{_buffer.data(), _buffer.size()};
+  if (!frame) {
+    log::warn("Client {}: Malformed message frame.", _clientId);
+    createResponse(msg::server::InvalidMessage, "Malformed message frame");
     return false;
   }
 
   char header[5];
   std::memcpy(header, _buffer.data(), 4);
   header[4] = 0;
-  log::debug("Client {}: Dispatching message '{}'.", _clientId, header);
+  WSUDO_LOG_DEBUG("Client {}: Dispatching message '{}'.", _clientId, header);
 
   // Check if the header is still the same on exit; that means we forgot
   // to set it.
   WSUDO_SCOPEEXIT_THIS {
-    if (_buffer.size() < 4 || !std::memcmp(_buffer.data(), header, 4)) {
-      log::debug("Response was not set!");
+    // A message waiting for a logon gets its response later.
+    if (!_pendingLogon &&
+        (_buffer.size() < 4 || !std::memcmp(_buffer.data(), header, 4)))
+    {
+      WSUDO_LOG_DEBUG("Response was not set!");
       createResponse(msg::server::InternalError);
     }
   };
 
-  if (!std::memcmp(header, msg::client::Credential, 4)) {
+  std::wstring_view username;
+  std::wstring_view password;
+  HANDLE remoteHandle;
+  if (frame.is(msg::client::QuerySession)) {
+    if (!frame.string(username) || !frame.atEnd()) {
+      log::warn("Client {}: Invalid query session message.", _clientId);
+      createResponse(msg::server::InvalidMessage);
+      return false;
+    }
+    if (tryCachedSession(username)) {
+      createResponse(msg::server::Success);
+    } else {
+      createResponse(msg::server::NoSession);
+    }
+    // Either way, the client's next message needs this connection.
+    return true;
+  } else if (frame.is(msg::client::Credential)) {
     // Verify the username/password pair.
-    auto bufferEnd = _buffer.end();
-    auto usernameBegin = _buffer.begin() + 4;
-    auto usernameEnd = usernameBegin;
-    while (true) {
-      if (usernameEnd >= bufferEnd - 1) {
-        log::warn("Client {}: Password not found in message.", _clientId);
-        createResponse(msg::server::InvalidMessage,
-                       "Password missing.");
-        return false;
-      }
-      if (*usernameEnd == 0) {
-        break;
-      }
-      ++usernameEnd;
+    if (!frame.string(username) || !frame.string(password) ||
+        !frame.atEnd())
+    {
+      log::warn("Client {}: Invalid credential message.", _clientId);
+      createResponse(msg::server::InvalidMessage,
+                     "Incorrect credential format.");
+      return false;
+    }
+    _blessAfterLogon = nullptr;
+    return tryToLogonUser(username, password);
+  } else if (frame.is(msg::client::CredentialBless)) {
+    if (!frame.handle(remoteHandle) || !frame.string(username) ||
+        !frame.string(password) || !frame.atEnd())
+    {
+      log::warn("Client {}: Invalid credential bless message.", _clientId);
+      createResponse(msg::server::InvalidMessage);
+      return false;
     }
-    auto passwordBegin = usernameEnd + 1;
-    auto passwordEnd = passwordBegin;
-    // The password shouldn't have any nulls.
-    while (true) {
-      if (passwordEnd == bufferEnd) {
-        break;
-      }
-      if (*passwordEnd == 0) {
-        log::warn("Client {}: Password contains NUL.", _clientId);
-        createResponse(msg::server::InvalidMessage,
-                       "Incorrect password format.");
-        return false;
-      }
-      ++passwordEnd;
+    _blessAfterLogon = remoteHandle;
+    return tryToLogonUser(username, password);
+  } else if (frame.is(msg::client::Bless)) {
+    HANDLE remoteHandles[msg::MaxBlessHandles];
+    uint32_t statuses[msg::MaxBlessHandles];
+    size_t count = 0;
+    while (!frame.atEnd() && count < msg::MaxBlessHandles &&
+           frame.handle(remoteHandles[count]))
+    {
+      ++count;
     }
-    _buffer.emplace_back(0);
-    return tryToLogonUser(reinterpret_cast<char *>(&*usernameBegin),
-                          reinterpret_cast<char *>(&*passwordBegin));
-  } else if (!std::memcmp(header, msg::client::Bless, 4)) {
-    if (_buffer.size() != 4 + sizeof(HANDLE)) {
+    if (count == 0 || !frame.atEnd()) {
       log::warn("Client {}: Invalid bless message.", _clientId);
       createResponse(msg::server::InvalidMessage);
+      return false;
+    }
+    if (bless(remoteHandles, count, statuses)) {
+      createResponse(msg::server::Success, statuses,
+                     count * sizeof(uint32_t));
     } else {
-      HANDLE remoteHandle;
-      std::memcpy(&remoteHandle, _buffer.data() + 4, sizeof(HANDLE));
-      if (bless(remoteHandle)) {
-        createResponse(msg::server::Success);
-      } else {
-        createResponse(msg::server::InternalError,
-                       "Token substitution failed.");
-      }
+      createResponse(msg::server::InternalError,
+                     "Token substitution failed.");
     }
-    return false;
+    // Agents keep one connection open for many blesses.
+    return true;
+  } else if (frame.is(msg::client::Stats)) {
+    if (!frame.atEnd()) {
+      log::warn("Client {}: Invalid stats message.", _clientId);
+      createResponse(msg::server::InvalidMessage);
+      return false;
+    }
+    if (!clientIsAdmin()) {
+      log::warn("Client {}: Stats denied for non-administrator.", _clientId);
+      createResponse(msg::server::AccessDenied);
+      return false;
+    }
+    respondWithStats();
+    // Let monitoring scrape repeatedly on one connection.
+    return true;
   } else {
     log::warn("Client {}: Unknown message header (0x{:2X}_{:2X}_{:2X}_{:2X}).",
               _clientId, header[0], header[1], header[2], header[3]);
@@ -225,141 +424,306 @@ bool ClientConnectionHandler::dispatchMessage() {
   }
 }
 
-bool ClientConnectionHandler::tryToLogonUser(char *username, char *password) {
-  auto username_w = to_utf16(username);
-  auto password_w = to_utf16(password);
-  // Zero the password from memory.
-  while (*password) {
-    *password++ = 0;
-  }
+bool ClientConnectionHandler::tryToLogonUser(std::wstring_view username,
+                                             std::wstring_view password)
+{
+  // The password is NUL terminated in place in the read buffer. Zero it from
+  // memory when we're done with it.
+  auto passwordChars = const_cast<wchar_t *>(password.data());
+  WSUDO_SCOPEEXIT {
+    SecureZeroMemory(passwordChars, password.length() * sizeof(wchar_t));
+  };
 
-  auto session = _sessionManager.find(username_w);
-  if (!session) {
-    session = _sessionManager.create(username_w, L"", std::move(password_w));
-    if (!session) {
-      log::warn("Client {}: Access denied for user '{}'.", _clientId, username);
-      createResponse(msg::server::AccessDenied);
-      return false;
-    }
+  session::SessionKey key;
+  if (!clientSessionKey(key)) {
+    createResponse(msg::server::InternalError);
+    return false;
   }
 
-  // This response will be sent if there are any failures here.
-  createResponse(msg::server::InternalError);
+  auto session = _sessionManager.find(key, username);
+  if (session) {
+    WSUDO_LOG_DEBUG("Client {}: Using cached session.", _clientId);
+    return authenticated(std::move(session), username);
+  }
 
-  HObject clientProcess;
   ULONG processId;
   if (!GetNamedPipeClientProcessId(_pipe, &processId)) {
     log::error("Client {}: Couldn't get client process ID: {}", _clientId,
                lastErrorString());
+    createResponse(msg::server::InternalError);
     return false;
   }
-  auto const access =
-    PROCESS_DUP_HANDLE | PROCESS_VM_READ | PROCESS_QUERY_INFORMATION;
-  if (!(clientProcess = OpenProcess(access, false, processId))) {
-    log::error("Client {}: Couldn't open client process: {}", _clientId,
-               lastErrorString());
+  // Refuse clients that keep failing before spending a logon on them. This
+  // also reserves the attempt, so many connections at once count too.
+  auto &throttle = _sessionManager.throttle();
+  if (auto waitMs = throttle.check(key.user(), processId, username,
+                                   GetTickCount64()))
+  {
+    log::warn("Client {}: Too many failed logons; refused for {} ms.",
+              _clientId, waitMs);
+    createResponse(msg::server::AccessDenied,
+                   fmt::format("Too many failed logons; try again in {} "
+                               "seconds.", (waitMs + 999) / 1000));
     return false;
   }
 
-  HObject currentToken;
-  // if (!OpenProcessToken(clientProcess, TOKEN_DUPLICATE | TOKEN_READ,
-  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_READ,
-                        &currentToken))
-  {
-    log::error("Client {}: Couldn't open client process token: {}", _clientId,
-               lastErrorString());
+  // Logging on can take a network round trip, so it runs on the thread pool
+  // and this handler waits for it without holding up the event loop.
+  _phaseStart = metrics::now();
+  _pendingLogon = _sessionManager.logon(key, processId, username, L"",
+                                        password);
+  if (!_pendingLogon) {
+    throttle.release(key.user(), processId, username, GetTickCount64());
+    _blessAfterLogon = nullptr;
+    createResponse(msg::server::InternalError);
     return false;
   }
+  return true;
+}
 
-  PSID ownerSid;
-  PSID groupSid;
-  PACL dacl;
-  PACL sacl;
-  PSECURITY_DESCRIPTOR secDesc;
-  if (!SUCCEEDED(GetSecurityInfo(currentToken, SE_KERNEL_OBJECT,
-                                 DACL_SECURITY_INFORMATION |
-                                   SACL_SECURITY_INFORMATION |
-                                   GROUP_SECURITY_INFORMATION |
-                                   OWNER_SECURITY_INFORMATION,
-                                 &ownerSid, &groupSid, &dacl, &sacl,
-                                 &secDesc)))
-  {
-    log::error("Client {}: Couldn't get security info: {}", _clientId,
-               lastErrorString());
+bool ClientConnectionHandler::authenticated(
+  std::shared_ptr<session::Session> session, std::wstring_view username
+)
+{
+  auto remoteHandle = std::exchange(_blessAfterLogon, nullptr);
+  if (!session) {
+    log::warn(L"Client {}: Access denied for user '{}'.", _clientId,
+              username);
+    createResponse(msg::server::AccessDenied);
     return false;
   }
-  WSUDO_SCOPEEXIT { LocalFree(secDesc); };
 
-  SECURITY_ATTRIBUTES secAttr;
-  secAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
-  secAttr.bInheritHandle = true;
-  secAttr.lpSecurityDescriptor = secDesc;
+  _session = std::move(session);
+  log::info(L"Client {}: Authorized as {}.", _clientId,
+            _session->identity().accountName());
 
-  //
+  if (!remoteHandle) {
+    createResponse(msg::server::Success);
+    return true;
+  }
 
-  HObject newToken;
-  if (!DuplicateTokenEx(currentToken, MAXIMUM_ALLOWED, &secAttr,
-                        SecurityImpersonation, TokenPrimary, &newToken))
-  {
-    log::error("Client {}: Couldn't duplicate token: {}", _clientId,
-               lastErrorString());
+  uint32_t status;
+  if (!bless(&remoteHandle, 1, &status)) {
+    createResponse(msg::server::InternalError,
+                   "Token substitution failed.");
+  } else if (status == ERROR_SUCCESS) {
+    createResponse(msg::server::Success);
+  } else if (status == ERROR_ACCESS_DENIED) {
+    createResponse(msg::server::AccessDenied,
+                   "Policy doesn't allow elevating this program.");
+  } else {
+    createResponse(msg::server::InternalError,
+                   "Token substitution failed.");
+  }
+  // The client exits after a credential bless.
+  return false;
+}
+
+bool ClientConnectionHandler::bless(const HANDLE *remoteHandles, size_t count,
+                                    uint32_t *statuses)
+{
+  assert(count <= msg::MaxBlessHandles);
+  HObject localHandles[msg::MaxBlessHandles];
+  if (!_session) {
+    log::error("Client {}: Not authenticated.", _clientId);
+    return false;
+  }
+
+  // Failed steps aren't recorded; they end the request anyway.
+  auto start = metrics::now();
+  HANDLE clientProcess = openClientProcess();
+  if (!clientProcess) {
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    WSUDO_LOG_DEBUG("Trying to duplicate remote handle 0x{:X}.",
+                    reinterpret_cast<size_t>(remoteHandles[i]));
+    if (DuplicateHandle(clientProcess, remoteHandles[i], GetCurrentProcess(),
+                        &localHandles[i],
+                        PROCESS_SET_INFORMATION |
+                          PROCESS_QUERY_LIMITED_INFORMATION,
+                        false, 0))
+    {
+      statuses[i] = ERROR_SUCCESS;
+    } else {
+      statuses[i] = GetLastError();
+      log::error("Client {}: Couldn't duplicate remote handle: {}", _clientId,
+                 lastErrorString(statuses[i]));
+    }
+  }
+  metrics::record(metrics::Phase::OpenProcess, start, _clientId);
+
+  // Resolved by serverMain; it reported there if this is missing.
+  auto &api = nt::g_api;
+  if (!api.NtSetInformationProcess) {
+    log::error("Client {}: NtSetInformationProcess is not available.",
+               _clientId);
     return false;
   }
 
-  _userToken = std::move(newToken);
-  log::info("Client {}: Authorized; stored new token.", _clientId);
+  size_t blessed = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (statuses[i] != ERROR_SUCCESS) {
+      continue;
+    }
+    if (!authorize(localHandles[i])) {
+      statuses[i] = ERROR_ACCESS_DENIED;
+      continue;
+    }
+
+    start = metrics::now();
+    auto userToken = _session->createPrimaryToken();
+    if (!userToken) {
+      statuses[i] = ERROR_NO_TOKEN;
+      continue;
+    }
+    metrics::record(metrics::Phase::DuplicateToken, start, _clientId);
+
+    start = metrics::now();
+    nt::PROCESS_ACCESS_TOKEN processAccessToken{userToken, nullptr};
+    auto status = api.NtSetInformationProcess(localHandles[i],
+                                              nt::ProcessAccessToken,
+                                              &processAccessToken,
+                                              sizeof(nt::PROCESS_ACCESS_TOKEN));
+    if (!NT_SUCCESS(status)) {
+      statuses[i] = api.RtlNtStatusToDosError
+                      ? api.RtlNtStatusToDosError(status)
+                      : ERROR_GEN_FAILURE;
+      log::error("Client {}: Couldn't assign access token: {}", _clientId,
+                 api.RtlNtStatusToDosError
+                   ? lastErrorString(statuses[i])
+                   : fmt::format("NTSTATUS 0x{:08X}",
+                                 static_cast<unsigned long>(status)));
+      continue;
+    }
+    metrics::record(metrics::Phase::SetToken, start, _clientId);
+    ++blessed;
+  }
+
+  log::info("Client {}: Adjusted {} of {} remote process tokens.", _clientId,
+            blessed, count);
 
-  createResponse(msg::server::Success);
   return true;
 }
 
-bool ClientConnectionHandler::bless(HANDLE remoteHandle) {
-  HObject clientProcess;
-  HObject localHandle;
-  ULONG processId;
-  if (!_userToken) {
-    log::error("Client {}: Not authenticated.", _clientId);
+bool ClientConnectionHandler::authorize(HANDLE process) {
+  wchar_t imagePath[MAX_PATH * 2];
+  DWORD length = ARRAYSIZE(imagePath);
+  if (!QueryFullProcessImageNameW(process, 0, imagePath, &length)) {
+    log::error("Client {}: Couldn't read the process image path: {}",
+               _clientId, lastErrorString());
+    return false;
+  }
+  std::wstring_view path{imagePath, length};
+  auto &sids = _session->identity().sids();
+  if (_policy.check(sids.data(), sids.size(), path) !=
+      policy::Decision::Allow)
+  {
+    log::warn("Client {}: Policy denies elevating {}.", _clientId,
+              to_utf8(path));
     return false;
   }
+  return true;
+}
 
+HANDLE ClientConnectionHandler::openClientProcess() {
+  if (_clientProcess) {
+    return _clientProcess;
+  }
+  ULONG processId;
   if (!GetNamedPipeClientProcessId(_pipe, &processId)) {
     log::error("Client {}: Couldn't get client process ID: {}", _clientId,
                lastErrorString());
-    return false;
+    return nullptr;
   }
-  auto const access = PROCESS_DUP_HANDLE | PROCESS_VM_READ;
-  if (!(clientProcess = OpenProcess(access, false, processId))) {
+  // Everything any request needs, so the process is only opened once.
+  auto const access = PROCESS_DUP_HANDLE | PROCESS_VM_READ |
+                      PROCESS_QUERY_LIMITED_INFORMATION;
+  if (!(_clientProcess = OpenProcess(access, false, processId))) {
     log::error("Client {}: Couldn't open client process: {}", _clientId,
                lastErrorString());
-    return false;
+    return nullptr;
   }
-  log::debug("Trying to duplicate remote handle 0x{:X}.",
-             reinterpret_cast<size_t>(remoteHandle));
-  if (!DuplicateHandle(clientProcess, remoteHandle, GetCurrentProcess(),
-                       &localHandle, PROCESS_SET_INFORMATION, false, 0))
-  {
-    log::error("Client {}: Couldn't duplicate remote handle: {}", _clientId,
+  return _clientProcess;
+}
+
+HObject ClientConnectionHandler::openClientToken() {
+  HObject token;
+  if (!ImpersonateNamedPipeClient(_pipe)) {
+    log::error("Client {}: Couldn't impersonate client: {}", _clientId,
+               lastErrorString());
+    return token;
+  }
+  if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, true, &token)) {
+    log::error("Client {}: Couldn't open client token: {}", _clientId,
                lastErrorString());
+  }
+  RevertToSelf();
+  return token;
+}
+
+bool ClientConnectionHandler::clientSessionKey(session::SessionKey &key) {
+  auto token = openClientToken();
+  return token && session::SessionKey::fromToken(token, key);
+}
+
+bool ClientConnectionHandler::tryCachedSession(std::wstring_view username) {
+  // The key comes from the client's own token, so a hit is always a session
+  // this client's logon created.
+  session::SessionKey key;
+  if (!clientSessionKey(key)) {
+    return false;
+  }
+  auto session = _sessionManager.find(key, username);
+  if (!session) {
     return false;
   }
 
-  auto ntdll = LinkedModule{L"ntdll.dll"};
-  auto NtSetInformationProcess =
-    ntdll.get<nt::NtSetInformationProcess_t>("NtSetInformationProcess");
+  WSUDO_LOG_DEBUG("Client {}: Reusing cached session without credentials.",
+                  _clientId);
+  _session = std::move(session);
+  return true;
+}
 
-  nt::PROCESS_ACCESS_TOKEN processAccessToken{_userToken, nullptr};
-  if (!NT_SUCCESS(NtSetInformationProcess(localHandle,
-                                          nt::ProcessAccessToken,
-                                          &processAccessToken,
-                                          sizeof(nt::PROCESS_ACCESS_TOKEN))))
+bool ClientConnectionHandler::clientIsAdmin() {
+  auto token = openClientToken();
+  if (!token) {
+    return false;
+  }
+
+  SID_IDENTIFIER_AUTHORITY ntAuthority = SECURITY_NT_AUTHORITY;
+  Handle<PSID, FreeSid> adminsSid;
+  if (!AllocateAndInitializeSid(&ntAuthority, 2, SECURITY_BUILTIN_DOMAIN_RID,
+                                DOMAIN_ALIAS_RID_ADMINS, 0, 0, 0, 0, 0, 0,
+                                &adminsSid))
   {
-    log::error("Client {}: Couldn't assign access token: {}", _clientId,
+    return false;
+  }
+  // Deny-only groups don't count, so an unelevated admin is rejected.
+  BOOL isMember = false;
+  if (!CheckTokenMembership(token, adminsSid, &isMember)) {
+    log::error("Client {}: CheckTokenMembership failed: {}", _clientId,
                lastErrorString());
     return false;
   }
+  return !!isMember;
+}
 
-  log::info("Client {}: Successfully adjusted remote process token.",
-            _clientId);
-
-  return true;
+void ClientConnectionHandler::respondWithStats() {
+  metrics::StatsSnapshot stats{};
+  stats.version = metrics::StatsVersion;
+  stats.handlers = static_cast<uint32_t>(_listener.count());
+  stats.pipeInstances = _pipeFactory.instances();
+  stats.pipeIdle = _pipeFactory.idle();
+  auto sessions = _sessionManager.stats();
+  stats.sessions = sessions.sessions;
+  stats.sessionHits = sessions.hits;
+  stats.sessionMisses = sessions.misses;
+  stats.sessionEvictions = sessions.evictions;
+  stats.bytesRead = EventOverlappedIO::totalBytesRead();
+  stats.bytesWritten = EventOverlappedIO::totalBytesWritten();
+  for (unsigned i = 0; i < metrics::PhaseCount; ++i) {
+    stats.phases[i] = metrics::snapshot(static_cast<metrics::Phase>(i));
+  }
+  createResponse(msg::server::Success, &stats, sizeof(stats));
 }
@@ -0,0 +1,435 @@
+#include "wsudo/server.h"
+
+#include <sddl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace wsudo;
+using namespace wsudo::server;
+
+// Helpers {{{
+
+namespace {
+
+constexpr wchar_t HandoffPipeName[] = L"\\\\.\\pipe\\wsudo_handoff";
+
+// Sent by the new instance first; the old one only hands off a format the
+// new one understands.
+constexpr uint32_t HandoffVersion = 1;
+
+// Larger state than this is treated as corrupt.
+constexpr uint32_t MaxHandoffSize = 16 * 1024 * 1024;
+
+// How long a stopping service waits for its holder to listen.
+constexpr DWORD HolderStartTimeoutMs = 5000;
+
+// Run one overlapped read or write on the handoff pipe to completion.
+template<typename F>
+bool transfer(HANDLE pipe, HANDLE event, size_t size, F &&start) {
+  OVERLAPPED overlapped{};
+  overlapped.hEvent = event;
+  DWORD bytes;
+  if (!start(&overlapped) && GetLastError() != ERROR_IO_PENDING) {
+    return false;
+  }
+  return GetOverlappedResult(pipe, &overlapped, &bytes, true) &&
+         bytes == size;
+}
+
+bool writeAll(HANDLE pipe, HANDLE event, const void *data, size_t size) {
+  return transfer(pipe, event, size, [&](LPOVERLAPPED overlapped) {
+    return WriteFile(pipe, data, static_cast<DWORD>(size), nullptr,
+                     overlapped);
+  });
+}
+
+bool readAll(HANDLE pipe, HANDLE event, void *data, size_t size) {
+  return transfer(pipe, event, size, [&](LPOVERLAPPED overlapped) {
+    return ReadFile(pipe, data, static_cast<DWORD>(size), nullptr,
+                    overlapped);
+  });
+}
+
+// Returns the token's user SID bytes, or an empty buffer on failure.
+std::vector<uint8_t> tokenUser(HANDLE token) {
+  alignas(TOKEN_USER)
+    uint8_t buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+  DWORD length;
+  if (!GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &length))
+  {
+    return {};
+  }
+  auto sid = reinterpret_cast<TOKEN_USER *>(buffer)->User.Sid;
+  auto bytes = static_cast<const uint8_t *>(sid);
+  return std::vector<uint8_t>(bytes, bytes + GetLengthSid(sid));
+}
+
+// Returns the process's image path, or an empty string on failure.
+std::wstring imagePath(HANDLE process) {
+  wchar_t path[MAX_PATH * 2];
+  DWORD length = ARRAYSIZE(path);
+  if (!QueryFullProcessImageNameW(process, 0, path, &length)) {
+    return {};
+  }
+  return std::wstring{path, length};
+}
+
+// The handed off state is handle values in this process, so whoever is
+// listening on the handoff pipe has to be a previous instance's holder: the
+// same executable, running elevated as the same account (LocalSystem for the
+// service). Anyone could have created the pipe first.
+bool isPreviousServer(HANDLE pipe) {
+  ULONG processId;
+  if (!GetNamedPipeServerProcessId(pipe, &processId)) {
+    log::warn("Can't identify the handoff pipe's server: {}",
+              lastErrorString());
+    return false;
+  }
+  HObject process{OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false,
+                              processId)};
+  HObject theirToken;
+  HObject ourToken;
+  if (!process || !OpenProcessToken(process, TOKEN_QUERY, &theirToken) ||
+      !OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &ourToken))
+  {
+    log::warn("Can't check handoff pipe server {}: {}", processId,
+              lastErrorString());
+    return false;
+  }
+
+  auto theirUser = tokenUser(theirToken);
+  auto ourUser = tokenUser(ourToken);
+  if (theirUser.empty() || theirUser != ourUser) {
+    log::warn("Handoff pipe server {} runs as another account.", processId);
+    return false;
+  }
+  TOKEN_ELEVATION elevation;
+  DWORD length;
+  if (!GetTokenInformation(theirToken, TokenElevation, &elevation,
+                           sizeof(elevation), &length) ||
+      !elevation.TokenIsElevated)
+  {
+    log::warn("Handoff pipe server {} isn't elevated.", processId);
+    return false;
+  }
+
+  auto theirImage = imagePath(process);
+  auto ourImage = imagePath(GetCurrentProcess());
+  if (theirImage.empty() ||
+      CompareStringOrdinal(theirImage.data(),
+                           static_cast<int>(theirImage.length()),
+                           ourImage.data(),
+                           static_cast<int>(ourImage.length()),
+                           true) != CSTR_EQUAL)
+  {
+    log::warn("Handoff pipe server {} is {}, not this server.", processId,
+              to_utf8(theirImage));
+    return false;
+  }
+  return true;
+}
+
+// Create the handoff pipe. Tokens go to whoever connects, so only elevated
+// administrators and SYSTEM may; a filtered admin token has Administrators
+// as deny-only.
+HObject listenForHandoff() {
+  HLocalPtr<PSECURITY_DESCRIPTOR> securityDescriptor;
+  if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        L"D:P(A;;GA;;;SY)(A;;GA;;;BA)", SDDL_REVISION_1, &securityDescriptor,
+        nullptr))
+  {
+    log::error("Can't create handoff security descriptor: {}",
+               lastErrorString());
+    return HObject{};
+  }
+  SECURITY_ATTRIBUTES securityAttributes{sizeof(SECURITY_ATTRIBUTES),
+                                         securityDescriptor, false};
+  HANDLE rawPipe =
+    CreateNamedPipeW(HandoffPipeName,
+                     PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE |
+                       FILE_FLAG_OVERLAPPED,
+                     PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                       PIPE_REJECT_REMOTE_CLIENTS,
+                     1, PipeBufferSize, PipeBufferSize, 0,
+                     &securityAttributes);
+  if (rawPipe == INVALID_HANDLE_VALUE) {
+    log::error("Can't create handoff pipe: {}", lastErrorString());
+    return HObject{};
+  }
+  return HObject{rawPipe};
+}
+
+// Wait up to timeoutMs on the handoff pipe for the next instance to take the
+// cached sessions.
+void offerSessions(HANDLE pipe, session::SessionManager &sessionManager,
+                   DWORD timeoutMs)
+{
+  auto sessions = sessionManager.stats().sessions;
+  if (!sessions) {
+    log::info("No sessions to hand off.");
+    return;
+  }
+  HObject event{CreateEventW(nullptr, true, false, nullptr)};
+
+  log::info("Waiting up to {} ms for the next server to take {} session(s).",
+            timeoutMs, sessions);
+  OVERLAPPED overlapped{};
+  overlapped.hEvent = event;
+  if (!ConnectNamedPipe(pipe, &overlapped)) {
+    switch (GetLastError()) {
+    case ERROR_PIPE_CONNECTED:
+      break;
+    case ERROR_IO_PENDING:
+      if (WaitForSingleObject(event, timeoutMs) != WAIT_OBJECT_0) {
+        CancelIo(pipe);
+        log::info("No server took over; dropping the sessions.");
+        return;
+      }
+      break;
+    default:
+      log::error("Handoff pipe failed: {}", lastErrorString());
+      return;
+    }
+  }
+
+  uint32_t version;
+  if (!readAll(pipe, event, &version, sizeof(version))) {
+    log::error("Next server didn't ask for the sessions: {}",
+               lastErrorString());
+    return;
+  }
+  if (version != HandoffVersion) {
+    log::warn("Next server wants handoff version {}, not {}; dropping the "
+              "sessions.", version, HandoffVersion);
+    uint32_t none = 0;
+    writeAll(pipe, event, &none, sizeof(none));
+    return;
+  }
+
+  ULONG processId;
+  HObject process;
+  if (GetNamedPipeClientProcessId(pipe, &processId)) {
+    process = OpenProcess(PROCESS_DUP_HANDLE, false, processId);
+  }
+  if (!process) {
+    log::error("Can't open the next server's process: {}", lastErrorString());
+    return;
+  }
+
+  auto state = sessionManager.exportSessions(process);
+  auto size = static_cast<uint32_t>(state.size());
+  if (!writeAll(pipe, event, &size, sizeof(size)) ||
+      !writeAll(pipe, event, state.data(), state.size()))
+  {
+    log::error("Handoff failed: {}", lastErrorString());
+    return;
+  }
+  // Don't close the pipe on data the new server hasn't read yet.
+  FlushFileBuffers(pipe);
+  log::info("Sessions handed off to process {}.", processId);
+}
+
+// Synchronous reads and writes on the holder's standard input.
+bool readInput(HANDLE input, void *data, size_t size) {
+  auto bytes = static_cast<uint8_t *>(data);
+  while (size) {
+    DWORD read;
+    if (!ReadFile(input, bytes, static_cast<DWORD>(size), &read, nullptr) ||
+        !read)
+    {
+      return false;
+    }
+    bytes += read;
+    size -= read;
+  }
+  return true;
+}
+
+bool writeInput(HANDLE input, const void *data, size_t size) {
+  DWORD written;
+  return WriteFile(input, data, static_cast<DWORD>(size), &written,
+                   nullptr) &&
+         written == size;
+}
+
+} // namespace
+
+// }}}
+
+bool SessionHolder::start() {
+  if (_process) {
+    return true;
+  }
+
+  // The holder only inherits its ends.
+  SECURITY_ATTRIBUTES inheritable{sizeof(SECURITY_ATTRIBUTES), nullptr, true};
+  HObject inputRead;
+  HObject input;
+  HObject listening{CreateEventW(&inheritable, true, false, nullptr)};
+  if (!listening || !CreatePipe(&inputRead, &input, &inheritable, 0) ||
+      !SetHandleInformation(input, HANDLE_FLAG_INHERIT, 0))
+  {
+    log::error("Can't set up the session holder: {}", lastErrorString());
+    return false;
+  }
+
+  // The path this process was started from rather than its current image
+  // name: after an upgrade that renamed this executable aside, that's the
+  // new one, which is what the next instance trusts.
+  std::wstring path(MAX_PATH, L'\0');
+  DWORD length;
+  while ((length = GetModuleFileNameW(nullptr, path.data(),
+                                      static_cast<DWORD>(path.size()))) ==
+         path.size())
+  {
+    path.resize(path.size() * 2);
+  }
+  path.resize(length);
+  auto commandLine = L"\"" + path + L"\" --hold-sessions " +
+                     std::to_wstring(reinterpret_cast<uintptr_t>(
+                       static_cast<HANDLE>(listening)));
+
+  STARTUPINFOW startupInfo{sizeof(STARTUPINFOW)};
+  startupInfo.dwFlags = STARTF_USESTDHANDLES;
+  startupInfo.hStdInput = inputRead;
+  PROCESS_INFORMATION processInfo;
+  if (!CreateProcessW(path.c_str(), commandLine.data(), nullptr, nullptr,
+                      true, CREATE_NO_WINDOW, nullptr, nullptr, &startupInfo,
+                      &processInfo))
+  {
+    log::error("Can't start the session holder: {}", lastErrorString());
+    return false;
+  }
+  HObject process{processInfo.hProcess};
+  CloseHandle(processInfo.hThread);
+
+  HANDLE handles[] = { listening, process };
+  if (WaitForMultipleObjects(2, handles, false, HolderStartTimeoutMs) !=
+      WAIT_OBJECT_0)
+  {
+    log::error("Session holder {} didn't start listening.",
+               processInfo.dwProcessId);
+    TerminateProcess(process, 1);
+    return false;
+  }
+  log::info("Session holder {} is listening.", processInfo.dwProcessId);
+  _process = std::move(process);
+  _input = std::move(input);
+  return true;
+}
+
+void SessionHolder::handOff(session::SessionManager &sessionManager) {
+  if (!_input) {
+    return;
+  }
+  auto state = sessionManager.exportSessions(_process);
+  uint32_t version = HandoffVersion;
+  auto size = static_cast<uint32_t>(state.size());
+  if (!writeInput(_input, &version, sizeof(version)) ||
+      !writeInput(_input, &size, sizeof(size)) ||
+      !writeInput(_input, state.data(), state.size()))
+  {
+    log::error("Can't give the sessions to the holder: {}",
+               lastErrorString());
+  } else {
+    log::info("Gave the sessions to holder {}.", GetProcessId(_process));
+  }
+  // The holder stops reading here.
+  _input = nullptr;
+}
+
+int wsudo::server::holdSessions(HANDLE listeningEvent) {
+  HObject listening{listeningEvent};
+  HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+  auto pipe = listenForHandoff();
+  if (!pipe || !SetEvent(listening)) {
+    return 1;
+  }
+
+  // Only the service that started this one has the other end.
+  uint32_t version;
+  uint32_t size;
+  if (!readInput(input, &version, sizeof(version)) ||
+      version != HandoffVersion || !readInput(input, &size, sizeof(size)) ||
+      size > MaxHandoffSize)
+  {
+    log::error("The stopping server didn't hand off any sessions.");
+    return 1;
+  }
+  std::vector<uint8_t> state(size);
+  if (!readInput(input, state.data(), state.size())) {
+    log::error("The stopping server didn't hand off any sessions.");
+    return 1;
+  }
+
+  // The expiration times come from the state.
+  session::SessionManager sessionManager{60 * 10};
+  if (size && !sessionManager.importSessions(state.data(), state.size())) {
+    return 1;
+  }
+  offerSessions(pipe, sessionManager, HandoffTimeoutMs);
+  return 0;
+}
+
+size_t wsudo::server::receiveSessions(session::SessionManager &sessionManager)
+{
+  // The holder is normally listening before this instance starts, but give
+  // it a moment in case it isn't yet, or another server is connected.
+  auto deadline = GetTickCount64() + HandoffConnectTimeoutMs;
+  HANDLE rawPipe;
+  // Identification level: the holder has no use for our token.
+  while ((rawPipe = CreateFileW(HandoffPipeName,
+                                GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                OPEN_EXISTING,
+                                FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT |
+                                  SECURITY_IDENTIFICATION,
+                                nullptr)) == INVALID_HANDLE_VALUE)
+  {
+    auto error = GetLastError();
+    auto now = GetTickCount64();
+    if ((error != ERROR_FILE_NOT_FOUND && error != ERROR_PIPE_BUSY) ||
+        now >= deadline)
+    {
+      if (error != ERROR_FILE_NOT_FOUND) {
+        log::warn("Can't connect to the previous server: {}",
+                  lastErrorString(error));
+      }
+      return 0;
+    }
+    auto remaining = static_cast<DWORD>(deadline - now);
+    // Fails at once while there is no pipe.
+    if (!WaitNamedPipeW(HandoffPipeName, remaining)) {
+      Sleep(std::min<DWORD>(remaining, 50));
+    }
+  }
+  HObject pipe{rawPipe};
+  if (!isPreviousServer(pipe)) {
+    log::error("Not taking sessions from an untrusted handoff pipe.");
+    return 0;
+  }
+  HObject event{CreateEventW(nullptr, true, false, nullptr)};
+
+  uint32_t version = HandoffVersion;
+  uint32_t size;
+  if (!writeAll(pipe, event, &version, sizeof(version)) ||
+      !readAll(pipe, event, &size, sizeof(size)))
+  {
+    log::warn("Session handoff failed: {}", lastErrorString());
+    return 0;
+  }
+  if (!size) {
+    log::info("The previous server had nothing to hand off.");
+    return 0;
+  }
+  if (size > MaxHandoffSize) {
+    log::warn("Handed off session state is too large ({} bytes).", size);
+    return 0;
+  }
+  std::vector<uint8_t> state(size);
+  if (!readAll(pipe, event, state.data(), state.size())) {
+    log::warn("Session handoff failed: {}", lastErrorString());
+    return 0;
+  }
+  return sessionManager.importSessions(state.data(), state.size());
+}
@@ -1,5 +1,6 @@
 #include "wsudo/server.h"
 
+#include <spdlog/async.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <fmt/format.h>
 #include <Psapi.h>
@@ -45,10 +46,17 @@ BOOL WINAPI consoleControlHandler(DWORD event) {
   return true;
 }
 
+// Log messages queued for the background thread. When the queue is full the
+// oldest are dropped rather than making a worker wait for the console.
+constexpr size_t LogQueueSize = 8192;
+
 int wmain(int argc, wchar_t *argv[]) {
-  log::g_outLogger = spdlog::stdout_color_mt("wsudo.out");
-  log::g_outLogger->set_level(spdlog::level::trace);
-  log::g_errLogger = spdlog::stderr_color_mt("wsudo.err");
+  spdlog::init_thread_pool(LogQueueSize, 1);
+  log::g_outLogger =
+    spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>("wsudo.out");
+  log::g_outLogger->set_level(log::MinLevel);
+  log::g_errLogger =
+    spdlog::create_async_nb<spdlog::sinks::stderr_color_sink_mt>("wsudo.err");
   log::g_errLogger->set_level(spdlog::level::warn);
 #ifndef NDEBUG
   // Set a more compact, readable log format for debugging.
@@ -58,8 +66,65 @@ int wmain(int argc, wchar_t *argv[]) {
   spdlog::set_pattern("[%Y-%m-%d %T.%e] %^[%l]%$ %v");
 #endif
 
-  // VC++ deadlock bug
-  WSUDO_SCOPEEXIT { spdlog::drop_all(); };
+  // VC++ deadlock bug. This also flushes the queue and stops the logging
+  // thread.
+  WSUDO_SCOPEEXIT { spdlog::shutdown(); };
+
+  server::Config config{ PipeFullPath, &gs_quitEventHandle };
+  enum class Mode {
+    Console, Service, Install, Uninstall, Restart, HoldSessions
+  };
+  Mode mode = Mode::Console;
+  HANDLE listeningEvent = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    auto hasValue = i + 1 < argc;
+    if ((!wcscmp(argv[i], L"-j") || !wcscmp(argv[i], L"--threads")) &&
+        hasValue)
+    {
+      config.workerThreads = static_cast<unsigned>(_wtoi(argv[++i]));
+    } else if (!wcscmp(argv[i], L"--min-idle-pipes") && hasValue) {
+      config.pipePool.minIdle = static_cast<unsigned>(_wtoi(argv[++i]));
+    } else if (!wcscmp(argv[i], L"--max-idle-pipes") && hasValue) {
+      config.pipePool.maxIdle = static_cast<unsigned>(_wtoi(argv[++i]));
+    } else if (!wcscmp(argv[i], L"--max-pipes") && hasValue) {
+      config.pipePool.maxInstances = static_cast<unsigned>(_wtoi(argv[++i]));
+    } else if (!wcscmp(argv[i], L"--max-message-size") && hasValue) {
+      config.maxMessageSize = static_cast<size_t>(_wtoi(argv[++i]));
+    } else if (!wcscmp(argv[i], L"--policy") && hasValue) {
+      config.policyPath = argv[++i];
+    } else if (!wcscmp(argv[i], L"--service")) {
+      mode = Mode::Service;
+    } else if (!wcscmp(argv[i], L"--install")) {
+      mode = Mode::Install;
+    } else if (!wcscmp(argv[i], L"--uninstall")) {
+      mode = Mode::Uninstall;
+    } else if (!wcscmp(argv[i], L"--restart")) {
+      mode = Mode::Restart;
+    } else if (!wcscmp(argv[i], L"--hold-sessions") && hasValue) {
+      // Started by a stopping service; the value is an inherited handle.
+      mode = Mode::HoldSessions;
+      listeningEvent = reinterpret_cast<HANDLE>(
+        static_cast<uintptr_t>(_wcstoui64(argv[++i], nullptr, 10)));
+    } else {
+      log::warn(L"Unknown argument '{}'.", argv[i]);
+    }
+  }
+
+  switch (mode) {
+  case Mode::Service:
+    // No console; the SCM starts and stops the server.
+    return server::runService(config);
+  case Mode::Install:
+    return server::installService() ? 0 : 1;
+  case Mode::Uninstall:
+    return server::uninstallService() ? 0 : 1;
+  case Mode::Restart:
+    return server::restartService() ? 0 : 1;
+  case Mode::HoldSessions:
+    return server::holdSessions(listeningEvent);
+  case Mode::Console:
+    break;
+  }
 
   HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
   HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -89,7 +154,6 @@ int wmain(int argc, wchar_t *argv[]) {
     SetConsoleMode(hStdout, stdoutMode);
   };
 
-  server::Config config{ PipeFullPath, &gs_quitEventHandle };
   std::thread serverThread{&server::serverMain, std::ref(config)};
   serverThread.join();
   log::info("Event loop returned {}.", server::statusToString(config.status));
@@ -0,0 +1,86 @@
+#include "wsudo/metrics.h"
+
+#include <TraceLoggingProvider.h>
+
+using namespace wsudo;
+using namespace wsudo::metrics;
+
+TRACELOGGING_DEFINE_PROVIDER(
+  g_provider, "wsudo.TokenServer",
+  (0x5b91d2a9, 0xc16c, 0x445e, 0x91, 0x24, 0x0d, 0xb0, 0xf2, 0xe6, 0xe4, 0xc5)
+);
+
+namespace {
+
+struct Histogram {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> totalMicros{0};
+  std::atomic<uint64_t> maxMicros{0};
+  std::array<std::atomic<uint64_t>, BucketCount> buckets{};
+};
+
+std::array<Histogram, PhaseCount> g_histograms;
+
+const int64_t g_ticksPerSecond = [] {
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  return frequency.QuadPart;
+}();
+
+unsigned bucketFor(uint64_t micros) {
+  unsigned bucket = 0;
+  while (micros && bucket < BucketCount - 1) {
+    micros >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+} // namespace
+
+HistogramSnapshot wsudo::metrics::snapshot(Phase phase) {
+  auto &histogram = g_histograms[static_cast<unsigned>(phase)];
+  HistogramSnapshot result;
+  result.count = histogram.count.load(std::memory_order_relaxed);
+  result.totalMicros = histogram.totalMicros.load(std::memory_order_relaxed);
+  result.maxMicros = histogram.maxMicros.load(std::memory_order_relaxed);
+  for (unsigned i = 0; i < BucketCount; ++i) {
+    result.buckets[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void wsudo::metrics::record(Phase phase, int64_t start, int clientId) {
+  auto ticks = now() - start;
+  auto micros = static_cast<uint64_t>(ticks > 0 ? ticks : 0) * 1000000 /
+                static_cast<uint64_t>(g_ticksPerSecond);
+
+  auto &histogram = g_histograms[static_cast<unsigned>(phase)];
+  histogram.count.fetch_add(1, std::memory_order_relaxed);
+  histogram.totalMicros.fetch_add(micros, std::memory_order_relaxed);
+  histogram.buckets[bucketFor(micros)].fetch_add(1, std::memory_order_relaxed);
+  auto max = histogram.maxMicros.load(std::memory_order_relaxed);
+  while (micros > max &&
+         !histogram.maxMicros.compare_exchange_weak(max, micros,
+                                                    std::memory_order_relaxed))
+  {}
+
+  if (TraceLoggingProviderEnabled(g_provider, 0, 0)) {
+    TraceLoggingWrite(g_provider, "Phase",
+                      TraceLoggingString(phaseName(phase), "Phase"),
+                      TraceLoggingUInt64(micros, "Micros"),
+                      TraceLoggingInt32(clientId, "Client"));
+  }
+}
+
+void wsudo::metrics::registerProvider() {
+  auto result = TraceLoggingRegister(g_provider);
+  if (result != ERROR_SUCCESS) {
+    log::warn("Couldn't register ETW provider: {}",
+              lastErrorString(static_cast<DWORD>(result)));
+  }
+}
+
+void wsudo::metrics::unregisterProvider() {
+  TraceLoggingUnregister(g_provider);
+}
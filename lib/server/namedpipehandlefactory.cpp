@@ -1,11 +1,20 @@
 #include "wsudo/server.h"
 
+#include <algorithm>
+
 using namespace wsudo;
 using namespace wsudo::server;
 
-NamedPipeHandleFactory::NamedPipeHandleFactory(LPCWSTR pipeName) noexcept
-  : _pipeName{pipeName}
+NamedPipeHandleFactory::NamedPipeHandleFactory(LPCWSTR pipeName,
+                                               PipePoolConfig pool) noexcept
+  : _pipeName{pipeName},
+    _pool{pool}
 {
+  _pool.maxInstances = std::clamp(_pool.maxInstances, 1u,
+                                  (unsigned)PIPE_UNLIMITED_INSTANCES);
+  _pool.minIdle = std::clamp(_pool.minIdle, 1u, _pool.maxInstances);
+  _pool.maxIdle = std::max(_pool.maxIdle, _pool.minIdle);
+
   _sidAuth = SECURITY_WORLD_SID_AUTHORITY;
   if (!AllocateAndInitializeSid(&_sidAuth, 1, SECURITY_WORLD_RID, 0, 0, 0, 0,
                                 0, 0, 0, &_sid))
@@ -44,7 +53,7 @@ NamedPipeHandleFactory::NamedPipeHandleFactory(LPCWSTR pipeName) noexcept
   _securityAttributes.bInheritHandle = false;
   _securityAttributes.lpSecurityDescriptor = _securityDescriptor;
 
-  log::debug("Named pipe security attributes initialized.");
+  WSUDO_LOG_DEBUG("Named pipe security attributes initialized.");
 }
 
 HObject NamedPipeHandleFactory::operator()() {
@@ -52,6 +61,12 @@ HObject NamedPipeHandleFactory::operator()() {
     return HObject{};
   }
 
+  std::lock_guard<std::mutex> lock{_mutex};
+  if (_instances >= _pool.maxInstances) {
+    WSUDO_LOG_DEBUG("Pipe pool is full ({} instances).", _instances);
+    return HObject{};
+  }
+
   DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED;
   if (_firstInstance) {
     openMode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
@@ -60,9 +75,12 @@ HObject NamedPipeHandleFactory::operator()() {
   HANDLE pipe = CreateNamedPipeW(_pipeName, openMode,
                                  PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE |
                                    PIPE_REJECT_REMOTE_CLIENTS,
-                                 MaxPipeConnections, PipeBufferSize,
+                                 _pool.maxInstances, PipeBufferSize,
                                  PipeBufferSize, PipeDefaultTimeout,
                                  &_securityAttributes);
+  if (pipe == INVALID_HANDLE_VALUE) {
+    pipe = nullptr;
+  }
 
   // We consider failing to open the first instance a critical failure,
   // but subsequent failures are just warnings because we still have an open
@@ -80,9 +98,65 @@ HObject NamedPipeHandleFactory::operator()() {
   }
 
   _firstInstance = false;
+  if (pipe) {
+    ++_instances;
+    ++_idle;
+    WSUDO_LOG_DEBUG("Pipe pool: {} instances, {} idle.", _instances, _idle);
+  }
   return HObject{pipe};
 }
 
+bool NamedPipeHandleFactory::onConnected() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  assert(_idle > 0);
+  --_idle;
+  return _idle < _pool.minIdle && _instances < _pool.maxInstances;
+}
+
+bool NamedPipeHandleFactory::onDisconnected() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  if (_idle >= _pool.maxIdle) {
+    return false;
+  }
+  ++_idle;
+  return true;
+}
+
+void NamedPipeHandleFactory::onClosed(bool idle) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  assert(_instances > 0);
+  --_instances;
+  if (idle) {
+    assert(_idle > 0);
+    --_idle;
+  }
+  WSUDO_LOG_DEBUG("Pipe pool: {} instances, {} idle.", _instances, _idle);
+}
+
+bool NamedPipeHandleFactory::hasExtraIdle() const {
+  std::lock_guard<std::mutex> lock{_mutex};
+  return _idle > _pool.minIdle;
+}
+
+bool NamedPipeHandleFactory::onIdleTimeout() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  if (_idle <= _pool.minIdle) {
+    return false;
+  }
+  --_idle;
+  return true;
+}
+
+unsigned NamedPipeHandleFactory::instances() const {
+  std::lock_guard<std::mutex> lock{_mutex};
+  return _instances;
+}
+
+unsigned NamedPipeHandleFactory::idle() const {
+  std::lock_guard<std::mutex> lock{_mutex};
+  return _idle;
+}
+
 bool NamedPipeHandleFactory::good() const {
   // _securityAttributes is only set when all initialization succeeded.
   return _securityAttributes.nLength == sizeof(SECURITY_ATTRIBUTES);
@@ -0,0 +1,826 @@
+#include "wsudo/policy.h"
+
+#include <AclAPI.h>
+#include <sddl.h>
+#include <algorithm>
+#include <cstring>
+#include <cwctype>
+#include <mutex>
+
+using namespace wsudo;
+using namespace wsudo::policy;
+
+struct PolicyTable::Header {
+  uint32_t magic;
+  uint32_t sidCount;
+  uint32_t ruleCount;
+  uint32_t size;
+};
+
+struct PolicyTable::SidEntry {
+  // Offsets are from the start of the table.
+  uint32_t sidOffset;
+  uint32_t sidLength;
+  uint32_t firstRule;
+  uint32_t ruleCount;
+};
+
+struct PolicyTable::Rule {
+  uint32_t programHash;
+  uint32_t programOffset;
+  // In characters.
+  uint32_t programLength;
+  uint8_t match;
+  uint8_t effect;
+  uint16_t reserved;
+};
+
+// Helpers {{{
+
+namespace {
+
+constexpr uint32_t TableMagic = 0x54505357; // "WSPT"
+
+// Policy files larger than this are rejected.
+constexpr DWORD MaxPolicyFileSize = 1024 * 1024;
+
+enum Match : uint8_t {
+  MatchExact,
+  // Program is a directory prefix ending in a backslash.
+  MatchDirectory,
+  MatchAny,
+};
+
+enum Effect : uint8_t {
+  EffectAllow,
+  EffectDeny,
+};
+
+struct ParsedRule {
+  std::vector<uint8_t> sid;
+  // Uppercase, so matching is ordinal.
+  std::wstring program;
+  Match match;
+  Effect effect;
+};
+
+uint32_t hashProgram(std::wstring_view program) {
+  // FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (auto c : program) {
+    hash = (hash ^ static_cast<uint16_t>(c)) * 16777619u;
+  }
+  return hash;
+}
+
+// SIDs are ordered by length, then bytes; any fixed order works for lookup.
+int compareSids(const uint8_t *a, size_t aLength, const uint8_t *b,
+                size_t bLength)
+{
+  if (aLength != bLength) {
+    return aLength < bLength ? -1 : 1;
+  }
+  return std::memcmp(a, b, aLength);
+}
+
+bool equalsIgnoreCase(std::wstring_view a, std::wstring_view b) {
+  return CompareStringOrdinal(a.data(), static_cast<int>(a.length()),
+                              b.data(), static_cast<int>(b.length()),
+                              true) == CSTR_EQUAL;
+}
+
+void toUpper(std::wstring &string) {
+  CharUpperBuffW(string.data(), static_cast<DWORD>(string.size()));
+}
+
+// Split a line into whitespace separated tokens. Double quotes group, and #
+// outside quotes starts a comment.
+bool tokenize(std::wstring_view line, std::vector<std::wstring> &tokens) {
+  size_t i = 0;
+  while (i < line.size()) {
+    if (iswspace(line[i])) {
+      ++i;
+      continue;
+    }
+    if (line[i] == L'#') {
+      break;
+    }
+    std::wstring token;
+    bool quoted = false;
+    for (; i < line.size() && (quoted || !iswspace(line[i])); ++i) {
+      if (line[i] == L'"') {
+        quoted = !quoted;
+      } else {
+        token.push_back(line[i]);
+      }
+    }
+    if (quoted) {
+      return false;
+    }
+    tokens.push_back(std::move(token));
+  }
+  return true;
+}
+
+bool resolvePrincipal(std::wstring_view principal, std::vector<uint8_t> &sid,
+                      std::string &error)
+{
+  if (equalsIgnoreCase(principal, L"ALL")) {
+    DWORD length = SECURITY_MAX_SID_SIZE;
+    sid.resize(length);
+    CreateWellKnownSid(WinWorldSid, nullptr, sid.data(), &length);
+    sid.resize(length);
+    return true;
+  }
+
+  std::wstring name{principal};
+  if (name.size() > 4 && equalsIgnoreCase(name.substr(0, 4), L"S-1-")) {
+    HLocalPtr<PSID> parsed;
+    if (!ConvertStringSidToSidW(name.c_str(), &parsed)) {
+      error = "invalid SID '" + to_utf8(name) + "'";
+      return false;
+    }
+    auto bytes = static_cast<const uint8_t *>(static_cast<PSID>(parsed));
+    sid.assign(bytes, bytes + GetLengthSid(parsed));
+    return true;
+  }
+
+  bool isGroup = !name.empty() && name[0] == L'%';
+  if (isGroup) {
+    name.erase(0, 1);
+  }
+  DWORD sidLength = SECURITY_MAX_SID_SIZE;
+  wchar_t domain[256];
+  DWORD domainLength = ARRAYSIZE(domain);
+  SID_NAME_USE use;
+  sid.resize(sidLength);
+  if (!LookupAccountNameW(nullptr, name.c_str(), sid.data(), &sidLength,
+                          domain, &domainLength, &use))
+  {
+    error = "unknown account '" + to_utf8(name) + "'";
+    return false;
+  }
+  sid.resize(sidLength);
+  bool resolvedGroup = use == SidTypeGroup || use == SidTypeAlias ||
+                       use == SidTypeWellKnownGroup;
+  if (isGroup != resolvedGroup) {
+    error = "'" + to_utf8(name) + "' is " +
+            (resolvedGroup ? "a group; write it as %" : "not a group");
+    return false;
+  }
+  return true;
+}
+
+bool parseProgram(std::wstring_view token, ParsedRule &rule,
+                  std::string &error)
+{
+  rule.effect = EffectAllow;
+  if (!token.empty() && token[0] == L'!') {
+    rule.effect = EffectDeny;
+    token.remove_prefix(1);
+  }
+  if (equalsIgnoreCase(token, L"ALL")) {
+    rule.match = MatchAny;
+    return true;
+  }
+
+  rule.program = token;
+  std::replace(rule.program.begin(), rule.program.end(), L'/', L'\\');
+  auto &program = rule.program;
+  bool absolute = (program.size() >= 3 && program[1] == L':' &&
+                   program[2] == L'\\') ||
+                  (program.size() >= 2 && program[0] == L'\\' &&
+                   program[1] == L'\\');
+  if (!absolute) {
+    error = "'" + to_utf8(token) + "' is not a full path";
+    return false;
+  }
+  if (program.size() >= 2 && program.compare(program.size() - 2, 2,
+                                              L"\\*") == 0)
+  {
+    // Keep the backslash so C:\Tools\* doesn't match C:\Toolsmith.
+    program.pop_back();
+    rule.match = MatchDirectory;
+  } else {
+    rule.match = MatchExact;
+  }
+  toUpper(program);
+  return true;
+}
+
+template<typename T>
+void putAt(std::vector<uint8_t> &table, size_t offset, const T &value) {
+  std::memcpy(table.data() + offset, &value, sizeof(T));
+}
+
+// SYSTEM, Administrators and TrustedInstaller, who can already elevate
+// anything, are the only ones trusted with the policy.
+bool isTrustedPrincipal(PSID sid) {
+  if (IsWellKnownSid(sid, WinLocalSystemSid) ||
+      IsWellKnownSid(sid, WinBuiltinAdministratorsSid))
+  {
+    return true;
+  }
+  HLocalPtr<LPWSTR> sidString;
+  return ConvertSidToStringSidW(sid, &sidString) &&
+         !std::wcscmp(sidString, L"S-1-5-80-956008885-3418522649-1831038044-"
+                                 L"1853292631-2271478464");
+}
+
+// Anyone who can change the policy file, or its directory, can elevate
+// anything. Both must be owned by a trusted principal, and their DACLs must
+// not let anyone else write, delete, or change their security. Ownership
+// alone isn't enough: whoever creates the directory can make files saved in
+// it later writable by them.
+bool isTrustedObject(HANDLE object) {
+  // Rights that let a principal change what the server reads: writing the
+  // file or adding to the directory, and taking either over.
+  constexpr ACCESS_MASK WriteAccess =
+    FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_EA | FILE_DELETE_CHILD |
+    DELETE | WRITE_DAC | WRITE_OWNER | GENERIC_WRITE | GENERIC_ALL;
+
+  PSID owner;
+  PACL dacl;
+  HLocalPtr<PSECURITY_DESCRIPTOR> securityDescriptor;
+  if (GetSecurityInfo(object, SE_FILE_OBJECT,
+                      OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+                      &owner, nullptr, &dacl, nullptr,
+                      &securityDescriptor) != ERROR_SUCCESS)
+  {
+    return false;
+  }
+  // A null DACL grants everyone everything.
+  if (!isTrustedPrincipal(owner) || !dacl) {
+    return false;
+  }
+  for (DWORD i = 0; i < dacl->AceCount; ++i) {
+    ACE_HEADER *header;
+    if (!GetAce(dacl, i, reinterpret_cast<LPVOID *>(&header))) {
+      return false;
+    }
+    if (header->AceFlags & INHERIT_ONLY_ACE) {
+      // Only applies to children, which are checked themselves.
+      continue;
+    }
+    switch (header->AceType) {
+    case ACCESS_DENIED_ACE_TYPE:
+    case ACCESS_DENIED_CALLBACK_ACE_TYPE:
+      // Denying never adds access.
+      continue;
+    case ACCESS_ALLOWED_ACE_TYPE:
+    case ACCESS_ALLOWED_CALLBACK_ACE_TYPE: {
+      // Both start with the same fields.
+      auto ace = reinterpret_cast<ACCESS_ALLOWED_ACE *>(header);
+      if ((ace->Mask & WriteAccess) &&
+          !isTrustedPrincipal(reinterpret_cast<PSID>(&ace->SidStart)))
+      {
+        return false;
+      }
+      continue;
+    }
+    default:
+      // Object and compound ACEs have no business on a file; don't guess
+      // what they allow.
+      return false;
+    }
+  }
+  return true;
+}
+
+// The directory part of a path, or "." if it has none.
+std::wstring directoryOf(const std::wstring &path) {
+  auto slash = path.find_last_of(L"\\/");
+  return slash == path.npos ? std::wstring{L"."} : path.substr(0, slash);
+}
+
+bool readPolicyFile(HANDLE file, std::wstring &text) {
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart > MaxPolicyFileSize) {
+    return false;
+  }
+  std::string utf8(static_cast<size_t>(size.QuadPart), '\0');
+  DWORD bytes;
+  if (!ReadFile(file, utf8.data(), static_cast<DWORD>(utf8.size()), &bytes,
+                nullptr))
+  {
+    return false;
+  }
+  utf8.resize(bytes);
+  std::string_view view{utf8};
+  if (view.substr(0, 3) == "\xEF\xBB\xBF") {
+    view.remove_prefix(3);
+  }
+  if (view.empty()) {
+    text.clear();
+    return true;
+  }
+  auto length = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS,
+                                    view.data(), static_cast<int>(view.size()),
+                                    nullptr, 0);
+  if (!length) {
+    return false;
+  }
+  text.resize(length);
+  MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, view.data(),
+                      static_cast<int>(view.size()), text.data(), length);
+  return true;
+}
+
+} // namespace
+
+// }}}
+
+////////////////////////////////////////////////////////////////////////////////
+// PolicyTable                                                                //
+////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<const PolicyTable>
+PolicyTable::compile(std::wstring_view text, std::string &error) {
+  std::vector<ParsedRule> parsed;
+  std::vector<std::wstring> tokens;
+  size_t lineNumber = 0;
+  while (!text.empty()) {
+    ++lineNumber;
+    auto end = text.find(L'\n');
+    auto line = text.substr(0, end);
+    text.remove_prefix(end == text.npos ? text.size() : end + 1);
+
+    tokens.clear();
+    if (!tokenize(line, tokens)) {
+      error = fmt::format("line {}: unterminated quote", lineNumber);
+      return nullptr;
+    }
+    if (tokens.empty()) {
+      continue;
+    }
+    if (tokens.size() != 2) {
+      error = fmt::format("line {}: expected a principal and a program",
+                          lineNumber);
+      return nullptr;
+    }
+    ParsedRule rule;
+    std::string reason;
+    if (!resolvePrincipal(tokens[0], rule.sid, reason) ||
+        !parseProgram(tokens[1], rule, reason))
+    {
+      error = fmt::format("line {}: {}", lineNumber, reason);
+      return nullptr;
+    }
+    parsed.push_back(std::move(rule));
+  }
+
+  std::stable_sort(parsed.begin(), parsed.end(),
+                   [](const ParsedRule &a, const ParsedRule &b) {
+                     return compareSids(a.sid.data(), a.sid.size(),
+                                        b.sid.data(), b.sid.size()) < 0;
+                   });
+
+  // Layout: header, SID index, rules, program strings, SID bytes.
+  size_t sidCount = 0;
+  size_t programChars = 0;
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    if (i == 0 || parsed[i].sid != parsed[i - 1].sid) {
+      ++sidCount;
+    }
+    programChars += parsed[i].program.size();
+  }
+  size_t sidsOffset = sizeof(Header);
+  size_t rulesOffset = sidsOffset + sidCount * sizeof(SidEntry);
+  size_t programsOffset = rulesOffset + parsed.size() * sizeof(Rule);
+  size_t sidBytesOffset = programsOffset + programChars * sizeof(wchar_t);
+  size_t sidBytes = 0;
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    if (i == 0 || parsed[i].sid != parsed[i - 1].sid) {
+      sidBytes += parsed[i].sid.size();
+    }
+  }
+  std::vector<uint8_t> table(sidBytesOffset + sidBytes);
+
+  size_t sidIndex = 0;
+  size_t programOffset = programsOffset;
+  size_t sidOffset = sidBytesOffset;
+  SidEntry entry{};
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    auto &rule = parsed[i];
+    if (i == 0 || rule.sid != parsed[i - 1].sid) {
+      if (i > 0) {
+        putAt(table, sidsOffset + sidIndex++ * sizeof(SidEntry), entry);
+      }
+      std::memcpy(table.data() + sidOffset, rule.sid.data(), rule.sid.size());
+      entry = SidEntry{static_cast<uint32_t>(sidOffset),
+                       static_cast<uint32_t>(rule.sid.size()),
+                       static_cast<uint32_t>(i), 0};
+      sidOffset += rule.sid.size();
+    }
+    ++entry.ruleCount;
+
+    std::memcpy(table.data() + programOffset, rule.program.data(),
+                rule.program.size() * sizeof(wchar_t));
+    putAt(table, rulesOffset + i * sizeof(Rule),
+          Rule{hashProgram(rule.program),
+               static_cast<uint32_t>(programOffset),
+               static_cast<uint32_t>(rule.program.size()),
+               rule.match, rule.effect, 0});
+    programOffset += rule.program.size() * sizeof(wchar_t);
+  }
+  if (!parsed.empty()) {
+    putAt(table, sidsOffset + sidIndex * sizeof(SidEntry), entry);
+  }
+  putAt(table, 0, Header{TableMagic, static_cast<uint32_t>(sidCount),
+                         static_cast<uint32_t>(parsed.size()),
+                         static_cast<uint32_t>(table.size())});
+
+  // Copy it into a pagefile-backed section and keep only a read-only view,
+  // so nothing can scribble on a live table.
+  HObject section{CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr,
+                                     PAGE_READWRITE, 0,
+                                     static_cast<DWORD>(table.size()),
+                                     nullptr)};
+  if (!section) {
+    error = "can't create table section: " + lastErrorString();
+    return nullptr;
+  }
+  {
+    Handle<const void *, UnmapViewOfFile> writeView{
+      MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, table.size())
+    };
+    if (!writeView) {
+      error = "can't map table section: " + lastErrorString();
+      return nullptr;
+    }
+    std::memcpy(const_cast<void *>(static_cast<const void *>(writeView)),
+                table.data(), table.size());
+  }
+  auto view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, table.size());
+  if (!view) {
+    error = "can't map table section: " + lastErrorString();
+    return nullptr;
+  }
+  return std::shared_ptr<const PolicyTable>{new PolicyTable{view}};
+}
+
+const PolicyTable::Header &PolicyTable::header() const {
+  return *reinterpret_cast<const Header *>(bytes());
+}
+
+const PolicyTable::SidEntry *PolicyTable::sids() const {
+  return reinterpret_cast<const SidEntry *>(bytes() + sizeof(Header));
+}
+
+const PolicyTable::Rule *PolicyTable::rules() const {
+  return reinterpret_cast<const Rule *>(sids() + header().sidCount);
+}
+
+size_t PolicyTable::ruleCount() const {
+  return header().ruleCount;
+}
+
+const PolicyTable::SidEntry *PolicyTable::find(PSID sid) const {
+  auto sidBytes = static_cast<const uint8_t *>(sid);
+  auto sidLength = GetLengthSid(sid);
+  auto first = sids();
+  auto last = first + header().sidCount;
+  auto it = std::lower_bound(first, last, 0,
+                             [&](const SidEntry &entry, int) {
+                               return compareSids(bytes() + entry.sidOffset,
+                                                  entry.sidLength, sidBytes,
+                                                  sidLength) < 0;
+                             });
+  if (it == last ||
+      compareSids(bytes() + it->sidOffset, it->sidLength, sidBytes,
+                  sidLength) != 0)
+  {
+    return nullptr;
+  }
+  return it;
+}
+
+Decision PolicyTable::check(const PolicySid *sids, size_t count,
+                            std::wstring_view imagePath) const
+{
+  std::wstring program{imagePath};
+  toUpper(program);
+  auto hash = hashProgram(program);
+
+  bool allowed = false;
+  for (size_t i = 0; i < count; ++i) {
+    auto entry = find(sids[i].sid);
+    if (!entry) {
+      continue;
+    }
+    auto rule = rules() + entry->firstRule;
+    for (auto end = rule + entry->ruleCount; rule != end; ++rule) {
+      std::wstring_view ruleProgram{
+        reinterpret_cast<const wchar_t *>(bytes() + rule->programOffset),
+        rule->programLength
+      };
+      bool matches;
+      switch (rule->match) {
+      case MatchExact:
+        matches = rule->programHash == hash && ruleProgram == program;
+        break;
+      case MatchDirectory:
+        matches = program.size() > ruleProgram.size() &&
+                  std::wstring_view{program}.substr(0, ruleProgram.size()) ==
+                    ruleProgram;
+        break;
+      default:
+        matches = true;
+        break;
+      }
+      if (!matches) {
+        continue;
+      }
+      if (rule->effect == EffectDeny) {
+        return Decision::Deny;
+      }
+      if (!sids[i].denyOnly) {
+        allowed = true;
+      }
+    }
+  }
+  return allowed ? Decision::Allow : Decision::Deny;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Policy                                                                     //
+////////////////////////////////////////////////////////////////////////////////
+
+Policy::Policy(std::wstring path) noexcept
+  : _path{std::move(path)}
+{
+}
+
+std::wstring Policy::defaultPath() {
+  wchar_t path[MAX_PATH];
+  auto length = ExpandEnvironmentStringsW(L"%ProgramData%\\wsudo\\policy.conf",
+                                          path, MAX_PATH);
+  if (!length || length > MAX_PATH) {
+    return std::wstring{L"C:\\ProgramData\\wsudo\\policy.conf"};
+  }
+  return std::wstring{path, length - 1};
+}
+
+bool Policy::createDirectory() {
+  auto directory = directoryOf(_path);
+  // Creating it first keeps anyone else from doing so and giving themselves
+  // write access to what's saved in it. Users may read the policy.
+  HLocalPtr<PSECURITY_DESCRIPTOR> securityDescriptor;
+  if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        L"D:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;OICI;FR;;;BU)",
+        SDDL_REVISION_1, &securityDescriptor, nullptr))
+  {
+    log::error("Can't create policy directory security descriptor: {}",
+               lastErrorString());
+    return false;
+  }
+  SECURITY_ATTRIBUTES securityAttributes{sizeof(SECURITY_ATTRIBUTES),
+                                         securityDescriptor, false};
+  if (CreateDirectoryW(directory.c_str(), &securityAttributes)) {
+    log::info("Created policy directory {}.", to_utf8(directory));
+    return true;
+  }
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    return true;
+  }
+  log::warn("Can't create policy directory {}: {}", to_utf8(directory),
+            lastErrorString());
+  return false;
+}
+
+bool Policy::load() {
+  auto path = to_utf8(_path);
+  HANDLE rawFile = CreateFileW(_path.c_str(), GENERIC_READ | READ_CONTROL,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                 FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                               nullptr);
+  if (rawFile == INVALID_HANDLE_VALUE) {
+    auto error = GetLastError();
+    if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) {
+      if (!_loaded) {
+        log::warn("No policy file at {}; every user who can log on may "
+                  "elevate any program.", path);
+        _loaded = true;
+      } else if (hasTable()) {
+        log::warn("Policy file {} was removed; keeping the current rules.",
+                  path);
+      }
+    } else {
+      log::error("Can't open policy file {}: {}", path,
+                 lastErrorString(error));
+      failClosed();
+    }
+    return false;
+  }
+  HObject file{rawFile};
+
+  auto directoryPath = directoryOf(_path);
+  HANDLE rawDirectory = CreateFileW(directoryPath.c_str(), READ_CONTROL,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                      FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING,
+                                    FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+  HObject directory{rawDirectory == INVALID_HANDLE_VALUE ? nullptr
+                                                         : rawDirectory};
+  if (!directory || !isTrustedObject(directory)) {
+    log::error("Policy directory {} must be owned by, and only writable by, "
+               "SYSTEM or Administrators; ignoring the policy.",
+               to_utf8(directoryPath));
+    failClosed();
+    return false;
+  }
+  if (!isTrustedObject(file)) {
+    log::error("Policy file {} must be owned by, and only writable by, "
+               "SYSTEM or Administrators; ignoring it.", path);
+    failClosed();
+    return false;
+  }
+  std::wstring text;
+  if (!readPolicyFile(file, text)) {
+    log::error("Can't read policy file {}.", path);
+    failClosed();
+    return false;
+  }
+  std::string error;
+  auto table = PolicyTable::compile(text, error);
+  if (!table) {
+    log::error("Policy file {}: {}", path, error);
+    failClosed();
+    return false;
+  }
+  log::info("Loaded {} policy rule(s) from {}.", table->ruleCount(), path);
+  setTable(std::move(table));
+  _loaded = true;
+  return true;
+}
+
+void Policy::setTable(std::shared_ptr<const PolicyTable> table) {
+  std::unique_lock<std::shared_mutex> lock{_mutex};
+  _table.swap(table);
+  // The old table is released outside the lock, unless a check has it.
+  lock.unlock();
+}
+
+bool Policy::hasTable() const {
+  std::shared_lock<std::shared_mutex> lock{_mutex};
+  return _table != nullptr;
+}
+
+void Policy::failClosed() {
+  if (hasTable()) {
+    return;
+  }
+  std::string error;
+  setTable(PolicyTable::compile(std::wstring_view{}, error));
+  _loaded = true;
+}
+
+Decision Policy::check(const PolicySid *sids, size_t count,
+                       std::wstring_view imagePath) const
+{
+  std::shared_ptr<const PolicyTable> table;
+  {
+    std::shared_lock<std::shared_mutex> lock{_mutex};
+    table = _table;
+  }
+  if (!_loaded || table == nullptr) {
+    return _loaded ? Decision::Allow : Decision::Deny;
+  }
+  return table->check(sids, count, imagePath);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PolicyWatchHandler                                                         //
+////////////////////////////////////////////////////////////////////////////////
+
+PolicyWatchHandler::PolicyWatchHandler(Policy &policy) noexcept
+  : _policy{policy},
+    _event{CreateEventW(nullptr, false, false, nullptr)}
+{
+  _overlapped.hEvent = _event;
+  auto &path = policy.path();
+  _policyDirectory = directoryOf(path);
+  auto slash = path.find_last_of(L"\\/");
+  _fileName = slash == path.npos ? path : path.substr(slash + 1);
+  if (open()) {
+    watch();
+  }
+}
+
+PolicyWatchHandler::~PolicyWatchHandler() {
+  // The pending read writes into this object; let it finish first.
+  if (_directory && CancelIoEx(_directory, &_overlapped)) {
+    DWORD bytes;
+    GetOverlappedResult(_directory, &_overlapped, &bytes, true);
+  }
+}
+
+bool PolicyWatchHandler::open() {
+  auto directory = _policyDirectory;
+  _watchName = _fileName;
+  _watchingPolicyDirectory = true;
+  while (true) {
+    // A bare drive needs its root directory's slash.
+    auto openPath = directory.size() == 2 && directory[1] == L':'
+                    ? directory + L'\\'
+                    : directory;
+    HANDLE rawDirectory = CreateFileW(openPath.c_str(), FILE_LIST_DIRECTORY,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                        FILE_SHARE_DELETE,
+                                      nullptr, OPEN_EXISTING,
+                                      FILE_FLAG_BACKUP_SEMANTICS |
+                                        FILE_FLAG_OVERLAPPED,
+                                      nullptr);
+    if (rawDirectory != INVALID_HANDLE_VALUE) {
+      _directory = rawDirectory;
+      break;
+    }
+    auto error = GetLastError();
+    auto slash = directory.find_last_of(L"\\/");
+    if ((error != ERROR_FILE_NOT_FOUND && error != ERROR_PATH_NOT_FOUND) ||
+        slash == directory.npos || slash == 0)
+    {
+      log::warn("Can't watch {} for policy changes: {}",
+                to_utf8(_policyDirectory), lastErrorString(error));
+      _directory = nullptr;
+      return false;
+    }
+    // Wait for the missing directory to be created in its parent.
+    _watchName = directory.substr(slash + 1);
+    _watchingPolicyDirectory = false;
+    directory.resize(slash);
+  }
+  if (!_watchingPolicyDirectory) {
+    log::info("Policy directory {} doesn't exist; watching {} for it.",
+              to_utf8(_policyDirectory), to_utf8(directory));
+  }
+  return true;
+}
+
+bool PolicyWatchHandler::watch() {
+  DWORD filter = _watchingPolicyDirectory
+                 ? FILE_NOTIFY_CHANGE_FILE_NAME |
+                     FILE_NOTIFY_CHANGE_LAST_WRITE |
+                     FILE_NOTIFY_CHANGE_SECURITY
+                 : FILE_NOTIFY_CHANGE_DIR_NAME;
+  if (!ReadDirectoryChangesW(_directory, _changes, sizeof(_changes), false,
+                             filter, nullptr, &_overlapped, nullptr))
+  {
+    log::error("Can't watch for policy changes: {}", lastErrorString());
+    return false;
+  }
+  return true;
+}
+
+events::EventStatus PolicyWatchHandler::operator()(events::EventListener &) {
+  if (!_directory) {
+    return events::EventStatus::Finished;
+  }
+  DWORD bytes;
+  if (!GetOverlappedResult(_directory, &_overlapped, &bytes, false)) {
+    if (GetLastError() == ERROR_IO_INCOMPLETE) {
+      return events::EventStatus::Ok;
+    }
+    log::error("Policy watch failed: {}", lastErrorString());
+    return events::EventStatus::Failed;
+  }
+
+  // No bytes means the change list overflowed; reload to be safe.
+  bool changed = bytes == 0;
+  for (size_t offset = 0; !changed && offset < bytes;) {
+    auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(
+      _changes + offset
+    );
+    std::wstring_view name{info->FileName,
+                           info->FileNameLength / sizeof(wchar_t)};
+    changed = equalsIgnoreCase(name, _watchName);
+    if (!info->NextEntryOffset) {
+      break;
+    }
+    offset += info->NextEntryOffset;
+  }
+
+  if (changed && !_watchingPolicyDirectory) {
+    // A directory on the way to the policy appeared. Move down to it, and
+    // load the policy in case it was created along with it.
+    if (!open() || !watch()) {
+      return events::EventStatus::Failed;
+    }
+    if (_watchingPolicyDirectory) {
+      _policy.load();
+    }
+    return events::EventStatus::Ok;
+  }
+
+  // Queue the next read first so a change during the reload isn't missed.
+  if (!watch()) {
+    return events::EventStatus::Failed;
+  }
+  if (changed) {
+    // The table swaps atomically; requests keep using the old one until
+    // this finishes, or for good if the new text doesn't compile.
+    _policy.load();
+  }
+  return events::EventStatus::Ok;
+}
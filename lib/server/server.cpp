@@ -1,5 +1,9 @@
 #include "wsudo/server.h"
 #include "wsudo/session.h"
+#include "wsudo/metrics.h"
+
+#include <algorithm>
+#include <thread>
 
 #pragma comment(lib, "Advapi32.lib")
 
@@ -9,32 +13,100 @@ using namespace wsudo::server;
 void wsudo::server::serverMain(Config &config) {
   using namespace events;
 
+  // Resolve ntdll up front so handlers never look anything up themselves.
+  if (!nt::loadApi()) {
+    log::warn("Some NT API functions are missing; elevation may fail.");
+  }
+
   session::SessionManager sessionManager{60 * 10};
 
-  NamedPipeHandleFactory pipeHandleFactory{config.pipeName.c_str()};
-  if (!pipeHandleFactory) {
-    config.status = StatusCreatePipeFailed;
-    return;
-  }
+  // Checked on every bless, so it has to be in place before any client is.
+  policy::Policy policy{config.policyPath.empty()
+                          ? policy::Policy::defaultPath()
+                          : config.policyPath};
+  policy.createDirectory();
+  policy.load();
 
-  EventListener listener;
-  *config.quitEvent = CreateEventW(nullptr, true, false, nullptr);
-  listener.emplace(*config.quitEvent, [](EventListener &listener) {
-    listener.stop();
-    return EventStatus::Finished;
-  });
+  EventStatus status;
+  {
+    NamedPipeHandleFactory pipeHandleFactory{config.pipeName.c_str(),
+                                             config.pipePool};
+    if (!pipeHandleFactory) {
+      config.status = StatusCreatePipeFailed;
+      return;
+    }
 
-  for (int id = 1; id <= MaxPipeConnections; ++id) {
-    listener.emplace<ClientConnectionHandler>(pipeHandleFactory(), id,
-                                              sessionManager);
-  }
+    // Shared by all connections; idle ones give their buffers back.
+    BufferPool bufferPool{config.maxMessageSize};
+
+    EventListener listener{EventBackend::CompletionPort,
+                           EventDispatch::Batched};
+    *config.quitEvent = CreateEventW(nullptr, true, false, nullptr);
+    listener.emplace(*config.quitEvent, [](EventListener &listener) {
+      listener.stop();
+      return EventStatus::Finished;
+    });
+
+    listener.emplace<SessionTimerHandler>(sessionManager);
+    listener.emplace<policy::PolicyWatchHandler>(policy);
+
+    // Start with the minimum number of listening instances; handlers add
+    // more as clients connect. The factory's minimum is at least one, even if
+    // the config's isn't.
+    for (unsigned i = 0; i < pipeHandleFactory.pool().minIdle; ++i) {
+      auto pipe = pipeHandleFactory();
+      if (!pipe) {
+        if (i == 0) {
+          config.status = StatusCreatePipeFailed;
+          return;
+        }
+        break;
+      }
+      listener.emplace<ClientConnectionHandler>(
+        std::move(pipe), pipeHandleFactory.nextInstanceId(), listener,
+        pipeHandleFactory, sessionManager, policy, bufferPool
+      );
+    }
+
+    // Clients can connect from here on; they are served once the loop runs.
+    if (config.onListening) {
+      config.onListening();
+    }
 
-  EventStatus status = listener.run();
+    // Adopt the previous instance's sessions before serving anyone, so its
+    // clients don't all log on again.
+    if (auto count = receiveSessions(sessionManager)) {
+      log::info("Resumed {} session(s) from the previous server.", count);
+    }
+    sessionManager.loadLocalDomain();
+    metrics::registerProvider();
+
+    unsigned workers = config.workerThreads;
+    if (workers == 0) {
+      workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    log::info("Running event loop on {} worker thread(s).", workers);
+
+    status = listener.run(INFINITE, workers);
+    // Logons still running wake handlers through the listener.
+    sessionManager.waitForLogons();
+    metrics::unregisterProvider();
+  }
 
   if (status == EventStatus::Failed) {
     config.status = StatusEventFailed;
   } else {
     config.status = StatusOk;
   }
-}
 
+  // The process may end as soon as the service reports stopping, so this
+  // has to happen first.
+  if (auto holder = config.sessionHolder.load()) {
+    holder->handOff(sessionManager);
+  }
+
+  // The pipe instances are closed, so a new server can create them.
+  if (config.onStopped) {
+    config.onStopped();
+  }
+}
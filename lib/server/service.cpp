@@ -0,0 +1,244 @@
+#include "wsudo/server.h"
+
+#include <mutex>
+#include <thread>
+
+using namespace wsudo;
+using namespace wsudo::server;
+
+// Helpers {{{
+
+namespace {
+
+// Wait hints for the SCM, in milliseconds.
+constexpr DWORD StartWaitHint = 5000;
+constexpr DWORD StopWaitHint = 5000;
+
+Config *gs_config = nullptr;
+HANDLE gs_quitEventHandle = nullptr;
+SessionHolder gs_sessionHolder;
+std::thread gs_serverThread;
+
+// Both the control handler and the server thread report status.
+std::mutex gs_statusMutex;
+SERVICE_STATUS_HANDLE gs_statusHandle = nullptr;
+SERVICE_STATUS gs_status{SERVICE_WIN32_OWN_PROCESS};
+
+void reportStatus(DWORD state, DWORD exitCode = NO_ERROR, DWORD waitHint = 0)
+{
+  std::lock_guard<std::mutex> lock{gs_statusMutex};
+  if (!gs_statusHandle || gs_status.dwCurrentState == SERVICE_STOPPED) {
+    return;
+  }
+  gs_status.dwCurrentState = state;
+  gs_status.dwControlsAccepted =
+    state == SERVICE_RUNNING ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN
+                             : 0;
+  if (exitCode == NO_ERROR) {
+    gs_status.dwWin32ExitCode = NO_ERROR;
+  } else {
+    gs_status.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+    gs_status.dwServiceSpecificExitCode = exitCode;
+  }
+  gs_status.dwWaitHint = waitHint;
+  if (state == SERVICE_RUNNING || state == SERVICE_STOPPED) {
+    gs_status.dwCheckPoint = 0;
+  } else {
+    ++gs_status.dwCheckPoint;
+  }
+  SetServiceStatus(gs_statusHandle, &gs_status);
+}
+
+DWORD WINAPI serviceControlHandler(DWORD control, DWORD, LPVOID, LPVOID) {
+  switch (control) {
+  case ServiceControlHandOff:
+    log::info("Received handoff request.");
+    // The handoff pipe has to exist before the SCM can start the next
+    // instance, which it may as soon as this stops.
+    if (gs_sessionHolder.start()) {
+      gs_config->sessionHolder = &gs_sessionHolder;
+    } else {
+      log::warn("Stopping without handing off the sessions.");
+    }
+    [[fallthrough]];
+  case SERVICE_CONTROL_STOP:
+  case SERVICE_CONTROL_SHUTDOWN:
+    reportStatus(SERVICE_STOP_PENDING, NO_ERROR, StopWaitHint);
+    if (gs_quitEventHandle) {
+      SetEvent(gs_quitEventHandle);
+    }
+    return NO_ERROR;
+  case SERVICE_CONTROL_INTERROGATE:
+    return NO_ERROR;
+  default:
+    return ERROR_CALL_NOT_IMPLEMENTED;
+  }
+}
+
+void WINAPI serviceMain(DWORD, LPWSTR *) {
+  gs_statusHandle = RegisterServiceCtrlHandlerExW(ServiceName,
+                                                  serviceControlHandler,
+                                                  nullptr);
+  if (!gs_statusHandle) {
+    log::critical("RegisterServiceCtrlHandlerExW failed: {}",
+                  lastErrorString());
+    return;
+  }
+  reportStatus(SERVICE_START_PENDING, NO_ERROR, StartWaitHint);
+
+  // The SCM only needs ServiceMain to register; the dispatcher returns once
+  // the service reports that it stopped, and runService joins this.
+  gs_serverThread = std::thread{[] {
+    serverMain(*gs_config);
+    // Covers servers that failed before they got to report stopping.
+    reportStatus(SERVICE_STOPPED,
+                 gs_config->status == StatusOk ? NO_ERROR
+                                               : gs_config->status);
+  }};
+}
+
+// Returns the service command line: this executable with --service.
+std::wstring serviceCommandLine() {
+  std::wstring path(MAX_PATH, L'\0');
+  DWORD length;
+  while ((length = GetModuleFileNameW(nullptr, path.data(),
+                                      static_cast<DWORD>(path.size()))) ==
+         path.size())
+  {
+    path.resize(path.size() * 2);
+  }
+  path.resize(length);
+  return L"\"" + path + L"\" --service";
+}
+
+using HService = Handle<SC_HANDLE, CloseServiceHandle>;
+
+HService openService(DWORD access) {
+  HService manager{OpenSCManagerW(nullptr, nullptr, SC_MANAGER_CONNECT)};
+  if (!manager) {
+    log::error("Can't open the service manager: {}", lastErrorString());
+    return HService{};
+  }
+  HService service{OpenServiceW(manager, ServiceName, access)};
+  if (!service) {
+    log::error("Can't open the wsudo service: {}", lastErrorString());
+  }
+  return service;
+}
+
+// Poll until the service reaches state or timeoutMs passes.
+bool waitForState(SC_HANDLE service, DWORD state, DWORD timeoutMs) {
+  auto deadline = GetTickCount64() + timeoutMs;
+  SERVICE_STATUS_PROCESS status;
+  DWORD length;
+  while (QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO,
+                              reinterpret_cast<LPBYTE>(&status),
+                              sizeof(status), &length))
+  {
+    if (status.dwCurrentState == state) {
+      return true;
+    }
+    if (GetTickCount64() >= deadline) {
+      log::error("Timed out waiting for the service.");
+      return false;
+    }
+    Sleep(250);
+  }
+  log::error("Can't query the service: {}", lastErrorString());
+  return false;
+}
+
+} // namespace
+
+// }}}
+
+int wsudo::server::runService(Config &config) {
+  gs_config = &config;
+  config.quitEvent = &gs_quitEventHandle;
+  // Report running as soon as clients can connect; the server finishes
+  // setting up after that.
+  config.onListening = [] { reportStatus(SERVICE_RUNNING); };
+  config.onStopped = [] { reportStatus(SERVICE_STOPPED); };
+
+  SERVICE_TABLE_ENTRYW serviceTable[] = {
+    { const_cast<LPWSTR>(ServiceName), &serviceMain },
+    { nullptr, nullptr },
+  };
+  if (!StartServiceCtrlDispatcherW(serviceTable)) {
+    log::critical("StartServiceCtrlDispatcherW failed: {}",
+                  lastErrorString());
+    return 1;
+  }
+  // May still be returning from serverMain.
+  if (gs_serverThread.joinable()) {
+    gs_serverThread.join();
+  }
+  return config.status == StatusOk ? 0 : 1;
+}
+
+bool wsudo::server::installService() {
+  HService manager{OpenSCManagerW(nullptr, nullptr, SC_MANAGER_CREATE_SERVICE)};
+  if (!manager) {
+    log::error("Can't open the service manager: {}", lastErrorString());
+    return false;
+  }
+  auto commandLine = serviceCommandLine();
+  HService service{CreateServiceW(manager, ServiceName, L"WSudo Token Server",
+                                  SERVICE_CHANGE_CONFIG,
+                                  SERVICE_WIN32_OWN_PROCESS,
+                                  SERVICE_AUTO_START, SERVICE_ERROR_NORMAL,
+                                  commandLine.c_str(), nullptr, nullptr,
+                                  nullptr, nullptr, nullptr)};
+  if (!service) {
+    log::error("Can't create the service: {}", lastErrorString());
+    return false;
+  }
+  SERVICE_DESCRIPTIONW description{
+    const_cast<LPWSTR>(L"Elevates wsudo clients without UAC prompts.")
+  };
+  ChangeServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, &description);
+  log::info("Service installed.");
+  return true;
+}
+
+bool wsudo::server::uninstallService() {
+  auto service = openService(SERVICE_STOP | SERVICE_QUERY_STATUS | DELETE);
+  if (!service) {
+    return false;
+  }
+  SERVICE_STATUS status;
+  if (ControlService(service, SERVICE_CONTROL_STOP, &status)) {
+    waitForState(service, SERVICE_STOPPED, StopWaitHint);
+  }
+  if (!DeleteService(service)) {
+    log::error("Can't delete the service: {}", lastErrorString());
+    return false;
+  }
+  log::info("Service removed.");
+  return true;
+}
+
+bool wsudo::server::restartService() {
+  auto service = openService(SERVICE_START | SERVICE_QUERY_STATUS |
+                             SERVICE_USER_DEFINED_CONTROL);
+  if (!service) {
+    return false;
+  }
+  SERVICE_STATUS status;
+  if (!ControlService(service, ServiceControlHandOff, &status) &&
+      GetLastError() != ERROR_SERVICE_NOT_ACTIVE)
+  {
+    log::error("Can't stop the service: {}", lastErrorString());
+    return false;
+  }
+  // The old instance's holder keeps the sessions for HandoffTimeoutMs after
+  // this.
+  if (!waitForState(service, SERVICE_STOPPED, StopWaitHint) ||
+      !StartServiceW(service, 0, nullptr))
+  {
+    log::error("Can't start the service: {}", lastErrorString());
+    return false;
+  }
+  log::info("Service restarted.");
+  return true;
+}
@@ -1,17 +1,208 @@
 #define WSUDO_NO_NT_API
 #include "wsudo/session.h"
 #include <NTSecAPI.h>
+#include <sddl.h>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 
 #define NT_SUCCESS(status) ((long)(status) >= 0)
 
 using namespace wsudo;
 using namespace wsudo::session;
 
+// Helpers {{{
+
+namespace {
+
+// Returns the token information, or an empty buffer on failure. Vector
+// storage is aligned enough for the TOKEN_* structures.
+std::vector<uint8_t> tokenInformation(HANDLE token,
+                                      TOKEN_INFORMATION_CLASS infoClass)
+{
+  DWORD length = 0;
+  GetTokenInformation(token, infoClass, nullptr, 0, &length);
+  std::vector<uint8_t> buffer(length);
+  if (!length ||
+      !GetTokenInformation(token, infoClass, buffer.data(), length, &length))
+  {
+    buffer.clear();
+  }
+  return buffer;
+}
+
+// Any fixed order works for binary search; this one compares lengths first.
+int compareSids(PSID a, PSID b) {
+  auto aLength = GetLengthSid(a);
+  auto bLength = GetLengthSid(b);
+  if (aLength != bLength) {
+    return aLength < bLength ? -1 : 1;
+  }
+  return std::memcmp(a, b, aLength);
+}
+
+// Ordinal, ignoring case, the way Windows compares account names.
+bool sameName(std::wstring_view a, std::wstring_view b) {
+  return CompareStringOrdinal(a.data(), static_cast<int>(a.length()),
+                              b.data(), static_cast<int>(b.length()),
+                              true) == CSTR_EQUAL;
+}
+
+// True if token is a primary token whose user is the account username and
+// domain name, and which has logonSid as its logon SID if that isn't null.
+// Handed off sessions are checked with this before their handles are
+// trusted.
+bool isHandedOffToken(HANDLE token, const std::wstring &username,
+                      const std::wstring &domain, PSID logonSid)
+{
+  TOKEN_STATISTICS statistics;
+  DWORD length;
+  if (!GetTokenInformation(token, TokenStatistics, &statistics,
+                           sizeof(TOKEN_STATISTICS), &length) ||
+      statistics.TokenType != TokenPrimary)
+  {
+    return false;
+  }
+
+  auto userBuffer = tokenInformation(token, TokenUser);
+  if (userBuffer.empty()) {
+    return false;
+  }
+  auto user = reinterpret_cast<TOKEN_USER *>(userBuffer.data())->User.Sid;
+  auto account = domain.empty() || domain == L"."
+                 ? username
+                 : domain + L"\\" + username;
+  alignas(DWORD) uint8_t accountSid[SECURITY_MAX_SID_SIZE];
+  DWORD accountSidLength = sizeof(accountSid);
+  wchar_t accountDomain[256];
+  DWORD accountDomainLength = ARRAYSIZE(accountDomain);
+  SID_NAME_USE use;
+  if (!LookupAccountNameW(nullptr, account.c_str(), accountSid,
+                          &accountSidLength, accountDomain,
+                          &accountDomainLength, &use) ||
+      !EqualSid(user, accountSid))
+  {
+    return false;
+  }
+
+  if (!logonSid) {
+    return true;
+  }
+  auto groupBuffer = tokenInformation(token, TokenGroups);
+  if (groupBuffer.empty()) {
+    return false;
+  }
+  auto groups = reinterpret_cast<TOKEN_GROUPS *>(groupBuffer.data());
+  for (DWORD i = 0; i < groups->GroupCount; ++i) {
+    if ((groups->Groups[i].Attributes & SE_GROUP_LOGON_ID) &&
+        EqualSid(groups->Groups[i].Sid, logonSid))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Compares every character so the time taken doesn't say how much of a
+// password matched.
+bool samePassword(std::wstring_view a, std::wstring_view b) {
+  if (a.length() != b.length()) {
+    return false;
+  }
+  wchar_t difference = 0;
+  for (size_t i = 0; i < a.length(); ++i) {
+    difference |= a[i] ^ b[i];
+  }
+  return difference == 0;
+}
+
+void erasePassword(std::wstring &password) {
+  SecureZeroMemory(password.data(), password.size() * sizeof(wchar_t));
+  password.clear();
+}
+
+bool luidLess(const LUID &a, const LUID &b) {
+  return a.HighPart != b.HighPart ? a.HighPart < b.HighPart
+                                  : a.LowPart < b.LowPart;
+}
+
+// Builds the state passed between server instances by exportSessions().
+class StateWriter {
+public:
+  template<typename T>
+  void put(const T &value) {
+    putBytes(&value, sizeof(T));
+  }
+
+  void putBytes(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    _data.insert(_data.end(), bytes, bytes + size);
+  }
+
+  void putString(std::wstring_view string) {
+    put(static_cast<uint32_t>(string.size()));
+    putBytes(string.data(), string.size() * sizeof(wchar_t));
+  }
+
+  std::vector<uint8_t> &data() { return _data; }
+
+private:
+  std::vector<uint8_t> _data;
+};
+
+// Reads StateWriter output. Every get fails once the data runs out.
+class StateReader {
+public:
+  StateReader(const uint8_t *data, size_t size) noexcept
+    : _data{data}, _size{size}
+  {}
+
+  template<typename T>
+  bool get(T &value) {
+    return getBytes(&value, sizeof(T));
+  }
+
+  bool getBytes(void *data, size_t size) {
+    if (size > _size - _offset) {
+      return false;
+    }
+    std::memcpy(data, _data + _offset, size);
+    _offset += size;
+    return true;
+  }
+
+  bool getString(std::wstring &string) {
+    uint32_t length;
+    if (!get(length) || length > (_size - _offset) / sizeof(wchar_t)) {
+      return false;
+    }
+    string.resize(length);
+    return getBytes(string.data(), length * sizeof(wchar_t));
+  }
+
+private:
+  const uint8_t *_data;
+  size_t _size;
+  size_t _offset = 0;
+};
+
+} // namespace
+
+// }}}
+
 SessionManager::SessionManager(unsigned defaultTtlSeconds) noexcept
   : _defaultTtlSeconds{defaultTtlSeconds},
+    _tokenTemplate{std::make_shared<const TokenTemplate>()},
     _timer{CreateWaitableTimerW(nullptr, false, nullptr)}
 {
+}
+
+SessionManager::~SessionManager() {
+  // Their callbacks store sessions here.
+  waitForLogons();
+}
+
+void SessionManager::loadLocalDomain() {
   NTSTATUS status;
   LSA_OBJECT_ATTRIBUTES attr{{}};
   Handle<LSA_HANDLE, LsaClose> policy;
@@ -41,64 +232,616 @@ SessionManager::SessionManager(unsigned defaultTtlSeconds) noexcept
             _localDomain);
 }
 
-std::shared_ptr<Session> SessionManager::find(std::wstring_view username,
-                                              std::wstring_view domain)
+std::shared_ptr<Session> SessionManager::find(const SessionKey &key,
+                                              std::wstring_view username)
 {
-  // TODO: Use full user@domain format.
-  (void)domain;
-  auto it = _sessions.find(username);
-  if (it == _sessions.end()) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto slot = _sessions.find(key);
+  // The key only says who is asking; the session must also be for the
+  // account they asked for.
+  if (!slot || !sameName((*slot)->username(), username)) {
+    ++_misses;
     return std::shared_ptr<Session>{};
   }
-  return it->second;
+  auto &session = *slot;
+  if (session->_ttlExpiresAt <= GetTickCount64()) {
+    // The timer hasn't caught up yet.
+    WSUDO_LOG_DEBUG(L"Session for '{}' expired.", session->username());
+    _sessions.erase(key);
+    ++_misses;
+    ++_evictions;
+    return std::shared_ptr<Session>{};
+  }
+  ++_hits;
+  session->touch();
+  return session;
 }
 
-std::shared_ptr<Session> SessionManager::store(Session &&session) {
-  //std::wstring_view domain{session.domain()};
-  std::wstring_view name{session.username()};
+std::shared_ptr<Session> SessionManager::store(const SessionKey &key,
+                                               Session &&session)
+{
   if (!session) {
-    log::info(L"Failed login attempt for {}.", name);
+    log::info(L"Failed login attempt for {}.", session.username());
     return std::shared_ptr<Session>{};
   }
-  log::debug(L"Session username: {}.", name);
-  auto [it, inserted] = _sessions.try_emplace(
-    name, std::make_shared<Session>(std::move(session))
+  session._key = key;
+  if (!session._identity.read(session._token)) {
+    log::error("Couldn't read the session token's groups: {}",
+               lastErrorString());
+    return std::shared_ptr<Session>{};
+  }
+  session.touch();
+  auto ptr = std::make_shared<Session>(std::move(session));
+  WSUDO_LOG_DEBUG(L"Session username: {}.", ptr->username());
+  std::lock_guard<std::mutex> lock{_mutex};
+  _sessions.insert(ptr);
+  armTimer(ptr->_ttlExpiresAt);
+  return ptr;
+}
+
+std::shared_ptr<PendingLogon>
+SessionManager::logon(const SessionKey &key, DWORD processId,
+                      std::wstring_view username, std::wstring_view domain,
+                      std::wstring_view password)
+{
+  std::lock_guard<std::mutex> lock{_logonMutex};
+  for (auto &logon : _logons) {
+    // A different password gets its own logon; it must not be accepted
+    // because someone else typed the right one.
+    if (logon->_key == key && sameName(logon->_username, username) &&
+        sameName(logon->_domain, domain) &&
+        samePassword(logon->_password, password))
+    {
+      WSUDO_LOG_DEBUG(L"Joining logon already running for '{}'.", username);
+      // The same guess only counts once, against the logon that makes it.
+      _throttle.release(key.user(), processId, username, GetTickCount64());
+      return logon;
+    }
+  }
+
+  std::shared_ptr<PendingLogon> logon{
+    new PendingLogon{key, processId, username, domain, password}
+  };
+  auto context = new std::pair<SessionManager *, std::shared_ptr<PendingLogon>>{
+    this, logon
+  };
+  if (!TrySubmitThreadpoolCallback(&SessionManager::logonCallback, context,
+                                   nullptr))
+  {
+    log::error("Couldn't queue logon: {}", lastErrorString());
+    delete context;
+    erasePassword(logon->_password);
+    return std::shared_ptr<PendingLogon>{};
+  }
+  _logons.push_back(std::move(logon));
+  return _logons.back();
+}
+
+void SessionManager::waitForLogons() {
+  std::unique_lock<std::mutex> lock{_logonMutex};
+  _logonsDone.wait(lock, [this] { return _logons.empty(); });
+}
+
+void CALLBACK SessionManager::logonCallback(PTP_CALLBACK_INSTANCE,
+                                            PVOID context)
+{
+  std::unique_ptr<std::pair<SessionManager *, std::shared_ptr<PendingLogon>>>
+    self{
+      static_cast<std::pair<SessionManager *, std::shared_ptr<PendingLogon>> *>(
+        context
+      )
+    };
+  self->first->runLogon(self->second);
+}
+
+void SessionManager::runLogon(const std::shared_ptr<PendingLogon> &logon) {
+  // Only this thread ever changes the password, so reading it unlocked is
+  // fine.
+  auto session = store(logon->_key,
+                       Session(*this, logon->_username, logon->_domain,
+                               logon->_password.c_str()));
+  auto user = logon->_key.user();
+  if (session) {
+    _throttle.succeeded(user, logon->_processId, logon->_username,
+                        GetTickCount64());
+  } else {
+    _throttle.failed(user, logon->_processId, logon->_username,
+                     GetTickCount64());
+  }
+  logon->finish(std::move(session));
+
+  // Until here, clients with the same password could still join and would
+  // see the result right away.
+  std::lock_guard<std::mutex> lock{_logonMutex};
+  erasePassword(logon->_password);
+  _logons.erase(std::find(_logons.begin(), _logons.end(), logon));
+  _logonsDone.notify_all();
+}
+
+void SessionManager::expire() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  // Timers can fire slightly early; don't rearm for a few milliseconds.
+  auto now = GetTickCount64() + 50;
+  ULONGLONG nextDueAt = 0;
+  _sessions.eraseIf(
+    [&](const Session &session) {
+      if (session._ttlExpiresAt > now) {
+        return false;
+      }
+      log::info(L"Session for '{}' expired.", session.username());
+      ++_evictions;
+      return true;
+    },
+    [&](const Session &session) {
+      if (!nextDueAt || session._ttlExpiresAt < nextDueAt) {
+        nextDueAt = session._ttlExpiresAt;
+      }
+    }
   );
-  if (!inserted) {
-    log::warn(L"Session already exists for '{}'.", name);
+
+  _timerDueAt = 0;
+  if (nextDueAt) {
+    armTimer(nextDueAt);
+  } else {
+    CancelWaitableTimer(_timer);
+  }
+}
+
+SessionStats SessionManager::stats() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  return SessionStats{_sessions.size(), _hits, _misses, _evictions};
+}
+
+std::vector<uint8_t> SessionManager::exportSessions(HANDLE process) {
+  StateWriter state;
+  uint32_t count = 0;
+  // Patched once the sessions are counted.
+  state.put(count);
+
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto now = GetTickCount64();
+  _sessions.forEach([&](const Session &session) {
+    if (session._ttlExpiresAt <= now) {
+      return;
+    }
+    HANDLE remoteToken;
+    if (!DuplicateHandle(GetCurrentProcess(), session._token, process,
+                         &remoteToken, 0, false, DUPLICATE_SAME_ACCESS))
+    {
+      log::warn("Couldn't hand off a session token: {}", lastErrorString());
+      return;
+    }
+    auto &key = session._key;
+    state.put(key.logonId.LowPart);
+    state.put(key.logonId.HighPart);
+    state.put(key.sidLength);
+    state.putBytes(key.sid.data(), key.sidLength);
+    state.putString(session._username);
+    state.putString(session._domain);
+    state.put(static_cast<uint64_t>(reinterpret_cast<ULONG_PTR>(remoteToken)));
+    state.put(static_cast<uint32_t>(session._ttlResetSeconds));
+    state.put(static_cast<uint64_t>(session._ttlExpiresAt - now));
+    PSID logonSid = session._pSid;
+    uint32_t logonSidLength = logonSid ? GetLengthSid(logonSid) : 0;
+    state.put(logonSidLength);
+    state.putBytes(logonSid, logonSidLength);
+    ++count;
+  });
+
+  auto &data = state.data();
+  std::memcpy(data.data(), &count, sizeof(count));
+  return std::move(data);
+}
+
+size_t SessionManager::importSessions(const uint8_t *data, size_t size) {
+  StateReader state{data, size};
+  uint32_t count;
+  if (!state.get(count)) {
+    return 0;
+  }
+
+  // Everything is parsed and checked before any of it is used. Handles are
+  // only owned once the whole state checks out; until then a value could
+  // name a handle this process uses for something else.
+  struct Handed {
+    SessionKey key;
+    std::wstring username;
+    std::wstring domain;
+    HANDLE token;
+    uint32_t ttlSeconds;
+    uint64_t remainingMs;
+    uint32_t logonSidLength;
+    alignas(DWORD) uint8_t logonSid[SECURITY_MAX_SID_SIZE];
+  };
+  std::vector<Handed> handed;
+  for (uint32_t i = 0; i < count; ++i) {
+    auto &entry = handed.emplace_back();
+    auto &key = entry.key;
+    uint64_t tokenValue;
+    if (!state.get(key.logonId.LowPart) || !state.get(key.logonId.HighPart) ||
+        !state.get(key.sidLength) || key.sidLength > key.sid.size() ||
+        !state.getBytes(key.sid.data(), key.sidLength) ||
+        !IsValidSid(key.user()) ||
+        GetLengthSid(key.user()) != key.sidLength ||
+        !state.getString(entry.username) || !state.getString(entry.domain) ||
+        !state.get(tokenValue) || !state.get(entry.ttlSeconds) ||
+        !state.get(entry.remainingMs) || !state.get(entry.logonSidLength) ||
+        entry.logonSidLength > SECURITY_MAX_SID_SIZE ||
+        !state.getBytes(entry.logonSid, entry.logonSidLength))
+    {
+      log::error("Handed off session state is malformed; ignoring all of "
+                 "it.");
+      return 0;
+    }
+    entry.token = reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(tokenValue));
+    if (!isHandedOffToken(entry.token, entry.username, entry.domain,
+                          entry.logonSidLength ? entry.logonSid : nullptr))
+    {
+      log::error("Handed off token for '{}' doesn't match its session; "
+                 "ignoring the whole state.", to_utf8(entry.username));
+      return 0;
+    }
+  }
+
+  auto now = GetTickCount64();
+  size_t imported = 0;
+  for (auto &entry : handed) {
+    HObject token{entry.token};
+    // LogonUserExW hands out the logon SID in LocalAlloc memory.
+    HLocalPtr<PSID> logonSid;
+    if (entry.logonSidLength &&
+        (logonSid = LocalAlloc(LMEM_FIXED, entry.logonSidLength)))
+    {
+      std::memcpy(logonSid, entry.logonSid, entry.logonSidLength);
+    }
+
+    Session session{*this, std::move(entry.username), std::move(entry.domain),
+                    std::move(token), std::move(logonSid), entry.ttlSeconds};
+    if (!session) {
+      continue;
+    }
+    session._key = entry.key;
+    if (!session._identity.read(session._token)) {
+      log::error("Couldn't read a handed off token's groups: {}",
+                 lastErrorString());
+      continue;
+    }
+    session._ttlExpiresAt = now + entry.remainingMs;
+    auto ptr = std::make_shared<Session>(std::move(session));
+    WSUDO_LOG_DEBUG(L"Adopted session for '{}'.", ptr->username());
+    std::lock_guard<std::mutex> lock{_mutex};
+    _sessions.insert(ptr);
+    armTimer(ptr->_ttlExpiresAt);
+    ++imported;
+  }
+  return imported;
+}
+
+void SessionManager::armTimer(ULONGLONG dueAt) {
+  if (_timerDueAt && _timerDueAt <= dueAt) {
+    // It will fire soon enough; expire() rearms it for the rest.
+    return;
+  }
+  auto now = GetTickCount64();
+  LARGE_INTEGER dueTime;
+  // Negative means relative, in 100ns units.
+  dueTime.QuadPart = dueAt > now
+    ? -static_cast<LONGLONG>((dueAt - now) * 10000)
+    : -1;
+  if (!SetWaitableTimer(_timer, &dueTime, 0, nullptr, nullptr, false)) {
+    log::error("Couldn't set session timer: {}", lastErrorString());
+    return;
+  }
+  _timerDueAt = dueAt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SessionKey                                                                 //
+////////////////////////////////////////////////////////////////////////////////
+
+bool SessionKey::fromToken(HANDLE token, SessionKey &key) {
+  TOKEN_STATISTICS statistics;
+  DWORD length;
+  if (!GetTokenInformation(token, TokenStatistics, &statistics,
+                           sizeof(TOKEN_STATISTICS), &length))
+  {
+    log::error("Couldn't read token statistics: {}", lastErrorString());
+    return false;
+  }
+  alignas(TOKEN_USER)
+    uint8_t buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+  if (!GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &length))
+  {
+    log::error("Couldn't read token user: {}", lastErrorString());
+    return false;
+  }
+  auto sid = reinterpret_cast<TOKEN_USER *>(buffer)->User.Sid;
+  key.logonId = statistics.AuthenticationId;
+  key.sidLength = static_cast<uint8_t>(GetLengthSid(sid));
+  std::memcpy(key.sid.data(), sid, key.sidLength);
+  return true;
+}
+
+uint64_t SessionKey::hash() const {
+  // The LUID is unique per logon and the last sub-authority is the user's
+  // RID; together they spread keys well. Finish with a 64 bit mixer.
+  uint64_t h = (static_cast<uint64_t>(logonId.HighPart) << 32) |
+               logonId.LowPart;
+  uint32_t rid = 0;
+  if (sidLength >= sizeof(uint32_t)) {
+    std::memcpy(&rid, sid.data() + sidLength - sizeof(uint32_t),
+                sizeof(uint32_t));
+  }
+  h ^= (static_cast<uint64_t>(rid) << 8) | sidLength;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+bool SessionKey::operator==(const SessionKey &other) const {
+  return logonId.LowPart == other.logonId.LowPart &&
+         logonId.HighPart == other.logonId.HighPart &&
+         sidLength == other.sidLength &&
+         !std::memcmp(sid.data(), other.sid.data(), sidLength);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PendingLogon                                                               //
+////////////////////////////////////////////////////////////////////////////////
+
+bool PendingLogon::notify(const void *owner, std::function<void()> wake) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  if (done()) {
+    return false;
+  }
+  _waiters.emplace_back(owner, std::move(wake));
+  return true;
+}
+
+void PendingLogon::cancel(const void *owner) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  _waiters.erase(std::remove_if(_waiters.begin(), _waiters.end(),
+                                [owner](const auto &waiter) {
+                                  return waiter.first == owner;
+                                }),
+                 _waiters.end());
+}
+
+void PendingLogon::finish(std::shared_ptr<Session> session) {
+  // Waking under the lock means a waiter is never woken after cancel()
+  // returns.
+  std::lock_guard<std::mutex> lock{_mutex};
+  _session = std::move(session);
+  _done.store(true, std::memory_order_release);
+  for (auto &waiter : _waiters) {
+    waiter.second();
+  }
+  _waiters.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TokenIdentity                                                              //
+////////////////////////////////////////////////////////////////////////////////
+
+bool TokenIdentity::read(HANDLE token) {
+  auto userBuffer = tokenInformation(token, TokenUser);
+  auto groupBuffer = tokenInformation(token, TokenGroups);
+  auto privilegeBuffer = tokenInformation(token, TokenPrivileges);
+  if (userBuffer.empty() || groupBuffer.empty() || privilegeBuffer.empty()) {
+    return false;
+  }
+  auto &user = reinterpret_cast<TOKEN_USER *>(userBuffer.data())->User;
+  auto groups = reinterpret_cast<TOKEN_GROUPS *>(groupBuffer.data());
+  auto privileges =
+    reinterpret_cast<TOKEN_PRIVILEGES *>(privilegeBuffer.data());
+
+  // Copy every SID into one buffer first, so the pointers into it are final.
+  std::vector<const SID_AND_ATTRIBUTES *> kept{&user};
+  size_t dataLength = GetLengthSid(user.Sid);
+  for (DWORD i = 0; i < groups->GroupCount; ++i) {
+    auto attributes = groups->Groups[i].Attributes;
+    if (attributes & (SE_GROUP_ENABLED | SE_GROUP_USE_FOR_DENY_ONLY)) {
+      kept.push_back(&groups->Groups[i]);
+      dataLength += GetLengthSid(groups->Groups[i].Sid);
+    }
+  }
+  _sidData.resize(dataLength);
+  _sids.clear();
+  size_t offset = 0;
+  for (auto sid : kept) {
+    auto length = GetLengthSid(sid->Sid);
+    std::memcpy(_sidData.data() + offset, sid->Sid, length);
+    _sids.push_back(policy::PolicySid{
+      _sidData.data() + offset,
+      !!(sid->Attributes & SE_GROUP_USE_FOR_DENY_ONLY)
+    });
+    offset += length;
+  }
+  std::sort(_sids.begin(), _sids.end(),
+            [](const policy::PolicySid &a, const policy::PolicySid &b) {
+              return compareSids(a.sid, b.sid) < 0;
+            });
+
+  _privileges.assign(privileges->Privileges,
+                     privileges->Privileges + privileges->PrivilegeCount);
+  std::sort(_privileges.begin(), _privileges.end(),
+            [](const LUID_AND_ATTRIBUTES &a, const LUID_AND_ATTRIBUTES &b) {
+              return luidLess(a.Luid, b.Luid);
+            });
+
+  wchar_t name[256];
+  wchar_t domain[256];
+  DWORD nameLength = ARRAYSIZE(name);
+  DWORD domainLength = ARRAYSIZE(domain);
+  SID_NAME_USE use;
+  if (LookupAccountSidW(nullptr, user.Sid, name, &nameLength, domain,
+                        &domainLength, &use))
+  {
+    _accountName = std::wstring{domain, domainLength} + L"\\" +
+                   std::wstring{name, nameLength};
+  } else {
+    HLocalPtr<LPWSTR> sidString;
+    if (ConvertSidToStringSidW(user.Sid, &sidString)) {
+      _accountName = static_cast<LPWSTR>(sidString);
+    }
+  }
+  return true;
+}
+
+bool TokenIdentity::isMember(PSID sid) const {
+  auto it = std::lower_bound(_sids.begin(), _sids.end(), sid,
+                             [](const policy::PolicySid &entry, PSID sid) {
+                               return compareSids(entry.sid, sid) < 0;
+                             });
+  return it != _sids.end() && compareSids(it->sid, sid) == 0 &&
+         !it->denyOnly;
+}
+
+bool TokenIdentity::hasPrivilege(const LUID &privilege) const {
+  auto it = std::lower_bound(_privileges.begin(), _privileges.end(), privilege,
+                             [](const LUID_AND_ATTRIBUTES &entry,
+                                const LUID &privilege) {
+                               return luidLess(entry.Luid, privilege);
+                             });
+  return it != _privileges.end() &&
+         it->Luid.LowPart == privilege.LowPart &&
+         it->Luid.HighPart == privilege.HighPart;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SessionTable                                                               //
+////////////////////////////////////////////////////////////////////////////////
+
+SessionTable::SessionTable()
+  : _slots(16)
+{
+}
+
+std::shared_ptr<Session> *SessionTable::find(const SessionKey &key) {
+  auto &slot = _slots[probe(key, key.hash())];
+  return slot.session ? &slot.session : nullptr;
+}
+
+void SessionTable::insert(std::shared_ptr<Session> session) {
+  // Keep the load under 3/4 so probe runs stay short.
+  if ((_count + 1) * 4 > _slots.size() * 3) {
+    grow();
+  }
+  auto hash = session->key().hash();
+  auto &slot = _slots[probe(session->key(), hash)];
+  if (!slot.session) {
+    ++_count;
+  }
+  slot.hash = hash;
+  slot.session = std::move(session);
+}
+
+void SessionTable::erase(const SessionKey &key) {
+  auto index = probe(key, key.hash());
+  if (_slots[index].session) {
+    eraseAt(index);
+  }
+}
+
+size_t SessionTable::probe(const SessionKey &key, uint64_t hash) const {
+  auto index = static_cast<size_t>(hash) & mask();
+  while (true) {
+    auto &slot = _slots[index];
+    if (!slot.session ||
+        (slot.hash == hash && slot.session->key() == key))
+    {
+      return index;
+    }
+    index = (index + 1) & mask();
+  }
+}
+
+void SessionTable::grow() {
+  std::vector<Slot> old(_slots.size() * 2);
+  old.swap(_slots);
+  for (auto &slot : old) {
+    if (slot.session) {
+      auto index = static_cast<size_t>(slot.hash) & mask();
+      while (_slots[index].session) {
+        index = (index + 1) & mask();
+      }
+      _slots[index] = std::move(slot);
+    }
+  }
+}
+
+void SessionTable::eraseAt(size_t index) {
+  _slots[index] = Slot{};
+  --_count;
+  auto hole = index;
+  auto next = (index + 1) & mask();
+  while (_slots[next].session) {
+    // An entry can fill the hole if its home slot isn't between the hole
+    // and where it is now.
+    auto home = static_cast<size_t>(_slots[next].hash) & mask();
+    if (((next - home) & mask()) >= ((next - hole) & mask())) {
+      _slots[hole] = std::move(_slots[next]);
+      _slots[next] = Slot{};
+      hole = next;
+    }
+    next = (next + 1) & mask();
   }
-  return it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Session                                                                    //
 ////////////////////////////////////////////////////////////////////////////////
 
-Session::Session(const SessionManager &, std::wstring_view username,
-                 std::wstring_view domain, std::wstring &&password,
+Session::Session(const SessionManager &manager, std::wstring_view username,
+                 std::wstring_view domain, const wchar_t *password,
                  unsigned ttlSeconds) noexcept
   : _username{username},
     _domain{domain},
     _ttlResetSeconds{ttlSeconds},
-    _ttlExpiresSeconds{0}
+    _ttlExpiresAt{0}
 {
   PVOID pProfileBuffer;
   DWORD profileLength;
   QUOTA_LIMITS quotaLimits;
-  if (!LogonUserExW(_username.c_str(), _domain.c_str(), password.c_str(),
+  if (!LogonUserExW(_username.c_str(), _domain.c_str(), password,
                     LOGON32_LOGON_NETWORK, LOGON32_PROVIDER_DEFAULT,
                     &_token, &_pSid, &pProfileBuffer, &profileLength,
                     &quotaLimits))
   {
-    log::debug("LogonUserExW failed: {}", lastErrorString());
+    WSUDO_LOG_DEBUG("LogonUserExW failed: {}", lastErrorString());
+    return;
   }
 
-  // TODO: Set expiration time.
+  createTokenPool(manager);
 }
 
 Session::Session(const SessionManager &manager, std::wstring_view username,
-                 std::wstring_view domain, std::wstring &&password) noexcept
-  : Session(manager, username, domain, std::move(password),
+                 std::wstring_view domain, const wchar_t *password) noexcept
+  : Session(manager, username, domain, password,
             manager.defaultTtlSeconds())
 {
 }
+
+Session::Session(const SessionManager &manager, std::wstring username,
+                 std::wstring domain, HObject token, HLocalPtr<PSID> logonSid,
+                 unsigned ttlSeconds) noexcept
+  : _username{std::move(username)},
+    _domain{std::move(domain)},
+    _token{std::move(token)},
+    _pSid{std::move(logonSid)},
+    _ttlResetSeconds{ttlSeconds},
+    _ttlExpiresAt{0}
+{
+  createTokenPool(manager);
+}
+
+void Session::createTokenPool(const SessionManager &manager) {
+  if (*manager.tokenTemplate()) {
+    _tokenPool = std::make_shared<TokenPool>(manager.tokenTemplate());
+    // Have tokens ready by the time the client asks for one.
+    _tokenPool->refill();
+  }
+}
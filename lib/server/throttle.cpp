@@ -0,0 +1,176 @@
+#include "wsudo/throttle.h"
+
+#include <algorithm>
+
+using namespace wsudo;
+using namespace wsudo::session;
+
+ULONGLONG LogonThrottle::check(PSID user, DWORD processId,
+                               std::wstring_view account, ULONGLONG now)
+{
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto allKeys = keys(user, processId, account);
+  ULONGLONG wait = 0;
+  for (auto &key : allKeys) {
+    auto entry = find(key, now);
+    if (!entry) {
+      continue;
+    }
+    if (entry->blockedUntil > now) {
+      wait = std::max(wait, entry->blockedUntil - now);
+    } else if (entry->inFlight >= std::max(entry->tokens, 1u)) {
+      // Every failure left is spoken for by an attempt in flight. Those end
+      // within moments, so there's no real deadline to give.
+      wait = std::max(wait, BaseBackoffMs);
+    }
+  }
+  if (wait) {
+    return wait;
+  }
+  for (auto &key : allKeys) {
+    ++use(key, now).inFlight;
+  }
+  return 0;
+}
+
+void LogonThrottle::failed(PSID user, DWORD processId,
+                           std::wstring_view account, ULONGLONG now)
+{
+  std::lock_guard<std::mutex> lock{_mutex};
+  for (auto &key : keys(user, processId, account)) {
+    auto &entry = use(key, now);
+    if (entry.inFlight) {
+      --entry.inFlight;
+    }
+    charge(entry, now);
+  }
+}
+
+void LogonThrottle::succeeded(PSID user, DWORD processId,
+                              std::wstring_view account, ULONGLONG now)
+{
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto allKeys = keys(user, processId, account);
+  // The account's own entry says how many of the user's and process's
+  // failures were for this account; failures for other accounts stay.
+  unsigned forgiven = 0;
+  if (auto entry = find(allKeys[2], now)) {
+    forgiven = Burst - entry->tokens;
+    entry->tokens = Burst;
+    entry->strikes = 0;
+    entry->blockedUntil = 0;
+    endAttempt(*entry);
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    auto entry = find(allKeys[i], now);
+    if (!entry) {
+      continue;
+    }
+    entry->tokens = std::min(entry->tokens + forgiven, Burst);
+    if (entry->tokens == Burst) {
+      entry->strikes = 0;
+      entry->blockedUntil = 0;
+    }
+    endAttempt(*entry);
+  }
+}
+
+void LogonThrottle::release(PSID user, DWORD processId,
+                            std::wstring_view account, ULONGLONG now)
+{
+  std::lock_guard<std::mutex> lock{_mutex};
+  for (auto &key : keys(user, processId, account)) {
+    if (auto entry = find(key, now)) {
+      endAttempt(*entry);
+    }
+  }
+}
+
+size_t LogonThrottle::size() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  return _entries.size();
+}
+
+LogonThrottle::Keys LogonThrottle::keys(PSID user, DWORD processId,
+                                        std::wstring_view account)
+{
+  // The prefixes keep the kinds of keys apart. SIDs carry their own length,
+  // so the account name can follow one directly.
+  auto sidLength = GetLengthSid(user);
+  Keys keys{std::string{'U'}, std::string{'P'}, std::string{'A'}};
+  keys[0].append(static_cast<const char *>(user), sidLength);
+  keys[1].append(reinterpret_cast<const char *>(&processId), sizeof(DWORD));
+
+  // Account names compare ignoring case, like Windows does.
+  std::wstring upper{account};
+  CharUpperBuffW(upper.data(), static_cast<DWORD>(upper.size()));
+  keys[2].append(static_cast<const char *>(user), sidLength);
+  keys[2].append(reinterpret_cast<const char *>(upper.data()),
+                 upper.size() * sizeof(wchar_t));
+  return keys;
+}
+
+LogonThrottle::Entry *LogonThrottle::find(const std::string &key,
+                                          ULONGLONG now)
+{
+  auto it = _index.find(key);
+  if (it == _index.end()) {
+    return nullptr;
+  }
+  auto &entry = *it->second;
+  if (entry.tokens < Burst && now > entry.refilledAt) {
+    auto refills = (now - entry.refilledAt) / RefillMs;
+    if (refills >= Burst - entry.tokens) {
+      // A full bucket forgives the backoff too.
+      entry.tokens = Burst;
+      entry.strikes = 0;
+    } else {
+      entry.tokens += static_cast<unsigned>(refills);
+      entry.refilledAt += refills * RefillMs;
+    }
+  }
+  return &entry;
+}
+
+LogonThrottle::Entry &LogonThrottle::use(const std::string &key,
+                                         ULONGLONG now)
+{
+  if (find(key, now)) {
+    _entries.splice(_entries.begin(), _entries, _index[key]);
+    return _entries.front();
+  }
+  if (_capacity && _entries.size() >= _capacity) {
+    _index.erase(_entries.back().key);
+    _entries.pop_back();
+  }
+  _entries.push_front(Entry{key});
+  _index.emplace(key, _entries.begin());
+  return _entries.front();
+}
+
+void LogonThrottle::endAttempt(Entry &entry) {
+  if (entry.inFlight) {
+    --entry.inFlight;
+  }
+  if (!entry.inFlight && entry.tokens == Burst) {
+    auto it = _index.find(entry.key);
+    auto position = it->second;
+    _index.erase(it);
+    _entries.erase(position);
+  }
+}
+
+void LogonThrottle::charge(Entry &entry, ULONGLONG now) {
+  if (entry.tokens == Burst) {
+    // Refilling starts with the first failure.
+    entry.refilledAt = now;
+  }
+  if (entry.tokens) {
+    --entry.tokens;
+  }
+  if (!entry.tokens) {
+    auto shift = std::min(entry.strikes++, 20u);
+    auto backoff = std::min(BaseBackoffMs << shift, MaxBackoffMs);
+    entry.blockedUntil = now + backoff;
+  }
+}
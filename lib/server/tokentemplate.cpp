@@ -0,0 +1,123 @@
+#include "wsudo/tokentemplate.h"
+
+#include <AclAPI.h>
+
+using namespace wsudo;
+using namespace wsudo::session;
+
+TokenTemplate::TokenTemplate() noexcept {
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_READ,
+                        &_token))
+  {
+    log::error("Couldn't open server process token: {}", lastErrorString());
+    return;
+  }
+
+  PSID ownerSid;
+  PSID groupSid;
+  PACL dacl;
+  PACL sacl;
+  auto error = GetSecurityInfo(_token, SE_KERNEL_OBJECT,
+                               DACL_SECURITY_INFORMATION |
+                                 SACL_SECURITY_INFORMATION |
+                                 GROUP_SECURITY_INFORMATION |
+                                 OWNER_SECURITY_INFORMATION,
+                               &ownerSid, &groupSid, &dacl, &sacl,
+                               &_security);
+  if (error != ERROR_SUCCESS) {
+    log::error("Couldn't get token security info: {}",
+               lastErrorString(error));
+    _token = nullptr;
+  }
+}
+
+HObject TokenTemplate::duplicate() const {
+  SECURITY_ATTRIBUTES secAttr;
+  secAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
+  secAttr.bInheritHandle = true;
+  secAttr.lpSecurityDescriptor = _security;
+
+  HObject newToken;
+  if (!DuplicateTokenEx(_token, MAXIMUM_ALLOWED, &secAttr,
+                        SecurityImpersonation, TokenPrimary, &newToken))
+  {
+    log::error("Couldn't duplicate token: {}", lastErrorString());
+  }
+  return newToken;
+}
+
+TokenPool::TokenPool(std::shared_ptr<const TokenTemplate> tokenTemplate,
+                     unsigned capacity) noexcept
+  : _template{std::move(tokenTemplate)},
+    _capacity{capacity}
+{
+  _tokens.reserve(capacity);
+}
+
+HObject TokenPool::take() {
+  HObject token;
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!_tokens.empty()) {
+      token = std::move(_tokens.back());
+      _tokens.pop_back();
+    }
+  }
+  refill();
+  if (!token) {
+    WSUDO_LOG_DEBUG("Token pool empty; duplicating inline.");
+    token = _template->duplicate();
+  }
+  return token;
+}
+
+void TokenPool::refill() {
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_refilling || _tokens.size() >= _capacity) {
+      return;
+    }
+    _refilling = true;
+  }
+
+  // The callback owns a reference so the pool outlives it, even if its
+  // session expires first.
+  auto context = new std::shared_ptr<TokenPool>{shared_from_this()};
+  if (!TrySubmitThreadpoolCallback(&TokenPool::refillCallback, context,
+                                   nullptr))
+  {
+    log::warn("Couldn't queue token pool refill: {}", lastErrorString());
+    delete context;
+    std::lock_guard<std::mutex> lock{_mutex};
+    _refilling = false;
+  }
+}
+
+void CALLBACK TokenPool::refillCallback(PTP_CALLBACK_INSTANCE,
+                                        PVOID context)
+{
+  std::unique_ptr<std::shared_ptr<TokenPool>> self{
+    static_cast<std::shared_ptr<TokenPool> *>(context)
+  };
+  (*self)->fill();
+}
+
+void TokenPool::fill() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      if (_tokens.size() >= _capacity) {
+        _refilling = false;
+        return;
+      }
+    }
+    // Duplicate outside the lock so take() never waits on it.
+    auto token = _template->duplicate();
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!token) {
+      _refilling = false;
+      return;
+    }
+    _tokens.push_back(std::move(token));
+  }
+}
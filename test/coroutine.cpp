@@ -0,0 +1,96 @@
+#include "wsudo/coroutine.h"
+
+#include <catch.hpp>
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using namespace wsudo;
+using namespace wsudo::events;
+
+namespace {
+
+const wchar_t *const CoroutinePipeName = L"\\\\.\\pipe\\wsudo_test_coroutine";
+
+class EchoHandler : public EventCoroutineHandler {
+public:
+  EchoHandler(HANDLE pipe, BufferPool &pool, std::string &received)
+    : EventCoroutineHandler{true, pool}, _pipe{pipe}, _received{received}
+  {}
+
+protected:
+  HANDLE fileHandle() const override { return _pipe; }
+
+  EventTask run() override {
+    if (co_await connect() != EventStatus::Finished) {
+      co_return EventStatus::Failed;
+    }
+    if (co_await read() != EventStatus::Finished) {
+      co_return EventStatus::Failed;
+    }
+    _received.assign(reinterpret_cast<const char *>(_buffer.data()),
+                     _buffer.size());
+    _buffer.resize(4);
+    std::memcpy(_buffer.data(), "pong", 4);
+    co_return co_await write();
+  }
+
+private:
+  HObject _pipe;
+  std::string &_received;
+};
+
+} // namespace
+
+TEST_CASE("Coroutine arena reuses its space", "[coroutine]") {
+  CoroutineArena arena;
+  void *first = arena.allocate(100);
+  REQUIRE(first != nullptr);
+  void *second = arena.allocate(100);
+  REQUIRE(second != nullptr);
+  REQUIRE(second != first);
+  REQUIRE(arena.allocate(CoroutineArena::Size) == nullptr);
+  arena.deallocate(second);
+  arena.deallocate(first);
+  REQUIRE(arena.allocate(100) == first);
+}
+
+TEST_CASE("Coroutine handlers connect, read and write", "[coroutine]") {
+  auto backend = GENERATE(EventBackend::WaitMultiple,
+                          EventBackend::CompletionPort);
+  BufferPool pool;
+  EventListener listener{backend};
+  std::string received;
+
+  HANDLE pipe = CreateNamedPipeW(CoroutinePipeName,
+                                 PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                 PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE,
+                                 1, PipeBufferSize, PipeBufferSize, 0,
+                                 nullptr);
+  REQUIRE(pipe != INVALID_HANDLE_VALUE);
+  listener.emplace<EchoHandler>(pipe, pool, received);
+
+  char response[8]{};
+  DWORD responseSize = 0;
+  std::thread client{[&] {
+    WaitNamedPipeW(CoroutinePipeName, NMPWAIT_WAIT_FOREVER);
+    HObject file{CreateFileW(CoroutinePipeName, GENERIC_READ | GENERIC_WRITE,
+                             0, nullptr, OPEN_EXISTING, 0, nullptr)};
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    SetNamedPipeHandleState(file, &mode, nullptr, nullptr);
+    DWORD bytes;
+    WriteFile(file, "ping", 4, &bytes, nullptr);
+    ReadFile(file, response, sizeof(response), &responseSize, nullptr);
+  }};
+
+  for (int i = 0; i < 16 && listener.count(); ++i) {
+    listener.next(5000);
+  }
+  client.join();
+
+  REQUIRE(listener.count() == 0);
+  REQUIRE(received == "ping");
+  REQUIRE(std::string_view{response, responseSize} == "pong");
+}
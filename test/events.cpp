@@ -44,3 +44,289 @@ TEST_CASE("EventListener chooses correctly.", "[events]") {
   REQUIRE(listener.next() == EventStatus::Finished);
   REQUIRE(timerNr == 1);
 }
+
+TEST_CASE("Completion port listener dispatches in signal order.", "[events]") {
+  using namespace wsudo::events;
+
+  EventListener listener{EventBackend::CompletionPort};
+  FILETIME systemTime;
+  int timerNr = 0;
+
+  GetSystemTimeAsFileTime(&systemTime);
+
+  auto addTimer = [&](int id, long duration) {
+    HANDLE timer = CreateWaitableTimerW(nullptr, true, nullptr);
+
+    union {
+      FILETIME fileTime;
+      LARGE_INTEGER dueTime;
+    };
+    fileTime = systemTime;
+    dueTime.QuadPart += duration * 10000;
+
+    SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, false);
+
+    listener.emplace(timer, [id, &timerNr](EventListener &){
+      timerNr = id;
+      return EventStatus::Finished;
+    });
+  };
+
+  addTimer(1, 60);
+  addTimer(2, 20);
+  addTimer(3, 40);
+
+  REQUIRE(listener.next() == EventStatus::Ok);
+  REQUIRE(timerNr == 2);
+  REQUIRE(listener.next() == EventStatus::Ok);
+  REQUIRE(timerNr == 3);
+  REQUIRE(listener.next() == EventStatus::Finished);
+  REQUIRE(timerNr == 1);
+}
+
+TEST_CASE("Completion port listener is not limited to MAXIMUM_WAIT_OBJECTS.",
+          "[events]")
+{
+  using namespace wsudo::events;
+
+  constexpr int handlerCount = MAXIMUM_WAIT_OBJECTS * 2;
+  EventListener listener{EventBackend::CompletionPort};
+  int called = 0;
+
+  for (int i = 0; i < handlerCount; ++i) {
+    listener.emplace(CreateEventW(nullptr, true, true, nullptr),
+                     [&called](EventListener &) {
+                       ++called;
+                       return EventStatus::Finished;
+                     });
+  }
+  REQUIRE(listener.count() == handlerCount);
+
+  while (listener.next(1000) == EventStatus::Ok) {
+  }
+  REQUIRE(called == handlerCount);
+  REQUIRE(listener.count() == 0);
+}
+
+TEST_CASE("EventListener handler IDs stay valid across removals.",
+          "[events]")
+{
+  using namespace wsudo::events;
+
+  EventListener listener;
+  int last = 0;
+  auto add = [&](int nr) {
+    return listener.emplace(CreateEventW(nullptr, true, false, nullptr),
+                            [nr, &last](EventListener &) {
+                              last = nr;
+                              return EventStatus::Finished;
+                            }).key();
+  };
+
+  auto first = add(1);
+  auto second = add(2);
+  auto third = add(3);
+  REQUIRE(first != 0);
+  REQUIRE(listener.contains(second));
+
+  // Removing from the middle moves the last handler into its place.
+  REQUIRE(listener.wake(second));
+  REQUIRE(listener.next() == EventStatus::Ok);
+  REQUIRE(last == 2);
+  REQUIRE_FALSE(listener.contains(second));
+  REQUIRE_FALSE(listener.wake(second));
+  REQUIRE(listener.contains(first));
+  REQUIRE(listener.contains(third));
+
+  REQUIRE(listener.wake(third));
+  REQUIRE(listener.next() == EventStatus::Ok);
+  REQUIRE(last == 3);
+
+  // The freed slot is reused under a new ID.
+  auto fourth = add(4);
+  REQUIRE(fourth != second);
+  REQUIRE(fourth != third);
+  REQUIRE(listener.contains(fourth));
+  REQUIRE(listener.count() == 2);
+}
+
+TEST_CASE("Batched dispatch runs every ready handler per wake.", "[events]") {
+  using namespace wsudo::events;
+
+  EventListener listener{EventBackend::WaitMultiple, EventDispatch::Batched};
+  int busy = 0;
+  int others = 0;
+
+  // Always signaled and first in the list, so it would win every wait if
+  // only one handler ran per wake.
+  listener.emplace(CreateEventW(nullptr, true, true, nullptr),
+                   [&busy](EventListener &) {
+                     ++busy;
+                     return EventStatus::Ok;
+                   });
+  for (int i = 0; i < 4; ++i) {
+    listener.emplace(CreateEventW(nullptr, true, true, nullptr),
+                     [&others](EventListener &) {
+                       ++others;
+                       return EventStatus::Finished;
+                     });
+  }
+
+  REQUIRE(listener.next() == EventStatus::Ok);
+  REQUIRE(busy == 1);
+  REQUIRE(others == 4);
+  REQUIRE(listener.count() == 1);
+}
+
+TEST_CASE("Completion port listener runs handlers on several workers.",
+          "[events]")
+{
+  using namespace wsudo::events;
+
+  constexpr int handlerCount = 256;
+  EventListener listener{EventBackend::CompletionPort};
+  std::atomic<int> called = 0;
+
+  for (int i = 0; i < handlerCount; ++i) {
+    listener.emplace(CreateEventW(nullptr, true, true, nullptr),
+                     [&called](EventListener &) {
+                       ++called;
+                       return EventStatus::Finished;
+                     });
+  }
+
+  REQUIRE(listener.run(5000, 4) == EventStatus::Finished);
+  REQUIRE(called == handlerCount);
+  REQUIRE(listener.count() == 0);
+}
+
+TEST_CASE("Timer wheel fires timers in deadline order.", "[events]") {
+  using namespace wsudo::events;
+
+  uint64_t now = 1000;
+  TimerWheel wheel{now};
+  std::vector<TimerWheel::Expired> expired;
+
+  auto soon = wheel.arm(now, 25, 1);
+  auto later = wheel.arm(now, 5000, 2);
+  auto canceled = wheel.arm(now, 100, 3);
+  // Far enough to live in the third level.
+  wheel.arm(now, 10 * 60 * 1000, 4);
+  REQUIRE(wheel.size() == 4);
+  REQUIRE(wheel.msUntilNext(now) <= 30);
+
+  REQUIRE(wheel.cancel(canceled));
+  REQUIRE_FALSE(wheel.cancel(canceled));
+
+  wheel.advance(now + 20, expired);
+  REQUIRE(expired.empty());
+
+  wheel.advance(now + 30, expired);
+  REQUIRE(expired.size() == 1);
+  REQUIRE(expired[0].first == soon);
+  REQUIRE(expired[0].second == 1);
+  REQUIRE_FALSE(wheel.cancel(soon));
+
+  expired.clear();
+  wheel.advance(now + 4990, expired);
+  REQUIRE(expired.empty());
+  wheel.advance(now + 5000, expired);
+  REQUIRE(expired.size() == 1);
+  REQUIRE(expired[0].first == later);
+
+  expired.clear();
+  wheel.advance(now + 10 * 60 * 1000 - 10, expired);
+  REQUIRE(expired.empty());
+  wheel.advance(now + 10 * 60 * 1000, expired);
+  REQUIRE(expired.size() == 1);
+  REQUIRE(expired[0].second == 4);
+  REQUIRE(wheel.size() == 0);
+  REQUIRE(wheel.msUntilNext(now) == UINT64_MAX);
+}
+
+TEST_CASE("Timer wheel fires timers due on a cascade tick on time.",
+          "[events]")
+{
+  using namespace wsudo::events;
+
+  TimerWheel wheel{0};
+  std::vector<TimerWheel::Expired> expired;
+
+  // Tick 64 is in the second level until the wheel cascades it down on tick
+  // 64 itself.
+  auto id = wheel.arm(0, 64 * TimerWheel::TickMs, 1);
+  wheel.advance(63 * TimerWheel::TickMs, expired);
+  REQUIRE(expired.empty());
+  wheel.advance(64 * TimerWheel::TickMs, expired);
+  REQUIRE(expired.size() == 1);
+  REQUIRE(expired[0].first == id);
+}
+
+TEST_CASE("EventListener timeouts don't fail the wait.", "[events]") {
+  using namespace wsudo::events;
+
+  // Never signaled; only the timeout runs it.
+  struct TimeoutHandler final : EventHandler {
+    wsudo::HObject _event{CreateEventW(nullptr, false, false, nullptr)};
+    int &_timedOut;
+
+    explicit TimeoutHandler(int &timedOut) : _timedOut{timedOut} {}
+
+    HANDLE event() const override { return _event; }
+    EventStatus operator()(EventListener &) override {
+      return EventStatus::Failed;
+    }
+    EventStatus timeout(EventListener &, TimerId) override {
+      ++_timedOut;
+      return EventStatus::Finished;
+    }
+  };
+
+  for (auto backend : {EventBackend::WaitMultiple,
+                       EventBackend::CompletionPort})
+  {
+    EventListener listener{backend};
+    int timedOut = 0;
+    auto &handler = listener.emplace<TimeoutHandler>(timedOut);
+    auto canceled = listener.setTimeout(handler, 20);
+    listener.setTimeout(handler, 40);
+    REQUIRE(listener.cancelTimeout(canceled));
+
+    REQUIRE(listener.run(5000) == EventStatus::Finished);
+    REQUIRE(timedOut == 1);
+  }
+}
+
+TEST_CASE("Buffer pool reuses buffers and enforces its limit.", "[events]") {
+  using namespace wsudo::events;
+
+  BufferPool pool{4 * BufferPool::MinBufferSize};
+  REQUIRE(pool.maxMessageSize() == 4 * BufferPool::MinBufferSize);
+
+  {
+    IOBuffer buffer{pool};
+    REQUIRE(buffer.capacity() == 0);
+    REQUIRE(buffer.resize(10));
+    REQUIRE(buffer.capacity() == BufferPool::MinBufferSize);
+    buffer.data()[0] = 42;
+
+    // Growing keeps the contents.
+    REQUIRE(buffer.resize(BufferPool::MinBufferSize + 1));
+    REQUIRE(buffer.capacity() == 2 * BufferPool::MinBufferSize);
+    REQUIRE(buffer.data()[0] == 42);
+
+    REQUIRE_FALSE(buffer.resize(pool.maxMessageSize() + 1));
+    REQUIRE(buffer.size() == BufferPool::MinBufferSize + 1);
+  }
+
+  // Once warm, taking the same sizes again doesn't allocate.
+  auto allocations = pool.allocations();
+  for (int i = 0; i < 100; ++i) {
+    IOBuffer buffer{pool};
+    REQUIRE(buffer.resize(10));
+    REQUIRE(buffer.resize(BufferPool::MinBufferSize + 1));
+    buffer.release();
+    REQUIRE(buffer.capacity() == 0);
+  }
+  REQUIRE(pool.allocations() == allocations);
+}
@@ -0,0 +1,75 @@
+#include "wsudo/message.h"
+
+#include <catch.hpp>
+
+#include <cstring>
+
+using namespace wsudo;
+
+TEST_CASE("Message frames round trip", "[message]") {
+  std::vector<char> buffer;
+  auto process = reinterpret_cast<HANDLE>(uintptr_t{0x1234});
+  auto size = msg::FrameWriter{buffer, msg::client::CredentialBless}
+    .handle(process)
+    .string(L"user")
+    .string(L"hunter2")
+    .finish();
+  REQUIRE(size == buffer.size());
+
+  msg::FrameReader frame{buffer.data(), buffer.size()};
+  REQUIRE(frame.valid());
+  REQUIRE(frame.is(msg::client::CredentialBless));
+  REQUIRE_FALSE(frame.is(msg::client::Credential));
+
+  HANDLE handle;
+  std::wstring_view username;
+  std::wstring_view password;
+  REQUIRE(frame.handle(handle));
+  REQUIRE(frame.string(username));
+  REQUIRE(frame.string(password));
+  REQUIRE(frame.atEnd());
+  REQUIRE(handle == process);
+  REQUIRE(username == L"user");
+  REQUIRE(password == L"hunter2");
+  // Strings are used in place, so they have to be terminated.
+  REQUIRE(password.data()[password.length()] == 0);
+  REQUIRE_FALSE(frame.string(username));
+}
+
+TEST_CASE("Malformed message frames are rejected", "[message]") {
+  std::vector<char> buffer;
+  msg::FrameWriter{buffer, msg::client::Credential}
+    .string(L"user")
+    .string(L"password")
+    .finish();
+
+  SECTION("Truncated frame") {
+    msg::FrameReader frame{buffer.data(), buffer.size() - 2};
+    REQUIRE_FALSE(frame.valid());
+  }
+
+  SECTION("Unknown version") {
+    buffer[4] = 2;
+    msg::FrameReader frame{buffer.data(), buffer.size()};
+    REQUIRE_FALSE(frame.valid());
+  }
+
+  SECTION("String longer than the frame") {
+    uint32_t count = 100;
+    std::memcpy(buffer.data() + sizeof(msg::FrameHeader), &count,
+                sizeof(uint32_t));
+    msg::FrameReader frame{buffer.data(), buffer.size()};
+    REQUIRE(frame.valid());
+    std::wstring_view username;
+    REQUIRE_FALSE(frame.string(username));
+  }
+
+  SECTION("Embedded NUL") {
+    // Replace the 's' in "user".
+    auto chars = buffer.data() + sizeof(msg::FrameHeader) + sizeof(uint32_t);
+    std::memset(chars + sizeof(wchar_t), 0, sizeof(wchar_t));
+    msg::FrameReader frame{buffer.data(), buffer.size()};
+    std::wstring_view username;
+    REQUIRE_FALSE(frame.string(username));
+  }
+}
@@ -0,0 +1,88 @@
+#include "wsudo/pathsearch.h"
+
+#include <catch.hpp>
+
+#include <shellapi.h>
+#pragma comment(lib, "Shell32.lib")
+
+using namespace wsudo;
+
+static void touch(const std::wstring &path) {
+  CloseHandle(CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+}
+
+TEST_CASE("Command line arguments round trip", "[pathsearch]") {
+  const wchar_t *args[] = {
+    L"plain", L"two words", L"", L"quote\"inside", L"trailing\\",
+    L"C:\\Program Files\\", L"back\\\\\"slash", L"\ttab",
+  };
+  auto commandLine = buildCommandLine(L"C:\\Some Dir\\tool.exe", 8,
+                                      const_cast<wchar_t **>(args));
+
+  int argc;
+  HLocalPtr<LPWSTR *> argv{CommandLineToArgvW(commandLine.c_str(), &argc)};
+  REQUIRE(argc == 9);
+  auto parsed = static_cast<LPWSTR *>(argv);
+  REQUIRE(std::wstring_view{parsed[0]} == L"C:\\Some Dir\\tool.exe");
+  for (int i = 0; i < 8; ++i) {
+    REQUIRE(std::wstring_view{parsed[i + 1]} == args[i]);
+  }
+}
+
+TEST_CASE("CommandResolver searches PATH and caches results",
+          "[pathsearch]")
+{
+  wchar_t tempPath[MAX_PATH];
+  REQUIRE(GetTempPathW(MAX_PATH, tempPath));
+  auto root = std::wstring{tempPath} + L"wsudo-pathsearch-" +
+              std::to_wstring(GetCurrentProcessId());
+  auto first = root + L"\\first";
+  auto second = root + L"\\second";
+  auto cache = root + L"\\commands.cache";
+  CreateDirectoryW(root.c_str(), nullptr);
+  CreateDirectoryW(first.c_str(), nullptr);
+  CreateDirectoryW(second.c_str(), nullptr);
+  WSUDO_SCOPEEXIT {
+    DeleteFileW((first + L"\\tool.com").c_str());
+    DeleteFileW((second + L"\\tool.exe").c_str());
+    DeleteFileW(cache.c_str());
+    RemoveDirectoryW(first.c_str());
+    RemoveDirectoryW(second.c_str());
+    RemoveDirectoryW(root.c_str());
+  };
+  auto path = first + L";\"" + second + L"\";" + root + L"\\missing";
+
+  touch(second + L"\\tool.exe");
+  {
+    CommandResolver resolver{path, L".COM;.EXE", cache};
+    REQUIRE(resolver.resolve(L"tool") == second + L"\\tool.exe");
+    REQUIRE(resolver.resolve(L"TOOL.EXE") == second + L"\\tool.exe");
+    REQUIRE(resolver.resolve(L"nothere").empty());
+    REQUIRE(resolver.save());
+  }
+
+  SECTION("Cached entries are reused") {
+    CommandResolver resolver{path, L".COM;.EXE", cache};
+    REQUIRE(resolver.resolve(L"tool") == second + L"\\tool.exe");
+  }
+
+  SECTION("A new file earlier in PATH invalidates the cache") {
+    touch(first + L"\\tool.com");
+    CommandResolver resolver{path, L".COM;.EXE", cache};
+    REQUIRE(resolver.resolve(L"tool") == first + L"\\tool.com");
+  }
+
+  SECTION("PATHEXT order decides between extensions") {
+    touch(second + L"\\tool.com");
+    WSUDO_SCOPEEXIT { DeleteFileW((second + L"\\tool.com").c_str()); };
+    CommandResolver resolver{path, L".EXE;.COM", cache};
+    REQUIRE(resolver.resolve(L"tool") == second + L"\\tool.exe");
+  }
+
+  SECTION("Paths are not searched for") {
+    CommandResolver resolver{path, L".COM;.EXE", cache};
+    REQUIRE(resolver.resolve(second + L"\\tool") == second + L"\\tool.exe");
+    REQUIRE(resolver.resolve(first + L"\\tool").empty());
+  }
+}
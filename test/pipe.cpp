@@ -16,6 +16,44 @@ TEST_CASE("Named pipe handle factory works", "[pipe]") {
   REQUIRE(secondHandle != nullptr);
 }
 
+TEST_CASE("Named pipe pool stays between its watermarks", "[pipe]") {
+  server::PipePoolConfig pool;
+  pool.minIdle = 1;
+  pool.maxIdle = 2;
+  pool.maxInstances = 3;
+  server::NamedPipeHandleFactory factory(TestPipeName, pool);
+  REQUIRE(factory.good());
+
+  auto first = factory();
+  REQUIRE(first != nullptr);
+  REQUIRE(factory.instances() == 1);
+  REQUIRE(factory.idle() == 1);
+
+  // The only listening instance was taken, so the pool should grow.
+  REQUIRE(factory.onConnected());
+  auto second = factory();
+  REQUIRE(second != nullptr);
+  REQUIRE(factory.idle() == 1);
+
+  REQUIRE(factory.onConnected());
+  auto third = factory();
+  REQUIRE(third != nullptr);
+  REQUIRE(factory.instances() == 3);
+
+  // At the instance limit; no more growth.
+  REQUIRE_FALSE(factory.onConnected());
+  REQUIRE(factory() == nullptr);
+  REQUIRE(factory.idle() == 0);
+
+  // Clients leave: two instances go back to listening, the third is closed.
+  REQUIRE(factory.onDisconnected());
+  REQUIRE(factory.onDisconnected());
+  REQUIRE_FALSE(factory.onDisconnected());
+  factory.onClosed(false);
+  REQUIRE(factory.instances() == 2);
+  REQUIRE(factory.idle() == 2);
+}
+
 #if 0
 TEST_CASE("Named pipe client connections work", "[pipe]") {
   server::NamedPipeHandleFactory factory(TestPipeName);
@@ -0,0 +1,127 @@
+#include "wsudo/policy.h"
+
+#include <catch.hpp>
+
+#include <sddl.h>
+
+using namespace wsudo;
+using namespace wsudo::policy;
+
+namespace {
+
+// Owns SIDs parsed from strings for the length of a test.
+struct TestSids {
+  std::vector<HLocalPtr<PSID>> owned;
+  std::vector<PolicySid> sids;
+
+  void add(const wchar_t *sidString, bool denyOnly = false) {
+    PSID sid;
+    REQUIRE(ConvertStringSidToSidW(sidString, &sid));
+    owned.emplace_back(sid);
+    sids.push_back(PolicySid{sid, denyOnly});
+  }
+};
+
+const wchar_t *const Alice = L"S-1-5-21-1-2-3-1001";
+const wchar_t *const Bob = L"S-1-5-21-1-2-3-1002";
+const wchar_t *const Operators = L"S-1-5-21-1-2-3-2001";
+
+} // namespace
+
+TEST_CASE("Policy tables compile and check rules", "[policy]") {
+  std::string error;
+  auto table = PolicyTable::compile(
+    L"# Alice may run anything in Tools, except the shell.\n"
+    L"S-1-5-21-1-2-3-1001 C:\\Tools\\*\n"
+    L"S-1-5-21-1-2-3-1001 !c:/tools/shell.exe\n"
+    L"\n"
+    L"S-1-5-21-1-2-3-2001 \"C:\\Program Files\\app.exe\"  # operators\n"
+    L"ALL C:\\Windows\\System32\\whoami.exe\n",
+    error
+  );
+  REQUIRE(table);
+  REQUIRE(table->ruleCount() == 4);
+
+  TestSids alice;
+  alice.add(Alice);
+  TestSids bob;
+  bob.add(Bob);
+  bob.add(Operators);
+  TestSids denyOnlyOperator;
+  denyOnlyOperator.add(Bob);
+  denyOnlyOperator.add(Operators, true);
+
+  auto check = [&](TestSids &subject, const wchar_t *program) {
+    return table->check(subject.sids.data(), subject.sids.size(), program);
+  };
+
+  REQUIRE(check(alice, L"C:\\TOOLS\\build.exe") == Decision::Allow);
+  REQUIRE(check(alice, L"C:\\Tools\\nested\\build.exe") == Decision::Allow);
+  REQUIRE(check(alice, L"C:\\Tools\\shell.exe") == Decision::Deny);
+  REQUIRE(check(alice, L"C:\\Toolsmith\\build.exe") == Decision::Deny);
+  REQUIRE(check(alice, L"C:\\Program Files\\app.exe") == Decision::Deny);
+
+  REQUIRE(check(bob, L"C:\\Program Files\\app.exe") == Decision::Allow);
+  REQUIRE(check(bob, L"C:\\Tools\\build.exe") == Decision::Deny);
+  REQUIRE(check(denyOnlyOperator, L"C:\\Program Files\\app.exe") ==
+          Decision::Deny);
+
+  // Everyone is in every token, so ALL rules come through that SID.
+  TestSids everyone;
+  everyone.add(Bob);
+  everyone.add(L"S-1-1-0");
+  REQUIRE(check(everyone, L"C:\\Windows\\System32\\whoami.exe") ==
+          Decision::Allow);
+}
+
+TEST_CASE("An empty policy denies everything", "[policy]") {
+  std::string error;
+  auto table = PolicyTable::compile(L"", error);
+  REQUIRE(table);
+  TestSids alice;
+  alice.add(Alice);
+  REQUIRE(table->check(alice.sids.data(), alice.sids.size(),
+                       L"C:\\Tools\\build.exe") == Decision::Deny);
+}
+
+TEST_CASE("Policy errors name the line", "[policy]") {
+  std::string error;
+  REQUIRE_FALSE(PolicyTable::compile(L"\nS-1-5-21-1-2-3-1001\n", error));
+  REQUIRE(error.find("line 2") != std::string::npos);
+  REQUIRE_FALSE(PolicyTable::compile(L"S-1-5-21-1-2-3-1001 tool.exe", error));
+  REQUIRE(error.find("full path") != std::string::npos);
+  REQUIRE_FALSE(PolicyTable::compile(L"\"ALL C:\\x.exe", error));
+  REQUIRE(error.find("quote") != std::string::npos);
+}
+
+TEST_CASE("A policy file that appears later and fails to load denies "
+          "everything", "[policy]")
+{
+  wchar_t tempPath[MAX_PATH];
+  REQUIRE(GetTempPathW(MAX_PATH, tempPath));
+  auto path = std::wstring{tempPath} + L"wsudo-policy-" +
+              std::to_wstring(GetCurrentProcessId()) + L".conf";
+  DeleteFileW(path.c_str());
+  WSUDO_SCOPEEXIT { DeleteFileW(path.c_str()); };
+
+  TestSids alice;
+  alice.add(Alice);
+  Policy policy{path};
+  REQUIRE_FALSE(policy.load());
+  REQUIRE(policy.check(alice.sids.data(), alice.sids.size(),
+                       L"C:\\Tools\\build.exe") == Decision::Allow);
+
+  // Doesn't compile. Its directory is writable by the user running the test,
+  // so it isn't trusted either; both fail closed.
+  HANDLE rawFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr,
+                               CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  REQUIRE(rawFile != INVALID_HANDLE_VALUE);
+  HObject file{rawFile};
+  DWORD written;
+  REQUIRE(WriteFile(file, "ALL tool.exe\n", 13, &written, nullptr));
+  file = nullptr;
+
+  REQUIRE_FALSE(policy.load());
+  REQUIRE(policy.check(alice.sids.data(), alice.sids.size(),
+                       L"C:\\Tools\\build.exe") == Decision::Deny);
+}
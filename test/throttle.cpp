@@ -0,0 +1,142 @@
+#include "wsudo/throttle.h"
+
+#include <catch.hpp>
+
+using namespace wsudo;
+using session::LogonThrottle;
+
+static std::vector<uint8_t> wellKnownSid(WELL_KNOWN_SID_TYPE type) {
+  std::vector<uint8_t> sid(SECURITY_MAX_SID_SIZE);
+  DWORD length = static_cast<DWORD>(sid.size());
+  REQUIRE(CreateWellKnownSid(type, nullptr, sid.data(), &length));
+  sid.resize(length);
+  return sid;
+}
+
+TEST_CASE("Logon throttle backs off after a burst of failures",
+          "[throttle]")
+{
+  auto sid = wellKnownSid(WinWorldSid);
+  PSID user = sid.data();
+  LogonThrottle throttle;
+  ULONGLONG now = 1000000;
+
+  for (unsigned i = 0; i < LogonThrottle::Burst - 1; ++i) {
+    REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+    throttle.failed(user, 1, L"alice", now);
+  }
+  REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+  throttle.failed(user, 1, L"alice", now);
+  REQUIRE(throttle.check(user, 1, L"alice", now) ==
+          LogonThrottle::BaseBackoffMs);
+
+  // Each failure after that doubles the wait.
+  now += LogonThrottle::BaseBackoffMs;
+  REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+  throttle.failed(user, 1, L"alice", now);
+  REQUIRE(throttle.check(user, 1, L"alice", now) ==
+          2 * LogonThrottle::BaseBackoffMs);
+
+  SECTION("Another process of the same user is refused too") {
+    REQUIRE(throttle.check(user, 2, L"alice", now) ==
+            2 * LogonThrottle::BaseBackoffMs);
+  }
+
+  SECTION("The process is refused as another user too") {
+    auto otherSid = wellKnownSid(WinLocalSid);
+    REQUIRE(throttle.check(otherSid.data(), 1, L"alice", now) ==
+            2 * LogonThrottle::BaseBackoffMs);
+  }
+
+  SECTION("A full bucket forgives the backoff") {
+    now += LogonThrottle::Burst * LogonThrottle::RefillMs;
+    throttle.failed(user, 1, L"alice", now);
+    REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+  }
+
+  SECTION("A successful logon forgives the failures") {
+    throttle.succeeded(user, 1, L"ALICE", now);
+    REQUIRE(throttle.size() == 0);
+    REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+  }
+}
+
+TEST_CASE("Logon throttle forgets the least recently failed clients",
+          "[throttle]")
+{
+  auto sid = wellKnownSid(WinWorldSid);
+  PSID user = sid.data();
+  LogonThrottle throttle{4};
+
+  for (unsigned i = 0; i < LogonThrottle::Burst; ++i) {
+    throttle.failed(user, 1, L"alice", 1000);
+  }
+  REQUIRE(throttle.check(user, 1, L"alice", 1000) != 0);
+  REQUIRE(throttle.size() == 3);
+
+  // Every failure refreshes the user and account, so only processes get
+  // evicted.
+  for (DWORD processId = 2; processId < 10; ++processId) {
+    throttle.failed(user, processId, L"alice", 1000);
+    REQUIRE(throttle.size() <= 4);
+  }
+  REQUIRE(throttle.check(user, 100, L"alice", 1000) != 0);
+  REQUIRE(throttle.check(wellKnownSid(WinLocalSid).data(), 1, L"alice",
+                         1000) == 0);
+}
+
+TEST_CASE("Logon throttle counts attempts in flight", "[throttle]") {
+  auto sid = wellKnownSid(WinWorldSid);
+  PSID user = sid.data();
+  LogonThrottle throttle;
+  ULONGLONG now = 1000000;
+
+  // Parallel connections can't start more logons than the bucket has
+  // failures left.
+  for (DWORD processId = 1; processId <= LogonThrottle::Burst; ++processId) {
+    REQUIRE(throttle.check(user, processId, L"alice", now) == 0);
+  }
+  REQUIRE(throttle.check(user, 100, L"alice", now) != 0);
+
+  throttle.release(user, 1, L"alice", now);
+  REQUIRE(throttle.check(user, 100, L"alice", now) == 0);
+
+  for (DWORD processId = 2; processId <= LogonThrottle::Burst; ++processId) {
+    throttle.release(user, processId, L"alice", now);
+  }
+  throttle.release(user, 100, L"alice", now);
+  REQUIRE(throttle.size() == 0);
+}
+
+TEST_CASE("Logging on only forgives failures for the same account",
+          "[throttle]")
+{
+  auto sid = wellKnownSid(WinWorldSid);
+  PSID user = sid.data();
+  LogonThrottle throttle;
+  ULONGLONG now = 1000000;
+
+  auto fail = [&](std::wstring_view account) {
+    REQUIRE(throttle.check(user, 1, account, now) == 0);
+    throttle.failed(user, 1, account, now);
+  };
+
+  // Guessing someone else's password, then logging on as yourself, doesn't
+  // reset the count.
+  for (unsigned i = 0; i < LogonThrottle::Burst - 1; ++i) {
+    fail(L"bob");
+  }
+  REQUIRE(throttle.check(user, 1, L"alice", now) == 0);
+  throttle.succeeded(user, 1, L"alice", now);
+  fail(L"bob");
+  REQUIRE(throttle.check(user, 1, L"bob", now) ==
+          LogonThrottle::BaseBackoffMs);
+  REQUIRE(throttle.check(user, 1, L"alice", now) ==
+          LogonThrottle::BaseBackoffMs);
+
+  // Logging on as bob forgives bob's failures, which were all of them.
+  now += LogonThrottle::BaseBackoffMs;
+  REQUIRE(throttle.check(user, 1, L"bob", now) == 0);
+  throttle.succeeded(user, 1, L"bob", now);
+  REQUIRE(throttle.size() == 0);
+}
@@ -1,4 +1,5 @@
 #include "wsudo/wsudo.h"
+#include "wsudo/session.h"
 #include <catch.hpp>
 
 TEST_CASE("LogonUser", "[.logon]") {
@@ -33,3 +34,69 @@ TEST_CASE("LogonUser", "[.logon]") {
   }
   REQUIRE(!!token);
 }
+
+TEST_CASE("TokenIdentity reads the process token", "[session]") {
+  using namespace wsudo;
+
+  HObject token;
+  REQUIRE(OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token));
+  session::TokenIdentity identity;
+  REQUIRE(identity.read(token));
+  REQUIRE(identity.userSid() != nullptr);
+  REQUIRE(!identity.accountName().empty());
+
+  // Every token has Everyone, and the user counts as a member of itself.
+  alignas(SID) uint8_t everyone[SECURITY_MAX_SID_SIZE];
+  DWORD length = sizeof(everyone);
+  REQUIRE(CreateWellKnownSid(WinWorldSid, nullptr, everyone, &length));
+  REQUIRE(identity.isMember(everyone));
+  REQUIRE(identity.isMember(identity.userSid()));
+
+  alignas(SID) uint8_t nobody[SECURITY_MAX_SID_SIZE];
+  length = sizeof(nobody);
+  REQUIRE(CreateWellKnownSid(WinNullSid, nullptr, nobody, &length));
+  REQUIRE_FALSE(identity.isMember(nobody));
+
+  // Every process token has SeChangeNotifyPrivilege.
+  LUID changeNotify;
+  REQUIRE(LookupPrivilegeValueW(nullptr, SE_CHANGE_NOTIFY_NAME,
+                                &changeNotify));
+  REQUIRE(identity.hasPrivilege(changeNotify));
+}
+
+TEST_CASE("Logons run on the thread pool and wake their waiters",
+          "[session]")
+{
+  using namespace wsudo;
+
+  session::SessionManager manager{60};
+  HObject token;
+  REQUIRE(OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token));
+  session::SessionKey key;
+  REQUIRE(session::SessionKey::fromToken(token, key));
+
+  auto logon = manager.logon(key, GetCurrentProcessId(), L"wsudo-nobody",
+                             L".", L"wrong");
+  REQUIRE(logon);
+  // A different password never shares a logon.
+  auto other = manager.logon(key, GetCurrentProcessId(), L"wsudo-nobody",
+                              L".", L"other");
+  REQUIRE(other);
+  REQUIRE(other != logon);
+
+  HObject event{CreateEventW(nullptr, true, false, nullptr)};
+  HANDLE eventHandle = event;
+  if (logon->notify(&event, [eventHandle] { SetEvent(eventHandle); })) {
+    REQUIRE(WaitForSingleObject(event, 30000) == WAIT_OBJECT_0);
+  }
+  REQUIRE(logon->done());
+  REQUIRE(logon->session() == nullptr);
+  REQUIRE_FALSE(logon->notify(&event, [] {}));
+
+  manager.waitForLogons();
+  REQUIRE(other->done());
+  REQUIRE(manager.stats().sessions == 0);
+  // Both failures were charged to this process, user, and the account it
+  // tried.
+  REQUIRE(manager.throttle().size() == 3);
+}